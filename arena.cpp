@@ -0,0 +1,67 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "arena.h"
+
+#define ARENA_ALIGN 64
+
+int arena_init(struct arena *a, size_t size) {
+    memset(a, 0, sizeof(*a));
+    size = (size + 4095) & ~(size_t)4095;
+
+    // MAP_POPULATE so the pages are resident before the first frame;
+    // otherwise the first pass over the scratch would page-fault.
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (MAP_FAILED == p) {
+        perror("arena mmap");
+        return -1;
+    }
+    a->base = (uint8_t *)p;
+    a->size = size;
+    return 0;
+}
+
+void arena_free(struct arena *a) {
+    if (a->base)
+        munmap(a->base, a->size);
+    memset(a, 0, sizeof(*a));
+}
+
+void *arena_alloc(struct arena *a, size_t n) {
+    size_t off = (a->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (off > a->size || n > a->size - off)
+        return NULL;
+    a->used = off + n;
+    if (a->used > a->peak)
+        a->peak = a->used;
+    return a->base + off;
+}
+
+size_t arena_mark(const struct arena *a) {
+    return a->used;
+}
+
+void arena_rewind(struct arena *a, size_t mark) {
+    if (mark <= a->used)
+        a->used = mark;
+}
@@ -0,0 +1,43 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bump allocator for per-session scratch memory. The whole region is
+// reserved and faulted in once at stream start; frame processing carves
+// buffers out of it and rewinds to a mark afterwards, so the steady state
+// never touches the heap.
+struct arena {
+    uint8_t *base;
+    size_t   size;
+    size_t   used;
+    size_t   peak;
+};
+
+int    arena_init(struct arena *a, size_t size);
+void   arena_free(struct arena *a);
+void  *arena_alloc(struct arena *a, size_t n);
+size_t arena_mark(const struct arena *a);
+void   arena_rewind(struct arena *a, size_t mark);
+
+#endif
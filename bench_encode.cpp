@@ -0,0 +1,210 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// Encoder comparison on recorded frames. Record raw frames with
+//   ./v4l2_png --encoder raw --frames 10
+// then compare encode time and output size per format:
+//   ./bench_encode -s 1920x1080 output_*.raw
+// With no frame files a synthetic test frame is used.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "arena.h"
+#include "cpu_dispatch.h"
+#include "debayer.h"
+#include "encode.h"
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static uint16_t *load_frame(const char *path, int width, int height) {
+    size_t size = (size_t)width * height * sizeof(uint16_t);
+    uint16_t *frame = (uint16_t *)malloc(size);
+    FILE *fp = fopen(path, "rb");
+    if (!frame || !fp) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    if (fread(frame, 1, size, fp) != size) {
+        fprintf(stderr, "%s: shorter than a %dx%d frame\n", path, width, height);
+        exit(EXIT_FAILURE);
+    }
+    fclose(fp);
+    return frame;
+}
+
+// Smooth colour gradient with a little sensor-like noise, laid out as
+// SRGGB10, for runs without recorded frames.
+static uint16_t *synthetic_frame(int width, int height) {
+    uint16_t *frame = (uint16_t *)malloc((size_t)width * height * sizeof(uint16_t));
+    uint32_t seed = 12345;
+    if (!frame) {
+        perror("Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int v;
+            if (y % 2 == 0 && x % 2 == 0)
+                v = 1023 * x / width;
+            else if (y % 2 == 1 && x % 2 == 1)
+                v = 1023 * y / height;
+            else
+                v = 512 + 300 * ((x / 64 + y / 64) % 2);
+            seed = seed * 1103515245 + 12345;
+            v += (int)((seed >> 16) % 17) - 8;
+            frame[y * width + x] = v < 0 ? 0 : v > 1023 ? 1023 : v;
+        }
+    }
+    return frame;
+}
+
+int main(int argc, char **argv) {
+    int width = 1920, height = 1080, iterations = 5, quality = 90, c;
+    static const int formats[] = { ENCODE_PNG, ENCODE_JPEG, ENCODE_QOI };
+    static const char *names[] = { "png", "jpeg", "qoi" };
+    const int n_formats = sizeof(formats) / sizeof(formats[0]);
+    const char *tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char path[512];
+
+    while ((c = getopt(argc, argv, "s:n:q:h")) != -1) {
+        switch (c) {
+        case 's':
+            if (sscanf(optarg, "%dx%d", &width, &height) != 2 || width < 2 || height < 2) {
+                fprintf(stderr, "Invalid size '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            if (width % 2 || height % 2) {
+                fprintf(stderr, "4:2:0 output needs even frame dimensions, got %dx%d\n",
+                        width, height);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'q':
+            quality = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-s WxH] [-n iterations] [-q jpeg-quality] [frame.raw ...]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (iterations < 1)
+        iterations = 1;
+
+    int n_frames = argc - optind;
+    if (n_frames == 0)
+        printf("No frames given, using a synthetic %dx%d frame\n", width, height);
+
+    struct arena scratch;
+    if (arena_init(&scratch, encode_arena_size(width)))
+        return EXIT_FAILURE;
+    uint8_t *rgb = (uint8_t *)malloc((size_t)width * height * 3);
+    if (!rgb) {
+        perror("Out of memory");
+        return EXIT_FAILURE;
+    }
+
+    uint8_t *yuv = (uint8_t *)malloc(yuv_frame_size(width, height));
+    if (!yuv) {
+        perror("Out of memory");
+        return EXIT_FAILURE;
+    }
+
+    double debayer_total = 0, yuv_total = 0, encode_total[n_formats], size_total[n_formats];
+    memset(encode_total, 0, sizeof(encode_total));
+    memset(size_total, 0, sizeof(size_total));
+
+    for (int f = 0; f < (n_frames ? n_frames : 1); f++) {
+        uint16_t *raw = n_frames ? load_frame(argv[optind + f], width, height)
+                                 : synthetic_frame(width, height);
+
+        // Demosaic once per iteration; every encoder then consumes the same
+        // rows, as process_image() would stream them.
+        double t0 = now_ms();
+        for (int i = 0; i < iterations; i++) {
+            for (int y = 0; y < height; y++)
+                debayer_row(raw, rgb + (size_t)y * width * 3, width, height, y);
+        }
+        debayer_total += (now_ms() - t0) / iterations;
+
+        // The NV12 output path: demosaic straight to 4:2:0, no RGB rows.
+        struct yuv_frame yf;
+        yuv_frame_init(&yf, yuv, width, height, YUV_NV12);
+        t0 = now_ms();
+        for (int i = 0; i < iterations; i++) {
+            for (int y = 0; y < height; y += 2) {
+                const uint16_t *cur = raw + (size_t)y * width;
+                debayer_yuv_rows(cur, cur + width, y + 2 < height ? cur + 2 * width : cur, &yf, y);
+            }
+        }
+        yuv_total += (now_ms() - t0) / iterations;
+
+        for (int k = 0; k < n_formats; k++) {
+            struct encoder enc;
+            struct stat st;
+            snprintf(path, sizeof(path), "%s/bench_encode.%s", tmpdir, encode_format_ext(formats[k]));
+
+            t0 = now_ms();
+            for (int i = 0; i < iterations; i++) {
+                encoder_begin(&enc, formats[k], quality, path, width, height, &scratch);
+                for (int y = 0; y < height; y++)
+                    encoder_write_row(&enc, rgb + (size_t)y * width * 3);
+                encoder_end(&enc);
+            }
+            encode_total[k] += (now_ms() - t0) / iterations;
+
+            if (-1 == stat(path, &st)) {
+                perror(path);
+                return EXIT_FAILURE;
+            }
+            size_total[k] += st.st_size;
+            unlink(path);
+        }
+        free(raw);
+    }
+
+    int n = n_frames ? n_frames : 1;
+    double raw_bytes = (double)width * height * 3;
+    printf("%d frame(s) %dx%d, %d iteration(s), JPEG quality %d, %s kernels\n", n, width, height,
+           iterations, quality, cpu_kernel_variant());
+    printf("demosaic: %8.2f ms/frame\n", debayer_total / n);
+    printf("demosaic to nv12: %8.2f ms/frame\n", yuv_total / n);
+    printf("%-8s %12s %12s %10s %8s %14s\n", "format", "encode ms", "size KiB", "ratio", "bpp", "max fps (+dm)");
+    for (int k = 0; k < n_formats; k++) {
+        double ms = encode_total[k] / n;
+        double size = size_total[k] / n;
+        printf("%-8s %12.2f %12.1f %9.2fx %8.2f %14.1f\n", names[k], ms, size / 1024,
+               raw_bytes / size, size * 8 / ((double)width * height), 1000.0 / (ms + debayer_total / n));
+    }
+
+    free(yuv);
+    free(rgb);
+    arena_free(&scratch);
+    return 0;
+}
@@ -0,0 +1,486 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+#include "capture_config.h"
+#include "encode.h"
+#include "frame_stack.h"
+#include "pyramid.h"
+#include "work_pool.h"
+
+int capture_quiet = 0;
+
+enum {
+    OPT_PIXFMT = 256,
+    OPT_FAST_START,
+    OPT_SETTLE_MS,
+    OPT_SKIP_FRAMES,
+    OPT_TIMEOUT,
+    OPT_RECOVERY_TIMEOUT,
+    OPT_CONFIG,
+    OPT_SNAPSHOT,
+    OPT_PREROLL,
+    OPT_TRIGGER_SOCKET,
+    OPT_TRIGGER_FILE,
+    OPT_MOTION,
+    OPT_MOTION_DELTA,
+    OPT_MOTION_INTERVAL,
+    OPT_ENCODER,
+    OPT_QUALITY,
+    OPT_CALIBRATION,
+    OPT_STACK,
+    OPT_STACK_MODE,
+    OPT_PYRAMID,
+    OPT_THUMBNAIL,
+    OPT_METRICS,
+    OPT_PREVIEW_PORT,
+    OPT_HEADLESS,
+};
+
+static const struct option long_options[] = {
+    { "device",           required_argument, NULL, 'd' },
+    { "size",             required_argument, NULL, 's' },
+    { "pixfmt",           required_argument, NULL, OPT_PIXFMT },
+    { "fps",              required_argument, NULL, 'r' },
+    { "buffers",          required_argument, NULL, 'b' },
+    { "ctrl",             required_argument, NULL, 'c' },
+    { "output",           required_argument, NULL, 'o' },
+    { "encoder",          required_argument, NULL, OPT_ENCODER },
+    { "quality",          required_argument, NULL, OPT_QUALITY },
+    { "calibration",      required_argument, NULL, OPT_CALIBRATION },
+    { "stack",            required_argument, NULL, OPT_STACK },
+    { "stack-mode",       required_argument, NULL, OPT_STACK_MODE },
+    { "pyramid",          required_argument, NULL, OPT_PYRAMID },
+    { "thumbnail",        required_argument, NULL, OPT_THUMBNAIL },
+    { "frames",           required_argument, NULL, 'n' },
+    { "threads",          required_argument, NULL, 'j' },
+    { "quiet",            no_argument,       NULL, 'q' },
+    { "fast-start",       no_argument,       NULL, OPT_FAST_START },
+    { "settle-ms",        required_argument, NULL, OPT_SETTLE_MS },
+    { "skip-frames",      required_argument, NULL, OPT_SKIP_FRAMES },
+    { "timeout",          required_argument, NULL, OPT_TIMEOUT },
+    { "recovery-timeout", required_argument, NULL, OPT_RECOVERY_TIMEOUT },
+    { "config",           required_argument, NULL, OPT_CONFIG },
+    { "snapshot",         no_argument,       NULL, OPT_SNAPSHOT },
+    { "preroll",          required_argument, NULL, OPT_PREROLL },
+    { "trigger-socket",   required_argument, NULL, OPT_TRIGGER_SOCKET },
+    { "trigger-file",     required_argument, NULL, OPT_TRIGGER_FILE },
+    { "metrics",          required_argument, NULL, OPT_METRICS },
+    { "preview-port",     required_argument, NULL, OPT_PREVIEW_PORT },
+    { "headless",         no_argument,       NULL, OPT_HEADLESS },
+    { "motion",           required_argument, NULL, OPT_MOTION },
+    { "motion-delta",     required_argument, NULL, OPT_MOTION_DELTA },
+    { "motion-interval",  required_argument, NULL, OPT_MOTION_INTERVAL },
+    { "help",             no_argument,       NULL, 'h' },
+    { NULL,               0,                 NULL, 0 },
+};
+
+void capture_config_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -d, --device PATH       capture device (default /dev/video0)\n"
+            "  -s, --size WxH          frame size (default 1920x1080)\n"
+            "      --pixfmt FOURCC     pixel format (default RG10)\n"
+            "  -r, --fps N[/D]         frame rate (default 15)\n"
+            "  -b, --buffers N         driver buffer count (default 4)\n"
+            "  -c, --ctrl ID=VALUE     set a V4L2 control, repeatable\n"
+            "  -o, --output PATTERN    output file, %%t = timestamp, %%s = sequence\n"
+            "      --encoder FORMAT    png (default), jpeg, qoi, raw, or nv12/i420 YUV\n"
+            "      --quality N         JPEG quality (default 90)\n"
+            "      --calibration FILE  black level, defect and shading calibration\n"
+            "      --stack N           average the last N raw frames (default 1, off)\n"
+            "      --stack-mode MODE   mean (default) or median\n"
+            "      --pyramid N         also save 1/2 .. 1/2^N size copies (N <= 3)\n"
+            "      --thumbnail W       also save a thumbnail W pixels wide\n"
+            "  -n, --frames N          frames to capture (default 1)\n"
+            "  -j, --threads N         encode threads, at most 16 (default: one per CPU)\n"
+            "  -q, --quiet             only report results and errors\n"
+            "      --fast-start        skip ioctls the device already satisfies and\n"
+            "                          the settle delay\n"
+            "      --settle-ms MS      delay after STREAMON (default 1000)\n"
+            "      --skip-frames N     discard N frames before the first capture\n"
+            "      --timeout S         first-frame timeout in seconds (default 10)\n"
+            "      --recovery-timeout S\n"
+            "                          keep trying to restart a failed stream or reopen\n"
+            "                          the device for S seconds (default 30, 0 = exit)\n"
+            "      --config FILE       read 'key = value' options from FILE\n"
+            "      --snapshot          keep streaming and save frames on trigger\n"
+            "                          (SIGUSR1, --trigger-socket, --trigger-file)\n"
+            "      --preroll N         raw frames kept for triggers (default 4)\n"
+            "      --trigger-socket P  UNIX socket accepting 'snap [usec]' requests\n"
+            "      --trigger-file P    GPIO value file, triggers on rising edge\n"
+            "      --motion PCT        snapshot when PCT %% of the scene changes\n"
+            "      --motion-delta N    per-block change counted as motion (default 16)\n"
+            "      --motion-interval MS\n"
+            "                          minimum time between motion saves (default 1000)\n"
+            "      --metrics ADDR      Prometheus metrics on localhost port ADDR, or on a\n"
+            "                          UNIX socket if ADDR is a path\n"
+            "      --preview-port N    serve an MJPEG preview over HTTP (live viewer)\n"
+            "      --headless          no preview window (live viewer)\n",
+            prog);
+}
+
+void capture_config_init(struct capture_config *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    strcpy(cfg->dev_name, "/dev/video0");
+    cfg->width = 1920;
+    cfg->height = 1080;
+    cfg->pixelformat = V4L2_PIX_FMT_SRGGB10;
+    cfg->fps_num = 1;
+    cfg->fps_den = 15;
+    cfg->n_buffers = 4;
+    cfg->encoder = ENCODE_PNG;
+    cfg->quality = 90;
+    cfg->stack_depth = 1;
+    cfg->stack_mode = STACK_MEAN;
+    cfg->frames = 1;
+    cfg->threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cfg->threads > WORK_POOL_MAX_THREADS)
+        cfg->threads = WORK_POOL_MAX_THREADS;
+    cfg->settle_ms = 1000;
+    cfg->timeout_s = 10;
+    cfg->recovery_timeout_s = 30;
+    cfg->preroll = 4;
+    cfg->motion_delta = 16;
+    cfg->motion_interval_ms = 1000;
+}
+
+void capture_config_add_control(struct capture_config *cfg, uint32_t id, int32_t value) {
+    for (int i = 0; i < cfg->n_controls; i++) {
+        if (cfg->controls[i].id == id) {
+            cfg->controls[i].value = value;
+            return;
+        }
+    }
+    if (cfg->n_controls == CAPTURE_MAX_CONTROLS) {
+        fprintf(stderr, "Too many controls, ignoring 0x%08x\n", id);
+        return;
+    }
+    cfg->controls[cfg->n_controls].id = id;
+    cfg->controls[cfg->n_controls].value = value;
+    cfg->n_controls++;
+}
+
+static int parse_int(const char *name, const char *value, long min, long max, long *out) {
+    char *end;
+    long v = strtol(value, &end, 0);
+    if (end == value || *end != '\0' || v < min || v > max) {
+        fprintf(stderr, "Invalid value for %s: '%s'\n", name, value);
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+static int parse_float(const char *name, const char *value, float min, float max, float *out) {
+    char *end;
+    float v = strtof(value, &end);
+    if (end == value || *end != '\0' || v < min || v > max) {
+        fprintf(stderr, "Invalid value for %s: '%s'\n", name, value);
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+static int parse_bool(const char *value) {
+    return !value || !strcasecmp(value, "1") || !strcasecmp(value, "true") ||
+           !strcasecmp(value, "yes") || !strcasecmp(value, "on");
+}
+
+// Applies one option, from either the command line or a config file.
+static int apply_option(struct capture_config *cfg, const char *name, const char *value) {
+    long v;
+
+    if (!strcmp(name, "device")) {
+        snprintf(cfg->dev_name, sizeof(cfg->dev_name), "%s", value);
+    } else if (!strcmp(name, "size")) {
+        unsigned int w, h;
+        if (sscanf(value, "%ux%u", &w, &h) != 2 || !w || !h) {
+            fprintf(stderr, "Invalid size '%s', expected WxH\n", value);
+            return -1;
+        }
+        cfg->width = w;
+        cfg->height = h;
+    } else if (!strcmp(name, "pixfmt")) {
+        if (strlen(value) != 4) {
+            fprintf(stderr, "Invalid pixel format '%s', expected a fourcc\n", value);
+            return -1;
+        }
+        cfg->pixelformat = v4l2_fourcc(value[0], value[1], value[2], value[3]);
+    } else if (!strcmp(name, "fps")) {
+        // N or N/D frames per second; V4L2 wants the inverse, time per frame.
+        unsigned int n, d = 1;
+        if (sscanf(value, "%u/%u", &n, &d) < 1 || !n || !d) {
+            fprintf(stderr, "Invalid frame rate '%s'\n", value);
+            return -1;
+        }
+        cfg->fps_num = d;
+        cfg->fps_den = n;
+    } else if (!strcmp(name, "buffers")) {
+        if (parse_int(name, value, 1, 32, &v))
+            return -1;
+        cfg->n_buffers = v;
+    } else if (!strcmp(name, "ctrl")) {
+        char *end;
+        unsigned long id = strtoul(value, &end, 0);
+        if (end == value || *end != '=') {
+            fprintf(stderr, "Invalid control '%s', expected ID=VALUE\n", value);
+            return -1;
+        }
+        if (parse_int(name, end + 1, INT32_MIN, INT32_MAX, &v))
+            return -1;
+        // The first user control replaces the program's defaults.
+        if (!cfg->controls_set) {
+            cfg->n_controls = 0;
+            cfg->controls_set = 1;
+        }
+        capture_config_add_control(cfg, id, v);
+    } else if (!strcmp(name, "output")) {
+        snprintf(cfg->output, sizeof(cfg->output), "%s", value);
+    } else if (!strcmp(name, "encoder")) {
+        if (encode_format_parse(value, &cfg->encoder)) {
+            fprintf(stderr, "Unknown encoder '%s'\n", value);
+            return -1;
+        }
+    } else if (!strcmp(name, "quality")) {
+        if (parse_int(name, value, 1, 100, &v))
+            return -1;
+        cfg->quality = v;
+    } else if (!strcmp(name, "calibration")) {
+        snprintf(cfg->calibration, sizeof(cfg->calibration), "%s", value);
+    } else if (!strcmp(name, "stack")) {
+        if (parse_int(name, value, 1, FRAME_STACK_MAX_DEPTH, &v))
+            return -1;
+        cfg->stack_depth = v;
+    } else if (!strcmp(name, "stack-mode")) {
+        if (frame_stack_parse_mode(value, &cfg->stack_mode)) {
+            fprintf(stderr, "Unknown stack mode '%s'\n", value);
+            return -1;
+        }
+    } else if (!strcmp(name, "pyramid")) {
+        if (parse_int(name, value, 0, PYRAMID_MAX_HALVINGS, &v))
+            return -1;
+        cfg->pyramid = v;
+    } else if (!strcmp(name, "thumbnail")) {
+        if (parse_int(name, value, 0, 65535, &v))
+            return -1;
+        cfg->thumbnail = v;
+    } else if (!strcmp(name, "frames")) {
+        if (parse_int(name, value, 1, INT32_MAX, &v))
+            return -1;
+        cfg->frames = v;
+    } else if (!strcmp(name, "threads")) {
+        if (parse_int(name, value, 1, WORK_POOL_MAX_THREADS, &v))
+            return -1;
+        cfg->threads = v;
+    } else if (!strcmp(name, "quiet")) {
+        capture_quiet = parse_bool(value);
+    } else if (!strcmp(name, "fast-start")) {
+        cfg->fast_start = parse_bool(value);
+    } else if (!strcmp(name, "settle-ms")) {
+        if (parse_int(name, value, 0, 60000, &v))
+            return -1;
+        cfg->settle_ms = v;
+    } else if (!strcmp(name, "skip-frames")) {
+        if (parse_int(name, value, 0, 1000, &v))
+            return -1;
+        cfg->skip_frames = v;
+    } else if (!strcmp(name, "timeout")) {
+        if (parse_int(name, value, 1, 3600, &v))
+            return -1;
+        cfg->timeout_s = v;
+    } else if (!strcmp(name, "recovery-timeout")) {
+        if (parse_int(name, value, 0, 86400, &v))
+            return -1;
+        cfg->recovery_timeout_s = v;
+    } else if (!strcmp(name, "snapshot")) {
+        cfg->snapshot = parse_bool(value);
+    } else if (!strcmp(name, "preroll")) {
+        if (parse_int(name, value, 1, 64, &v))
+            return -1;
+        cfg->preroll = v;
+    } else if (!strcmp(name, "trigger-socket")) {
+        if (strlen(value) >= sizeof(cfg->trigger_socket)) {
+            fprintf(stderr, "Trigger socket path too long\n");
+            return -1;
+        }
+        strcpy(cfg->trigger_socket, value);
+    } else if (!strcmp(name, "trigger-file")) {
+        snprintf(cfg->trigger_file, sizeof(cfg->trigger_file), "%s", value);
+    } else if (!strcmp(name, "metrics")) {
+        if (strlen(value) >= sizeof(cfg->metrics)) {
+            fprintf(stderr, "Metrics address too long\n");
+            return -1;
+        }
+        strcpy(cfg->metrics, value);
+    } else if (!strcmp(name, "preview-port")) {
+        if (parse_int(name, value, 0, 65535, &v))
+            return -1;
+        cfg->preview_port = v;
+    } else if (!strcmp(name, "headless")) {
+        cfg->headless = parse_bool(value);
+    } else if (!strcmp(name, "motion")) {
+        if (parse_float(name, value, 0, 100, &cfg->motion))
+            return -1;
+    } else if (!strcmp(name, "motion-delta")) {
+        if (parse_int(name, value, 1, 1023, &v))
+            return -1;
+        cfg->motion_delta = v;
+    } else if (!strcmp(name, "motion-interval")) {
+        if (parse_int(name, value, 0, 3600000, &v))
+            return -1;
+        cfg->motion_interval_ms = v;
+    } else if (!strcmp(name, "config")) {
+        return capture_config_load(cfg, value);
+    } else {
+        fprintf(stderr, "Unknown option '%s'\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+static char *trim(char *s) {
+    while (isspace((unsigned char)*s))
+        s++;
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+    return s;
+}
+
+// Config files hold one 'key = value' per line, with the same keys as the
+// long options ('_' and '-' are interchangeable). '#' starts a comment.
+// 'config = FILE' includes another file, up to CAPTURE_MAX_CONFIG_DEPTH
+// deep, so a file that includes itself fails instead of recursing forever.
+int capture_config_load(struct capture_config *cfg, const char *path) {
+    static int depth;
+    char line[512];
+    int lineno = 0, rc = 0;
+
+    if (depth == CAPTURE_MAX_CONFIG_DEPTH) {
+        fprintf(stderr, "%s: config files nested more than %d deep\n", path, CAPTURE_MAX_CONFIG_DEPTH);
+        return -1;
+    }
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    depth++;
+
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash)
+            *hash = '\0';
+        char *key = trim(line);
+        if (!*key)
+            continue;
+
+        char *value = NULL;
+        char *eq = strchr(key, '=');
+        if (eq) {
+            *eq = '\0';
+            value = trim(eq + 1);
+            key = trim(key);
+        }
+        for (char *p = key; *p; p++) {
+            if (*p == '_')
+                *p = '-';
+        }
+
+        // Flags may be given without a value; everything else needs one.
+        const struct option *opt = long_options;
+        while (opt->name && strcmp(opt->name, key))
+            opt++;
+        if (!value && opt->name && opt->has_arg == required_argument) {
+            fprintf(stderr, "%s:%d: missing value for '%s'\n", path, lineno, key);
+            rc = -1;
+            break;
+        }
+        if (apply_option(cfg, key, value)) {
+            fprintf(stderr, "%s:%d: invalid line\n", path, lineno);
+            rc = -1;
+            break;
+        }
+    }
+
+    depth--;
+    fclose(fp);
+    return rc;
+}
+
+int capture_config_parse_args(struct capture_config *cfg, int argc, char **argv) {
+    int c, index;
+
+    optind = 1;
+    while ((c = getopt_long(argc, argv, "d:s:r:b:c:o:n:j:qh", long_options, &index)) != -1) {
+        if (c == 'h' || c == '?') {
+            capture_config_usage(argv[0]);
+            return -1;
+        }
+        const struct option *opt = long_options;
+        while (opt->name && opt->val != c)
+            opt++;
+        if (apply_option(cfg, opt->name, optarg))
+            return -1;
+    }
+
+    if (optind < argc) {
+        fprintf(stderr, "Unexpected argument '%s'\n", argv[optind]);
+        capture_config_usage(argv[0]);
+        return -1;
+    }
+    return 0;
+}
+
+// Expands %t (timestamp seconds), %s (zero-padded sequence) and %% in an
+// output pattern. Returns -1 if the result does not fit.
+int capture_output_name(char *out, size_t size, const char *pattern,
+                        long timestamp, uint32_t sequence) {
+    size_t n = 0;
+    for (const char *p = pattern; *p; p++) {
+        int w;
+        if (p[0] == '%' && p[1] == 't') {
+            w = snprintf(out + n, size - n, "%ld", timestamp);
+            p++;
+        } else if (p[0] == '%' && p[1] == 's') {
+            w = snprintf(out + n, size - n, "%06u", sequence);
+            p++;
+        } else if (p[0] == '%' && p[1] == '%') {
+            w = snprintf(out + n, size - n, "%%");
+            p++;
+        } else {
+            w = snprintf(out + n, size - n, "%c", *p);
+        }
+        if (w < 0 || (size_t)w >= size - n)
+            return -1;
+        n += w;
+    }
+    if (n == 0 && size > 0)
+        out[0] = '\0';
+    return 0;
+}
@@ -0,0 +1,88 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef CAPTURE_CONFIG_H
+#define CAPTURE_CONFIG_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define CAPTURE_MAX_CONTROLS 16
+#define CAPTURE_MAX_CONFIG_DEPTH 8
+
+// Set by --quiet; suppresses the per-step progress output.
+extern int capture_quiet;
+
+#define INFO_PRINT(fmt, ...) do { if (!capture_quiet) printf(fmt, ##__VA_ARGS__); } while (0)
+
+struct capture_control {
+    uint32_t id;
+    int32_t  value;
+};
+
+// Everything that used to be a literal in main(). Filled with defaults by
+// capture_config_init(), then overridden by --config files and command-line
+// options in the order they appear.
+struct capture_config {
+    char                    dev_name[256];
+    uint32_t                width;
+    uint32_t                height;
+    uint32_t                pixelformat;
+    uint32_t                fps_num;
+    uint32_t                fps_den;
+    uint32_t                n_buffers;
+    struct capture_control  controls[CAPTURE_MAX_CONTROLS];
+    int                     n_controls;
+    int                     controls_set;   // controls came from the user
+    char                    output[256];    // pattern, empty = program default
+    int                     encoder;        // enum encode_format
+    int                     quality;        // JPEG quality, 1-100
+    int                     frames;
+    int                     threads;
+    int                     fast_start;
+    int                     settle_ms;
+    int                     skip_frames;
+    int                     timeout_s;
+    int                     recovery_timeout_s; // give up recovering, 0 = never try
+    int                     snapshot;       // resident trigger server mode
+    int                     preroll;        // raw frames kept for triggers
+    char                    trigger_socket[108];
+    char                    trigger_file[256];
+    float                   motion;         // % of thumbnail changed, 0 = off
+    int                     motion_delta;   // per-pixel change, 10-bit levels
+    int                     motion_interval_ms;
+    char                    calibration[256];   // raw correction file
+    int                     stack_depth;    // temporal denoise, 1 = off
+    int                     stack_mode;     // enum frame_stack_mode
+    int                     pyramid;        // extra outputs at 1/2, 1/4, 1/8 size
+    int                     thumbnail;      // thumbnail width, 0 = off
+    char                    metrics[108];   // port or UNIX socket path
+    int                     preview_port;   // MJPEG preview server, 0 = off
+    int                     headless;       // no local preview window
+};
+
+void capture_config_init(struct capture_config *cfg);
+void capture_config_add_control(struct capture_config *cfg, uint32_t id, int32_t value);
+int  capture_config_load(struct capture_config *cfg, const char *path);
+int  capture_config_parse_args(struct capture_config *cfg, int argc, char **argv);
+void capture_config_usage(const char *prog);
+int  capture_output_name(char *out, size_t size, const char *pattern,
+                         long timestamp, uint32_t sequence);
+
+#endif
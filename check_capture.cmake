@@ -0,0 +1,43 @@
+# Runs a capture and checks what it saved, for tests that need more than the
+# exit status:
+#
+#   cmake -DFILES=<glob> -DCOUNT=<n> [-DEXPECT=<regex>] -P check_capture.cmake -- <command...>
+#
+# Files matching FILES are removed first. The test fails unless the command
+# exits 0, leaves exactly COUNT files matching FILES, and prints output
+# (stdout and stderr together) matching EXPECT.
+
+set(command "")
+set(in_command FALSE)
+math(EXPR last "${CMAKE_ARGC} - 1")
+foreach(i RANGE ${last})
+    if(in_command)
+        list(APPEND command "${CMAKE_ARGV${i}}")
+    elseif(CMAKE_ARGV${i} STREQUAL "--")
+        set(in_command TRUE)
+    endif()
+endforeach()
+if(NOT command OR NOT DEFINED FILES OR NOT DEFINED COUNT)
+    message(FATAL_ERROR "usage: cmake -DFILES=<glob> -DCOUNT=<n> [-DEXPECT=<regex>] -P check_capture.cmake -- <command...>")
+endif()
+
+file(GLOB stale ${FILES})
+if(stale)
+    file(REMOVE ${stale})
+endif()
+
+execute_process(COMMAND ${command} RESULT_VARIABLE status OUTPUT_VARIABLE output ERROR_VARIABLE output)
+message("${output}")
+if(NOT status EQUAL 0)
+    message(FATAL_ERROR "capture exited with ${status}")
+endif()
+
+file(GLOB saved ${FILES})
+list(LENGTH saved n_saved)
+if(NOT n_saved EQUAL COUNT)
+    message(FATAL_ERROR "capture saved ${n_saved} files, expected ${COUNT}")
+endif()
+
+if(DEFINED EXPECT AND NOT output MATCHES "${EXPECT}")
+    message(FATAL_ERROR "capture output does not match '${EXPECT}'")
+endif()
@@ -0,0 +1,52 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef CPU_DISPATCH_H
+#define CPU_DISPATCH_H
+
+// Hot per-pixel kernels are compiled once per instruction set and the
+// variant is picked when the program loads, so one binary runs on every
+// machine of its architecture and uses the widest vectors each one has.
+// The compiler emits the variants and an ifunc resolver; a kernel only
+// needs KERNEL_CLONES in front of its definition, and any always_inline
+// helpers are inlined into every variant.
+//
+// x86-64: baseline (SSE2), x86-64-v3 (AVX2) and x86-64-v4 (AVX-512).
+// The x86-64-v* level names need GCC 12 or Clang 14.
+// AArch64: baseline (NEON) and SVE; function multi-versioning needs
+// GCC 14 or Clang 16, older compilers build the NEON code only.
+//
+// -DNO_KERNEL_CLONES builds one variant for the -march given, e.g. for a
+// build that only ever runs on the machine it was compiled on.
+#if defined(NO_KERNEL_CLONES) || !defined(__linux__)
+#define KERNEL_CLONES
+#elif defined(__x86_64__) && (defined(__clang__) ? __clang_major__ >= 14 : __GNUC__ >= 12)
+#define KERNEL_CLONES __attribute__((target_clones("default", "arch=x86-64-v3", "arch=x86-64-v4")))
+#define KERNEL_CLONES_ENABLED
+#elif defined(__aarch64__) && (defined(__clang__) ? __clang_major__ >= 16 : __GNUC__ >= 14)
+#define KERNEL_CLONES __attribute__((target_clones("default", "sve")))
+#define KERNEL_CLONES_ENABLED
+#else
+#define KERNEL_CLONES
+#endif
+
+// Name of the kernel variant the resolver picks on this CPU, for logs.
+const char *cpu_kernel_variant(void);
+
+#endif
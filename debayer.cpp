@@ -0,0 +1,290 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include "cpu_dispatch.h"
+#include "debayer.h"
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+
+// h_interp and v_interp are caller-owned scratch rows of width * 3 entries
+// each, so a full-frame debayer reuses the same two rows instead of
+// allocating per row.
+void ahd_debayer(const uint16_t *src, uint8_t *row, int width, int height, int y,
+                 uint16_t *h_interp, uint16_t *v_interp)
+{
+    // Perform horizontal and vertical interpolations
+    for (int x = 0; x < width; x++) {
+        int is_green = ((x + y) % 2 == 0);
+        int is_blue = (y % 2 == 1 && x % 2 == 0);
+
+        // Horizontal interpolation
+        if (is_green) {
+            h_interp[x*3 + 1] = src[y * width + x] & 0x03FF;
+            h_interp[x*3 + 0] = (x > 0) ? (src[y * width + x - 1] & 0x03FF) : h_interp[x*3 + 1];
+            h_interp[x*3 + 2] = (x < width - 1) ? (src[y * width + x + 1] & 0x03FF) : h_interp[x*3 + 1];
+        } else if (is_blue) {
+            h_interp[x*3 + 2] = src[y * width + x] & 0x03FF;
+            h_interp[x*3 + 1] = (x > 0 && x < width - 1) ? 
+                ((src[y * width + x - 1] & 0x03FF) + (src[y * width + x + 1] & 0x03FF)) / 2 : h_interp[x*3 + 2];
+            h_interp[x*3 + 0] = h_interp[x*3 + 1];
+        } else { // is_red
+            h_interp[x*3 + 0] = src[y * width + x] & 0x03FF;
+            h_interp[x*3 + 1] = (x > 0 && x < width - 1) ? 
+                ((src[y * width + x - 1] & 0x03FF) + (src[y * width + x + 1] & 0x03FF)) / 2 : h_interp[x*3 + 0];
+            h_interp[x*3 + 2] = h_interp[x*3 + 1];
+        }
+
+        // Vertical interpolation (similar to horizontal, but using y-1 and y+1)
+        if (is_green) {
+            v_interp[x*3 + 1] = src[y * width + x] & 0x03FF;
+            v_interp[x*3 + 0] = (y > 0) ? (src[(y - 1) * width + x] & 0x03FF) : v_interp[x*3 + 1];
+            v_interp[x*3 + 2] = (y < height - 1) ? (src[(y + 1) * width + x] & 0x03FF) : v_interp[x*3 + 1];
+        } else if (is_blue) {
+            v_interp[x*3 + 2] = src[y * width + x] & 0x03FF;
+            v_interp[x*3 + 1] = (y > 0 && y < height - 1) ? 
+                ((src[(y - 1) * width + x] & 0x03FF) + (src[(y + 1) * width + x] & 0x03FF)) / 2 : v_interp[x*3 + 2];
+            v_interp[x*3 + 0] = v_interp[x*3 + 1];
+        } else { // is_red
+            v_interp[x*3 + 0] = src[y * width + x] & 0x03FF;
+            v_interp[x*3 + 1] = (y > 0 && y < height - 1) ? 
+                ((src[(y - 1) * width + x] & 0x03FF) + (src[(y + 1) * width + x] & 0x03FF)) / 2 : v_interp[x*3 + 0];
+            v_interp[x*3 + 2] = v_interp[x*3 + 1];
+        }
+
+        // Calculate homogeneity
+        float h_homogeneity = 0, v_homogeneity = 0;
+        for (int c = 0; c < 3; c++) {
+            h_homogeneity += fabs(h_interp[MAX(0, x-1)*3 + c] - h_interp[x*3 + c]) + 
+                             fabs(h_interp[MIN(width-1, x+1)*3 + c] - h_interp[x*3 + c]);
+            v_homogeneity += fabs(v_interp[MAX(0, x-1)*3 + c] - v_interp[x*3 + c]) + 
+                             fabs(v_interp[MIN(width-1, x+1)*3 + c] - v_interp[x*3 + c]);
+        }
+
+        // Choose interpolation with better homogeneity
+        uint16_t *chosen = (h_homogeneity <= v_homogeneity) ? h_interp : v_interp;
+
+        // Write to output
+        row[x * 3] = chosen[x*3 + 0] >> 2;
+        row[x * 3 + 1] = chosen[x*3 + 1] >> 2;
+        row[x * 3 + 2] = chosen[x*3 + 2] >> 2;
+    }
+}
+
+// One pixel of the bilinear demosaic, with neighbours past the frame edge
+// mirrored from the opposite side.
+static inline __attribute__((always_inline))
+void rgb_pixel(const uint16_t *above, const uint16_t *cur, const uint16_t *below,
+               uint8_t *row, int width, int y, int x)
+{
+    int xl = x > 0 ? x - 1 : x + 1;
+    int xr = x < width - 1 ? x + 1 : x - 1;
+    uint16_t r, g, b;
+    if (y % 2 == 0) {
+        if (x % 2 == 0) {
+            r = cur[x] & 0x03FF;
+            g = (uint16_t)(((uint32_t)(cur[xr] & 0x03FF) + (uint32_t)(below[x] & 0x03FF)) >> 1);
+            b = below[xr] & 0x03FF;
+        } else {
+            r = (uint16_t)(((uint32_t)(cur[xl] & 0x03FF) + (uint32_t)(cur[xr] & 0x03FF)) >> 1);
+            g = cur[x] & 0x03FF;
+            b = (uint16_t)(((uint32_t)(above[x] & 0x03FF) + (uint32_t)(below[x] & 0x03FF)) >> 1);
+        }
+    } else {
+        if (x % 2 == 0) {
+            r = (uint16_t)(((uint32_t)(above[x] & 0x03FF) + (uint32_t)(below[x] & 0x03FF)) >> 1);
+            g = cur[x] & 0x03FF;
+            b = (uint16_t)(((uint32_t)(cur[xl] & 0x03FF) + (uint32_t)(cur[xr] & 0x03FF)) >> 1);
+        } else {
+            r = above[xr] & 0x03FF;
+            g = (uint16_t)(((uint32_t)(above[x] & 0x03FF) + (uint32_t)(cur[xr] & 0x03FF)) >> 1);
+            b = cur[x] & 0x03FF;
+        }
+    }
+    row[x * 3] = r >> 2;
+    row[x * 3 + 1] = g >> 2;
+    row[x * 3 + 2] = b >> 2;
+}
+
+// Interior pixels of a row, pairs [1, pairs - 1), where every neighbour is
+// in range: no edge tests and a fixed Bayer phase per loop. Each channel is
+// computed for a block of pixels in its own loop and the block is then
+// interleaved into RGB, so all loops vectorize; one loop writing all six
+// bytes of a pixel pair does not. Same arithmetic as rgb_pixel(), with
+// ((p + q) >> 1) >> 2 folded into (p + q) >> 3.
+#define RGB_BLOCK 128
+
+static inline __attribute__((always_inline))
+void rgb_interior(const uint16_t *__restrict above, const uint16_t *__restrict cur,
+                  const uint16_t *__restrict below, uint8_t *__restrict row, int pairs, int y)
+{
+    uint8_t rp[2 * RGB_BLOCK], gp[2 * RGB_BLOCK], bp[2 * RGB_BLOCK];
+
+    for (int i0 = 1; i0 < pairs - 1; i0 += RGB_BLOCK) {
+        int n = pairs - 1 - i0 < RGB_BLOCK ? pairs - 1 - i0 : RGB_BLOCK;
+        const uint16_t *a = above + 2 * i0, *c = cur + 2 * i0, *b = below + 2 * i0;
+
+        if (y % 2 == 0) {
+            // R G: red at the even pixel, green at the odd one.
+            for (int i = 0; i < n; i++) {
+                rp[2 * i] = (c[2 * i] & 0x03FF) >> 2;
+                rp[2 * i + 1] = ((c[2 * i] & 0x03FF) + (c[2 * i + 2] & 0x03FF)) >> 3;
+            }
+            for (int i = 0; i < n; i++) {
+                gp[2 * i] = ((c[2 * i + 1] & 0x03FF) + (b[2 * i] & 0x03FF)) >> 3;
+                gp[2 * i + 1] = (c[2 * i + 1] & 0x03FF) >> 2;
+            }
+            for (int i = 0; i < n; i++) {
+                bp[2 * i] = (b[2 * i + 1] & 0x03FF) >> 2;
+                bp[2 * i + 1] = ((a[2 * i + 1] & 0x03FF) + (b[2 * i + 1] & 0x03FF)) >> 3;
+            }
+        } else {
+            // G B: green at the even pixel, blue at the odd one.
+            for (int i = 0; i < n; i++) {
+                rp[2 * i] = ((a[2 * i] & 0x03FF) + (b[2 * i] & 0x03FF)) >> 3;
+                rp[2 * i + 1] = (a[2 * i + 2] & 0x03FF) >> 2;
+            }
+            for (int i = 0; i < n; i++) {
+                gp[2 * i] = (c[2 * i] & 0x03FF) >> 2;
+                gp[2 * i + 1] = ((a[2 * i + 1] & 0x03FF) + (c[2 * i + 2] & 0x03FF)) >> 3;
+            }
+            for (int i = 0; i < n; i++) {
+                bp[2 * i] = ((c[2 * i - 1] & 0x03FF) + (c[2 * i + 1] & 0x03FF)) >> 3;
+                bp[2 * i + 1] = (c[2 * i + 1] & 0x03FF) >> 2;
+            }
+        }
+
+        uint8_t *out = row + 6 * i0;
+        for (int i = 0; i < 2 * n; i++) {
+            out[3 * i] = rp[i];
+            out[3 * i + 1] = gp[i];
+            out[3 * i + 2] = bp[i];
+        }
+    }
+}
+
+// Bilinear demosaic of one output row of an SRGGB10 frame (10-bit samples
+// in 16-bit words), given the raw rows above, at and below y, into 8-bit
+// RGB. Edge pixels borrow their neighbours from the opposite side; the
+// first and last pair of the row go through the per-pixel path.
+KERNEL_CLONES
+void debayer_rows(const uint16_t *above, const uint16_t *cur, const uint16_t *below,
+                  uint8_t *row, int width, int y)
+{
+    int pairs = width / 2;
+    int x = 0;
+    if (pairs >= 3) {
+        rgb_pixel(above, cur, below, row, width, y, 0);
+        rgb_pixel(above, cur, below, row, width, y, 1);
+        rgb_interior(above, cur, below, row, pairs, y);
+        x = 2 * (pairs - 1);
+    }
+    for (; x < width; x++)
+        rgb_pixel(above, cur, below, row, width, y, x);
+}
+
+void debayer_row(const uint16_t *src, uint8_t *row, int width, int height, int y)
+{
+    int above = y > 0 ? y - 1 : y + 1;
+    int below = y < height - 1 ? y + 1 : y - 1;
+    debayer_rows(src + (size_t)above * width, src + (size_t)y * width,
+                 src + (size_t)below * width, row, width, y);
+}
+
+size_t yuv_frame_size(int width, int height)
+{
+    return (size_t)width * height * 3 / 2;
+}
+
+void yuv_frame_init(struct yuv_frame *f, uint8_t *buf, int width, int height, int layout)
+{
+    size_t luma = (size_t)width * height;
+    f->y = buf;
+    f->u = buf + luma;
+    f->width = width;
+    if (layout == YUV_NV12) {
+        f->v = f->u + 1;
+        f->uv_stride = width;
+        f->uv_step = 2;
+    } else {
+        f->v = f->u + luma / 4;
+        f->uv_stride = width / 2;
+        f->uv_step = 1;
+    }
+}
+
+// One 2x2 quad at even (y, x) of an RGGB frame: bilinear interpolation
+// from the quad and the pair of rows below it (the row above would only
+// refine blue on the red row), then luma per pixel and chroma from the
+// quad sums. On 10-bit input the 8-bit BT.601 coefficients need two more
+// bits of shift for luma and four more (sum of four pixels) for chroma.
+// xl is column x - 1 and xr is x + 2, mirrored at the edges.
+static inline __attribute__((always_inline))
+void yuv_quad(const uint16_t *r0, const uint16_t *r1, const uint16_t *r2, int xl, int x, int xr,
+              uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v)
+{
+    int a = r0[x] & 0x03FF, b = r0[x + 1] & 0x03FF, c = r0[xr] & 0x03FF;
+    int d = r1[xl] & 0x03FF, e = r1[x] & 0x03FF, f = r1[x + 1] & 0x03FF, g = r1[xr] & 0x03FF;
+    int h = r2[x] & 0x03FF, i = r2[xr] & 0x03FF;
+
+    int R0 = a,                         G0 = (b + e) >> 1,  B0 = f;
+    int R1 = (a + c) >> 1,              G1 = b,             B1 = f;
+    int R2 = (a + h) >> 1,              G2 = e,             B2 = (d + f) >> 1;
+    int R3 = (a + c + h + i + 2) >> 2,  G3 = (b + g) >> 1,  B3 = f;
+
+    y0[x]     = ((66 * R0 + 129 * G0 + 25 * B0 + 512) >> 10) + 16;
+    y0[x + 1] = ((66 * R1 + 129 * G1 + 25 * B1 + 512) >> 10) + 16;
+    y1[x]     = ((66 * R2 + 129 * G2 + 25 * B2 + 512) >> 10) + 16;
+    y1[x + 1] = ((66 * R3 + 129 * G3 + 25 * B3 + 512) >> 10) + 16;
+
+    int sr = R0 + R1 + R2 + R3, sg = G0 + G1 + G2 + G3, sb = B0 + B1 + B2 + B3;
+    *u = ((-38 * sr - 74 * sg + 112 * sb + 2048) >> 12) + 128;
+    *v = ((112 * sr - 94 * sg - 18 * sb + 2048) >> 12) + 128;
+}
+
+// The interior loop has no edge tests and a constant chroma step, so the
+// compiler can vectorize it; the two edge quads are done separately.
+static inline __attribute__((always_inline))
+void yuv_rows(const uint16_t *__restrict r0, const uint16_t *__restrict r1,
+              const uint16_t *__restrict r2, uint8_t *__restrict y0, uint8_t *__restrict y1,
+              uint8_t *__restrict u, uint8_t *__restrict v, int width, int uv_step)
+{
+    int last = width - 2;
+    yuv_quad(r0, r1, r2, 1, 0, last > 0 ? 2 : 0, y0, y1, u, v);
+    for (int i = 1; i < last / 2; i++)
+        yuv_quad(r0, r1, r2, 2 * i - 1, 2 * i, 2 * i + 2, y0, y1, u + i * uv_step, v + i * uv_step);
+    if (last > 0)
+        yuv_quad(r0, r1, r2, last - 1, last, last, y0, y1, u + last / 2 * uv_step, v + last / 2 * uv_step);
+}
+
+KERNEL_CLONES
+void debayer_yuv_rows(const uint16_t *cur, const uint16_t *next, const uint16_t *below,
+                      struct yuv_frame *f, int y)
+{
+    uint8_t *y0 = f->y + (size_t)y * f->width;
+    uint8_t *u = f->u + (size_t)(y / 2) * f->uv_stride;
+    uint8_t *v = f->v + (size_t)(y / 2) * f->uv_stride;
+    if (f->uv_step == 2)
+        yuv_rows(cur, next, below, y0, y0 + f->width, u, v, f->width, 2);
+    else
+        yuv_rows(cur, next, below, y0, y0 + f->width, u, v, f->width, 1);
+}
@@ -0,0 +1,63 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef DEBAYER_H
+#define DEBAYER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Row-at-a-time demosaic kernels. Each call produces one interleaved
+// 8-bit row of output for row y of the raw frame, so encoders can stream
+// rows straight out without a full-frame RGB buffer. debayer_rows() takes
+// the three raw rows around y directly, for callers that produce raw rows
+// on the fly.
+void debayer_rows(const uint16_t *above, const uint16_t *cur, const uint16_t *below,
+                  uint8_t *row, int width, int y);
+void debayer_row(const uint16_t *src, uint8_t *row, int width, int height, int y);
+
+// Planar 4:2:0 output for video encoders: a full-resolution Y plane, then
+// either one interleaved UV plane (NV12) or separate U and V planes (I420).
+enum yuv_layout {
+    YUV_NV12,
+    YUV_I420,
+};
+
+struct yuv_frame {
+    uint8_t *y;
+    uint8_t *u;
+    uint8_t *v;         // u + 1 for NV12
+    int     width;
+    int     uv_stride;  // bytes per chroma row
+    int     uv_step;    // bytes between chroma samples: 2 for NV12, 1 for I420
+};
+
+size_t yuv_frame_size(int width, int height);
+void   yuv_frame_init(struct yuv_frame *f, uint8_t *buf, int width, int height, int layout);
+
+// Demosaics raw rows y and y + 1 (y even) straight to luma rows y and y + 1
+// and chroma row y / 2, converting in fixed point (BT.601, studio swing) and
+// averaging chroma over each 2x2 quad. below is raw row y + 2, or row y for
+// the last pair. Width and height must be even.
+void debayer_yuv_rows(const uint16_t *cur, const uint16_t *next, const uint16_t *below,
+                      struct yuv_frame *f, int y);
+void ahd_debayer(const uint16_t *src, uint8_t *row, int width, int height, int y,
+                 uint16_t *h_interp, uint16_t *v_interp);
+
+#endif
@@ -0,0 +1,438 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <png.h>
+#include <jpeglib.h>
+#include <jerror.h>
+#include "encode.h"
+#include "debayer.h"
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+int encode_format_parse(const char *name, int *format) {
+    if (!strcasecmp(name, "png"))
+        *format = ENCODE_PNG;
+    else if (!strcasecmp(name, "jpeg") || !strcasecmp(name, "jpg"))
+        *format = ENCODE_JPEG;
+    else if (!strcasecmp(name, "qoi"))
+        *format = ENCODE_QOI;
+    else if (!strcasecmp(name, "raw"))
+        *format = ENCODE_RAW;
+    else if (!strcasecmp(name, "nv12"))
+        *format = ENCODE_NV12;
+    else if (!strcasecmp(name, "i420") || !strcasecmp(name, "yuv420p"))
+        *format = ENCODE_I420;
+    else
+        return -1;
+    return 0;
+}
+
+const char *encode_format_ext(int format) {
+    switch (format) {
+    case ENCODE_JPEG:   return "jpg";
+    case ENCODE_QOI:    return "qoi";
+    case ENCODE_RAW:    return "raw";
+    case ENCODE_NV12:   return "nv12";
+    case ENCODE_I420:   return "yuv";
+    default:            return "png";
+    }
+}
+
+size_t encode_arena_size(int width) {
+    // Output row, the two AHD interpolation rows, the three corrected raw
+    // rows and the QOI chunk buffer on top of the fixed codec budget.
+    return ENCODE_ARENA_BASE + (size_t)width * (3 + 3 * 2 * sizeof(uint16_t) + 3 * sizeof(uint16_t) + 4);
+}
+
+// Whole-frame formats are built in the scratch arena before being written,
+// so it must hold the frame as well; the row-streaming codecs need nothing.
+size_t encode_frame_size(int format, int width, int height) {
+    if (format == ENCODE_NV12 || format == ENCODE_I420)
+        return yuv_frame_size(width, height);
+    return 0;
+}
+
+static int sink_flush(struct file_sink *sink) {
+    size_t off = 0;
+    while (off < sink->len) {
+        ssize_t n = write(sink->fd, sink->buf + off, sink->len - off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        off += n;
+    }
+    sink->written += sink->len;
+    sink->len = 0;
+    return 0;
+}
+
+static int sink_write(struct file_sink *sink, const void *data, size_t length) {
+    const uint8_t *p = (const uint8_t *)data;
+    while (length > 0) {
+        size_t n = MIN(length, sink->cap - sink->len);
+        memcpy(sink->buf + sink->len, p, n);
+        sink->len += n;
+        p += n;
+        length -= n;
+        if (sink->len == sink->cap && sink_flush(sink))
+            return -1;
+    }
+    return 0;
+}
+
+static void *scratch_alloc(struct encoder *enc, size_t size) {
+    void *p = arena_alloc(enc->scratch, size);
+    if (!p) {
+        fprintf(stderr, "Encode scratch arena exhausted\n");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+// --- PNG (libpng) ---------------------------------------------------------
+
+struct png_state {
+    png_structp png;
+    png_infop   info;
+};
+
+static png_voidp arena_png_malloc(png_structp png, png_alloc_size_t size) {
+    return arena_alloc((struct arena *)png_get_mem_ptr(png), size);
+}
+
+static void arena_png_free(png_structp png, png_voidp p) {
+    // Released in bulk by arena_rewind() once the image is written.
+}
+
+static void png_error_exit(png_structp png, png_const_charp msg) {
+    fprintf(stderr, "libpng: %s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+static void png_sink_write(png_structp png, png_bytep data, png_size_t length) {
+    if (sink_write((struct file_sink *)png_get_io_ptr(png), data, length))
+        png_error(png, "write failed");
+}
+
+static void png_sink_flush(png_structp png) {
+    if (sink_flush((struct file_sink *)png_get_io_ptr(png)))
+        png_error(png, "write failed");
+}
+
+static void png_begin(struct encoder *enc) {
+    struct png_state *st = (struct png_state *)scratch_alloc(enc, sizeof(*st));
+    enc->state = st;
+
+    st->png = png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, png_error_exit, NULL,
+                                        enc->scratch, arena_png_malloc, arena_png_free);
+    if (!st->png) {
+        fprintf(stderr, "png_create_write_struct failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    st->info = png_create_info_struct(st->png);
+    if (!st->info) {
+        fprintf(stderr, "png_create_info_struct failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    png_set_write_fn(st->png, &enc->sink, png_sink_write, png_sink_flush);
+
+    png_set_IHDR(st->png, st->info, enc->width, enc->height, 8, PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(st->png, st->info);
+}
+
+static void png_end(struct encoder *enc) {
+    struct png_state *st = (struct png_state *)enc->state;
+    png_write_end(st->png, NULL);
+    png_destroy_write_struct(&st->png, &st->info);
+}
+
+// --- JPEG (libjpeg-turbo) -------------------------------------------------
+
+// libjpeg-turbo picks its SIMD colour conversion and DCT at runtime. Its
+// memory manager allocates from the heap per image, so JPEG output is the
+// one path that is not allocation-free.
+struct jpeg_state {
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr       jerr;
+    struct jpeg_destination_mgr dest;
+    struct file_sink            *sink;
+};
+
+static void jpeg_sink_init(j_compress_ptr cinfo) {
+    struct jpeg_state *st = (struct jpeg_state *)cinfo->client_data;
+    st->dest.next_output_byte = st->sink->buf;
+    st->dest.free_in_buffer = st->sink->cap;
+}
+
+static boolean jpeg_sink_empty(j_compress_ptr cinfo) {
+    struct jpeg_state *st = (struct jpeg_state *)cinfo->client_data;
+    st->sink->len = st->sink->cap;
+    if (sink_flush(st->sink))
+        ERREXIT(cinfo, JERR_FILE_WRITE);
+    jpeg_sink_init(cinfo);
+    return TRUE;
+}
+
+static void jpeg_sink_term(j_compress_ptr cinfo) {
+    struct jpeg_state *st = (struct jpeg_state *)cinfo->client_data;
+    st->sink->len = st->sink->cap - st->dest.free_in_buffer;
+    if (sink_flush(st->sink))
+        ERREXIT(cinfo, JERR_FILE_WRITE);
+}
+
+static void jpeg_begin(struct encoder *enc, int quality) {
+    struct jpeg_state *st = (struct jpeg_state *)scratch_alloc(enc, sizeof(*st));
+    enc->state = st;
+
+    // The default error_exit prints the message and exits.
+    st->cinfo.err = jpeg_std_error(&st->jerr);
+    jpeg_create_compress(&st->cinfo);
+    st->cinfo.client_data = st;
+
+    st->sink = &enc->sink;
+    st->dest.init_destination = jpeg_sink_init;
+    st->dest.empty_output_buffer = jpeg_sink_empty;
+    st->dest.term_destination = jpeg_sink_term;
+    st->cinfo.dest = &st->dest;
+
+    st->cinfo.image_width = enc->width;
+    st->cinfo.image_height = enc->height;
+    st->cinfo.input_components = 3;
+    st->cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&st->cinfo);
+    jpeg_set_quality(&st->cinfo, quality, TRUE);
+    jpeg_start_compress(&st->cinfo, TRUE);
+}
+
+static void jpeg_write_row(struct encoder *enc, const uint8_t *rgb) {
+    struct jpeg_state *st = (struct jpeg_state *)enc->state;
+    JSAMPROW row = (JSAMPROW)rgb;
+    jpeg_write_scanlines(&st->cinfo, &row, 1);
+}
+
+static void jpeg_end(struct encoder *enc) {
+    struct jpeg_state *st = (struct jpeg_state *)enc->state;
+    jpeg_finish_compress(&st->cinfo);
+    jpeg_destroy_compress(&st->cinfo);
+}
+
+// --- QOI ------------------------------------------------------------------
+
+// "Quite OK Image" lossless format (qoiformat.org). One pass, no entropy
+// coder, O(1) state: a 64-entry colour cache, the previous pixel and the
+// current run length, all of which carry across rows. Cache entries are
+// RGBA: they start out as transparent black, which must not match an
+// opaque black pixel.
+#define QOI_OP_INDEX    0x00
+#define QOI_OP_DIFF     0x40
+#define QOI_OP_LUMA     0x80
+#define QOI_OP_RUN      0xc0
+#define QOI_OP_RGB      0xfe
+
+struct qoi_state {
+    uint8_t index[64][4];
+    uint8_t prev[3];
+    int     run;
+    uint8_t *chunk;     // worst case 4 bytes per pixel of one row
+};
+
+static void qoi_put32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void qoi_begin(struct encoder *enc) {
+    struct qoi_state *st = (struct qoi_state *)scratch_alloc(enc, sizeof(*st));
+    uint8_t header[14];
+
+    memset(st, 0, sizeof(*st));
+    st->chunk = (uint8_t *)scratch_alloc(enc, (size_t)enc->width * 4);
+    enc->state = st;
+
+    memcpy(header, "qoif", 4);
+    qoi_put32(header + 4, enc->width);
+    qoi_put32(header + 8, enc->height);
+    header[12] = 3;     // channels
+    header[13] = 0;     // sRGB with linear alpha
+    if (sink_write(&enc->sink, header, sizeof(header))) {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void qoi_write_row(struct encoder *enc, const uint8_t *rgb) {
+    struct qoi_state *st = (struct qoi_state *)enc->state;
+    uint8_t *out = st->chunk;
+
+    for (int x = 0; x < enc->width; x++, rgb += 3) {
+        if (rgb[0] == st->prev[0] && rgb[1] == st->prev[1] && rgb[2] == st->prev[2]) {
+            if (++st->run == 62) {
+                *out++ = QOI_OP_RUN | (st->run - 1);
+                st->run = 0;
+            }
+            continue;
+        }
+        if (st->run) {
+            *out++ = QOI_OP_RUN | (st->run - 1);
+            st->run = 0;
+        }
+
+        // Alpha is always 255, which contributes 255 * 11 to the hash.
+        int hash = (rgb[0] * 3 + rgb[1] * 5 + rgb[2] * 7 + 255 * 11) % 64;
+        if (st->index[hash][3] == 255 && !memcmp(st->index[hash], rgb, 3)) {
+            *out++ = QOI_OP_INDEX | hash;
+        } else {
+            memcpy(st->index[hash], rgb, 3);
+            st->index[hash][3] = 255;
+
+            int8_t vr = rgb[0] - st->prev[0];
+            int8_t vg = rgb[1] - st->prev[1];
+            int8_t vb = rgb[2] - st->prev[2];
+            int8_t vg_r = vr - vg;
+            int8_t vg_b = vb - vg;
+
+            if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                *out++ = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+            } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8) {
+                *out++ = QOI_OP_LUMA | (vg + 32);
+                *out++ = (vg_r + 8) << 4 | (vg_b + 8);
+            } else {
+                *out++ = QOI_OP_RGB;
+                *out++ = rgb[0];
+                *out++ = rgb[1];
+                *out++ = rgb[2];
+            }
+        }
+        memcpy(st->prev, rgb, 3);
+    }
+
+    if (sink_write(&enc->sink, st->chunk, out - st->chunk)) {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void qoi_end(struct encoder *enc) {
+    struct qoi_state *st = (struct qoi_state *)enc->state;
+    static const uint8_t padding[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+    uint8_t op;
+
+    if (st->run) {
+        op = QOI_OP_RUN | (st->run - 1);
+        if (sink_write(&enc->sink, &op, 1)) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (sink_write(&enc->sink, padding, sizeof(padding))) {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// --------------------------------------------------------------------------
+
+void encoder_begin(struct encoder *enc, int format, int quality, const char *filename,
+                   int width, int height, struct arena *scratch) {
+    memset(enc, 0, sizeof(*enc));
+    enc->format = format;
+    enc->width = width;
+    enc->height = height;
+    enc->scratch = scratch;
+    enc->mark = arena_mark(scratch);
+
+    enc->sink.cap = ENCODE_STAGING_SIZE;
+    enc->sink.buf = (uint8_t *)scratch_alloc(enc, enc->sink.cap);
+    enc->sink.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (enc->sink.fd < 0) {
+        perror("Error opening output file");
+        exit(EXIT_FAILURE);
+    }
+
+    switch (format) {
+    case ENCODE_JPEG:   jpeg_begin(enc, quality); break;
+    case ENCODE_QOI:    qoi_begin(enc); break;
+    default:            png_begin(enc); break;
+    }
+}
+
+void encoder_write_row(struct encoder *enc, const uint8_t *rgb) {
+    switch (enc->format) {
+    case ENCODE_JPEG:
+        jpeg_write_row(enc, rgb);
+        break;
+    case ENCODE_QOI:
+        qoi_write_row(enc, rgb);
+        break;
+    default:
+        png_write_row(((struct png_state *)enc->state)->png, (png_const_bytep)rgb);
+        break;
+    }
+}
+
+void encoder_end(struct encoder *enc) {
+    switch (enc->format) {
+    case ENCODE_JPEG:   jpeg_end(enc); break;
+    case ENCODE_QOI:    qoi_end(enc); break;
+    default:            png_end(enc); break;
+    }
+
+    if (sink_flush(&enc->sink)) {
+        perror("write");
+        exit(EXIT_FAILURE);
+    }
+    close(enc->sink.fd);
+    arena_rewind(enc->scratch, enc->mark);
+}
+
+void encode_raw_frame(const void *raw, size_t size, const char *filename) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("Error opening output file");
+        exit(EXIT_FAILURE);
+    }
+
+    const uint8_t *p = (const uint8_t *)raw;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        p += n;
+        size -= n;
+    }
+    close(fd);
+}
@@ -0,0 +1,76 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef ENCODE_H
+#define ENCODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+
+enum encode_format {
+    ENCODE_PNG,
+    ENCODE_JPEG,
+    ENCODE_QOI,
+    ENCODE_RAW,     // undemosaiced sensor data, e.g. for bench_encode
+    ENCODE_NV12,    // planar YUV 4:2:0 for video encoders, written whole
+    ENCODE_I420,
+};
+
+// Fixed budget for codec state (libpng/zlib deflate) and the output
+// staging buffer; encode_arena_size() adds the per-width row buffers.
+#define ENCODE_ARENA_BASE   (1u << 20)
+#define ENCODE_STAGING_SIZE (64u << 10)
+
+// Buffered writes to a plain fd; stdio would malloc a FILE per save.
+struct file_sink {
+    int     fd;
+    uint8_t *buf;
+    size_t  len;
+    size_t  cap;
+    size_t  written;    // bytes flushed to the file so far
+};
+
+// Row-streaming image writer. Rows of interleaved 8-bit RGB go in one at a
+// time, exactly as the demosaic produces them, and the selected codec
+// writes them out. Codec state lives in the caller's scratch arena and is
+// released by encoder_end(). Errors are fatal, as for the capture itself.
+struct encoder {
+    int              format;
+    int              width;
+    int              height;
+    struct arena     *scratch;
+    size_t           mark;
+    struct file_sink sink;
+    void             *state;
+};
+
+int         encode_format_parse(const char *name, int *format);
+const char *encode_format_ext(int format);
+size_t      encode_arena_size(int width);
+size_t      encode_frame_size(int format, int width, int height);
+
+void encoder_begin(struct encoder *enc, int format, int quality, const char *filename,
+                   int width, int height, struct arena *scratch);
+void encoder_write_row(struct encoder *enc, const uint8_t *rgb);
+void encoder_end(struct encoder *enc);
+
+void encode_raw_frame(const void *raw, size_t size, const char *filename);
+
+#endif
@@ -0,0 +1,735 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// Fault-injecting fake V4L2 capture device, for testing the capture and
+// recovery paths without a camera. Built as a preload library, it stands in
+// for one device node and streams synthetic SRGGB10 frames:
+//
+//   g++ -O2 -shared -fPIC -o fake_v4l2.so fake_v4l2.cpp -ldl -lpthread
+//   export FAKE_V4L2_FAULTS=eio@100,unplug@250:800
+//   LD_PRELOAD=./fake_v4l2.so ./v4l2_png -d /dev/video-fake --frames 400
+//
+// FAKE_V4L2_DEVICE names the node (default /dev/video-fake). FAKE_V4L2_FAULTS
+// is a comma-separated list of KIND@FRAME[:ARG], each firing once when the
+// fake has produced FRAME frames:
+//
+//   error@N:K     the next K frames (default 10) carry V4L2_BUF_FLAG_ERROR
+//   eio@N         the queue fails: QBUF/DQBUF return EIO until STREAMOFF
+//   stall@N       frames stop until the next STREAMOFF/STREAMON
+//   unplug@N:MS   the device disappears: every open file gets ENODEV and
+//                 open() fails with ENOENT for MS ms (default 500)
+//
+// The model follows videobuf2 where the recovery code depends on it: the
+// buffers belong to the file that requested them and stay allocated while
+// any of them is mapped, so REQBUFS from another file fails with EBUSY until
+// the old file is closed and every buffer unmapped.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <linux/videodev2.h>
+
+#define FAKE_MAX_BUFFERS    32
+#define FAKE_MAX_FILES      8
+#define FAKE_MAX_HANDLES    16
+#define FAKE_MAX_FAULTS     16
+#define FAKE_MAX_CONTROLS   16
+
+enum fake_fault_kind { FAULT_ERROR, FAULT_EIO, FAULT_STALL, FAULT_UNPLUG };
+enum fake_buffer_state { BUF_IDLE, BUF_QUEUED, BUF_DONE };
+
+struct fake_buffer {
+    int             memfd;
+    uint8_t         *mem;           // the fake's own mapping
+    void            *app_addr;      // the program's mapping, if any
+    int             state;
+    uint64_t        order;          // FIFO order within QUEUED and DONE
+    uint32_t        sequence;
+    uint32_t        flags;
+    struct timeval  timestamp;
+};
+
+struct fake_file {
+    int     used;
+    int     generation;             // dead once the device was unplugged
+};
+
+// An fd referring to a fake file; dup2() can make several.
+struct fake_handle {
+    int     fd;
+    int     file;
+};
+
+struct fake_fault {
+    int             kind;
+    unsigned long   at;
+    int             arg;
+};
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_close)(int);
+static int (*real_dup2)(int, int);
+static int (*real_dup3)(int, int, int);
+static int (*real_ioctl)(int, unsigned long, ...);
+static void *(*real_mmap)(void *, size_t, int, int, int, off_t);
+static int (*real_munmap)(void *, size_t);
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char device_path[256] = "/dev/video-fake";
+static struct fake_file files[FAKE_MAX_FILES];
+static struct fake_handle handles[FAKE_MAX_HANDLES];
+static int n_handles;
+static int generation;
+static double unplugged_until_ms;
+
+static uint32_t width = 1920, height = 1080;
+static uint32_t interval_num = 1, interval_den = 30;
+static struct { uint32_t id; int32_t value; } controls[FAKE_MAX_CONTROLS];
+static int n_controls;
+
+static struct fake_buffer buffers[FAKE_MAX_BUFFERS];
+static unsigned int n_buffers;
+static size_t buffer_stride;
+static int owner = -1;              // file that requested the buffers
+static int owner_closed;
+static int streaming;
+static int queue_error;
+static int stalled;
+static int error_frames;
+static uint64_t next_order;
+static uint32_t sequence;
+static unsigned long frames_produced;
+
+static struct fake_fault faults[FAKE_MAX_FAULTS];
+static int n_faults;
+static pthread_t producer;
+static int producer_started;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static size_t frame_bytes(void) {
+    return (size_t)width * height * 2;
+}
+
+static void parse_faults(const char *spec) {
+    static const char *names[] = { "error", "eio", "stall", "unplug" };
+    char copy[1024];
+    snprintf(copy, sizeof(copy), "%s", spec);
+
+    for (char *tok = strtok(copy, ","); tok && n_faults < FAKE_MAX_FAULTS; tok = strtok(NULL, ",")) {
+        char kind[16];
+        unsigned long at;
+        int arg = -1, k;
+        if (sscanf(tok, "%15[a-z]@%lu:%d", kind, &at, &arg) < 2) {
+            fprintf(stderr, "fake_v4l2: bad fault '%s'\n", tok);
+            continue;
+        }
+        for (k = 0; k < 4 && strcmp(kind, names[k]); k++)
+            ;
+        if (k == 4) {
+            fprintf(stderr, "fake_v4l2: unknown fault '%s'\n", kind);
+            continue;
+        }
+        if (arg < 0)
+            arg = k == FAULT_ERROR ? 10 : k == FAULT_UNPLUG ? 500 : 0;
+        faults[n_faults++] = (struct fake_fault){ k, at, arg };
+    }
+}
+
+// Also called from the interposed functions: another preloaded library
+// (a sanitizer runtime, say) may call them before our constructor ran.
+static void resolve_symbols(void) {
+    if (real_munmap)
+        return;
+    real_open = (int (*)(const char *, int, ...))dlsym(RTLD_NEXT, "open");
+    real_close = (int (*)(int))dlsym(RTLD_NEXT, "close");
+    real_dup2 = (int (*)(int, int))dlsym(RTLD_NEXT, "dup2");
+    real_dup3 = (int (*)(int, int, int))dlsym(RTLD_NEXT, "dup3");
+    real_ioctl = (int (*)(int, unsigned long, ...))dlsym(RTLD_NEXT, "ioctl");
+    real_mmap = (void *(*)(void *, size_t, int, int, int, off_t))dlsym(RTLD_NEXT, "mmap");
+    real_munmap = (int (*)(void *, size_t))dlsym(RTLD_NEXT, "munmap");
+}
+
+__attribute__((constructor)) static void fake_init(void) {
+    resolve_symbols();
+
+    const char *path = getenv("FAKE_V4L2_DEVICE");
+    if (path)
+        snprintf(device_path, sizeof(device_path), "%s", path);
+    const char *spec = getenv("FAKE_V4L2_FAULTS");
+    if (spec)
+        parse_faults(spec);
+}
+
+// --- bookkeeping, all under lock --------------------------------------------
+
+static int find_handle(int fd) {
+    for (int i = 0; i < n_handles; i++) {
+        if (handles[i].fd == fd)
+            return i;
+    }
+    return -1;
+}
+
+static void wake_file(int file) {
+    uint64_t one = 1;
+    for (int i = 0; i < n_handles; i++) {
+        if (handles[i].file == file) {
+            if (write(handles[i].fd, &one, sizeof(one)) < 0) {
+                // Counter full; the reader is awake anyway.
+            }
+            return;
+        }
+    }
+}
+
+// The eventfd counts done buffers (semaphore mode), so select() and
+// poll() on the fake fd behave like on a real device.
+static void consume_wakeup(int file) {
+    uint64_t n;
+    for (int i = 0; i < n_handles; i++) {
+        if (handles[i].file == file) {
+            if (read(handles[i].fd, &n, sizeof(n)) < 0) {
+                // Already drained by an error wakeup.
+            }
+            return;
+        }
+    }
+}
+
+static void drain_file(int file) {
+    uint64_t n;
+    for (int i = 0; i < n_handles; i++) {
+        if (handles[i].file == file) {
+            while (read(handles[i].fd, &n, sizeof(n)) == sizeof(n))
+                ;
+            return;
+        }
+    }
+}
+
+static void free_buffers(void) {
+    for (unsigned int i = 0; i < n_buffers; i++) {
+        real_munmap(buffers[i].mem, buffer_stride);
+        real_close(buffers[i].memfd);
+    }
+    memset(buffers, 0, sizeof(buffers));
+    n_buffers = 0;
+    owner = -1;
+    owner_closed = 0;
+    streaming = 0;
+}
+
+static int buffers_mapped(void) {
+    for (unsigned int i = 0; i < n_buffers; i++) {
+        if (buffers[i].app_addr)
+            return 1;
+    }
+    return 0;
+}
+
+// Drops an fd; the file goes away with its last fd, and the buffers with
+// the owning file once nothing maps them.
+static void drop_handle(int h) {
+    int file = handles[h].file;
+    handles[h] = handles[--n_handles];
+    for (int i = 0; i < n_handles; i++) {
+        if (handles[i].file == file)
+            return;
+    }
+    files[file].used = 0;
+    if (file == owner) {
+        streaming = 0;
+        owner_closed = 1;
+        if (!buffers_mapped())
+            free_buffers();
+    }
+}
+
+// --- frame source -------------------------------------------------------------
+
+// A horizontal ramp per Bayer channel with a bright square that moves one
+// step per frame, so demosaic, motion detection and encoders all see
+// something that changes. Red sits 64 levels above blue, with green
+// between them, so a swapped channel order shows up.
+static void fill_frame(uint16_t *dst, uint32_t seq) {
+    static const int tint[2][2] = { { 64, 32 }, { 32, 0 } };   // RGGB
+    int box = height / 8, bx = (seq * 8) % (width - box), by = height / 2 - box / 2;
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            int v = 64 + x * 768 / width + tint[y & 1][x & 1];
+            if ((int)x >= bx && (int)x < bx + box && (int)y >= by && (int)y < by + box)
+                v = 960;
+            dst[(size_t)y * width + x] = v;
+        }
+    }
+}
+
+static void fire_faults(void) {
+    for (int i = 0; i < n_faults; i++) {
+        if (faults[i].at != frames_produced)
+            continue;
+        switch (faults[i].kind) {
+        case FAULT_ERROR:
+            fprintf(stderr, "fake_v4l2: frame %lu: %d corrupt frames\n", frames_produced, faults[i].arg);
+            error_frames = faults[i].arg;
+            break;
+        case FAULT_EIO:
+            fprintf(stderr, "fake_v4l2: frame %lu: queue error\n", frames_produced);
+            queue_error = 1;
+            wake_file(owner);
+            break;
+        case FAULT_STALL:
+            fprintf(stderr, "fake_v4l2: frame %lu: stream stalled\n", frames_produced);
+            stalled = 1;
+            break;
+        case FAULT_UNPLUG:
+            fprintf(stderr, "fake_v4l2: frame %lu: unplugged for %d ms\n", frames_produced, faults[i].arg);
+            // Every open file is now dead. The program's mappings stay
+            // valid memory, as they would after a real disconnect.
+            generation++;
+            unplugged_until_ms = now_ms() + faults[i].arg;
+            for (int h = 0; h < n_handles; h++)
+                wake_file(handles[h].file);
+            free_buffers();
+            break;
+        }
+    }
+}
+
+static void *producer_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        useconds_t interval = (useconds_t)(1e6 * interval_num / interval_den);
+        pthread_mutex_unlock(&lock);
+        usleep(interval);
+
+        pthread_mutex_lock(&lock);
+        if (!streaming || stalled || queue_error) {
+            pthread_mutex_unlock(&lock);
+            continue;
+        }
+        frames_produced++;
+        fire_faults();
+        if (!streaming || stalled || queue_error) {
+            pthread_mutex_unlock(&lock);
+            continue;
+        }
+
+        struct fake_buffer *buf = NULL;
+        for (unsigned int i = 0; i < n_buffers; i++) {
+            if (buffers[i].state == BUF_QUEUED && (!buf || buffers[i].order < buf->order))
+                buf = &buffers[i];
+        }
+        if (!buf) {
+            sequence++;     // dropped: nothing queued
+            pthread_mutex_unlock(&lock);
+            continue;
+        }
+        fill_frame((uint16_t *)buf->mem, sequence);
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        buf->timestamp.tv_sec = ts.tv_sec;
+        buf->timestamp.tv_usec = ts.tv_nsec / 1000;
+        buf->sequence = sequence++;
+        buf->flags = 0;
+        if (error_frames > 0) {
+            buf->flags = V4L2_BUF_FLAG_ERROR;
+            error_frames--;
+        }
+        buf->state = BUF_DONE;
+        buf->order = next_order++;
+        wake_file(owner);
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+// --- ioctls -------------------------------------------------------------------
+
+static void fill_format(struct v4l2_format *fmt) {
+    memset(&fmt->fmt.pix, 0, sizeof(fmt->fmt.pix));
+    fmt->fmt.pix.width = width;
+    fmt->fmt.pix.height = height;
+    fmt->fmt.pix.pixelformat = V4L2_PIX_FMT_SRGGB10;
+    fmt->fmt.pix.field = V4L2_FIELD_NONE;
+    fmt->fmt.pix.bytesperline = width * 2;
+    fmt->fmt.pix.sizeimage = frame_bytes();
+}
+
+static int32_t *find_control(uint32_t id, int create) {
+    for (int i = 0; i < n_controls; i++) {
+        if (controls[i].id == id)
+            return &controls[i].value;
+    }
+    if (!create || n_controls == FAKE_MAX_CONTROLS)
+        return NULL;
+    controls[n_controls].id = id;
+    controls[n_controls].value = 0;
+    return &controls[n_controls++].value;
+}
+
+static int request_buffers(int file, struct v4l2_requestbuffers *req) {
+    if (req->memory != V4L2_MEMORY_MMAP || req->type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+        return EINVAL;
+    if (n_buffers && owner != file) {
+        if (!owner_closed || buffers_mapped())
+            return EBUSY;
+        free_buffers();
+    }
+    if (streaming)
+        return EBUSY;
+    if (n_buffers) {
+        if (buffers_mapped())
+            return EBUSY;
+        free_buffers();
+    }
+    if (req->count == 0)
+        return 0;
+
+    unsigned int count = req->count > FAKE_MAX_BUFFERS ? FAKE_MAX_BUFFERS : req->count;
+    long page = sysconf(_SC_PAGESIZE);
+    buffer_stride = (frame_bytes() + page - 1) / page * page;
+    for (n_buffers = 0; n_buffers < count; n_buffers++) {
+        struct fake_buffer *buf = &buffers[n_buffers];
+        buf->memfd = memfd_create("fake_v4l2", MFD_CLOEXEC);
+        if (buf->memfd < 0 || ftruncate(buf->memfd, buffer_stride) < 0)
+            return ENOMEM;
+        buf->mem = (uint8_t *)real_mmap(NULL, buffer_stride, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                        buf->memfd, 0);
+        if (buf->mem == MAP_FAILED)
+            return ENOMEM;
+    }
+    owner = file;
+    owner_closed = 0;
+    req->count = n_buffers;
+    return 0;
+}
+
+static int fake_ioctl(int file, unsigned long request, void *arg) {
+    if (files[file].generation != generation)
+        return ENODEV;
+
+    switch (request) {
+    case VIDIOC_QUERYCAP: {
+        struct v4l2_capability *cap = (struct v4l2_capability *)arg;
+        memset(cap, 0, sizeof(*cap));
+        strcpy((char *)cap->driver, "fake_v4l2");
+        strcpy((char *)cap->card, "Fault-injecting fake camera");
+        strcpy((char *)cap->bus_info, "platform:fake");
+        cap->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+        cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+        return 0;
+    }
+    case VIDIOC_G_FMT:
+        fill_format((struct v4l2_format *)arg);
+        return 0;
+    case VIDIOC_S_FMT: {
+        struct v4l2_format *fmt = (struct v4l2_format *)arg;
+        if (n_buffers)
+            return EBUSY;
+        width = fmt->fmt.pix.width < 16 ? 16 : fmt->fmt.pix.width & ~1u;
+        height = fmt->fmt.pix.height < 16 ? 16 : fmt->fmt.pix.height & ~1u;
+        fill_format(fmt);
+        return 0;
+    }
+    case VIDIOC_G_PARM:
+    case VIDIOC_S_PARM: {
+        struct v4l2_streamparm *parm = (struct v4l2_streamparm *)arg;
+        struct v4l2_fract *tpf = &parm->parm.capture.timeperframe;
+        if (request == VIDIOC_S_PARM && tpf->numerator && tpf->denominator) {
+            interval_num = tpf->numerator;
+            interval_den = tpf->denominator;
+        }
+        tpf->numerator = interval_num;
+        tpf->denominator = interval_den;
+        parm->parm.capture.capability = V4L2_CAP_TIMEPERFRAME;
+        return 0;
+    }
+    case VIDIOC_QUERYCTRL: {
+        struct v4l2_queryctrl *q = (struct v4l2_queryctrl *)arg;
+        uint32_t id = q->id;
+        memset(q, 0, sizeof(*q));
+        q->id = id;
+        q->type = V4L2_CTRL_TYPE_INTEGER;
+        snprintf((char *)q->name, sizeof(q->name), "Control 0x%08x", id);
+        q->maximum = 1 << 20;
+        q->step = 1;
+        return 0;
+    }
+    case VIDIOC_G_CTRL:
+    case VIDIOC_S_CTRL: {
+        struct v4l2_control *c = (struct v4l2_control *)arg;
+        int32_t *v = find_control(c->id, request == VIDIOC_S_CTRL);
+        if (request == VIDIOC_S_CTRL && v)
+            *v = c->value;
+        c->value = v ? *v : 0;
+        return 0;
+    }
+    case VIDIOC_G_INPUT:
+        *(int *)arg = 0;
+        return 0;
+    case VIDIOC_ENUMINPUT: {
+        struct v4l2_input *in = (struct v4l2_input *)arg;
+        if (in->index != 0)
+            return EINVAL;
+        strcpy((char *)in->name, "Camera");
+        in->type = V4L2_INPUT_TYPE_CAMERA;
+        in->status = 0;
+        return 0;
+    }
+    case VIDIOC_REQBUFS:
+        return request_buffers(file, (struct v4l2_requestbuffers *)arg);
+    }
+
+    // Buffer and streaming ioctls belong to the file that owns the queue.
+    if (file != owner || owner_closed)
+        return request == VIDIOC_QUERYBUF || request == VIDIOC_QBUF || request == VIDIOC_DQBUF ||
+               request == VIDIOC_STREAMON || request == VIDIOC_STREAMOFF ? EBUSY : ENOTTY;
+
+    struct v4l2_buffer *vb = (struct v4l2_buffer *)arg;
+    enum v4l2_buf_type *type = (enum v4l2_buf_type *)arg;
+    switch (request) {
+    case VIDIOC_QUERYBUF:
+        if (vb->index >= n_buffers)
+            return EINVAL;
+        vb->length = frame_bytes();
+        vb->m.offset = vb->index * buffer_stride;
+        vb->flags = buffers[vb->index].app_addr ? V4L2_BUF_FLAG_MAPPED : 0;
+        return 0;
+    case VIDIOC_QBUF:
+        if (queue_error)
+            return EIO;
+        if (vb->index >= n_buffers || buffers[vb->index].state != BUF_IDLE)
+            return EINVAL;
+        buffers[vb->index].state = BUF_QUEUED;
+        buffers[vb->index].order = next_order++;
+        return 0;
+    case VIDIOC_DQBUF: {
+        if (queue_error)
+            return EIO;
+        struct fake_buffer *buf = NULL;
+        for (unsigned int i = 0; i < n_buffers; i++) {
+            if (buffers[i].state == BUF_DONE && (!buf || buffers[i].order < buf->order))
+                buf = &buffers[i];
+        }
+        if (!buf)
+            return EAGAIN;
+        consume_wakeup(file);
+        buf->state = BUF_IDLE;
+        vb->index = buf - buffers;
+        vb->bytesused = frame_bytes();
+        vb->length = frame_bytes();
+        vb->flags = buf->flags | V4L2_BUF_FLAG_MAPPED | V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+        vb->field = V4L2_FIELD_NONE;
+        vb->timestamp = buf->timestamp;
+        vb->sequence = buf->sequence;
+        vb->m.offset = vb->index * buffer_stride;
+        return 0;
+    }
+    case VIDIOC_STREAMON:
+        if (*type != V4L2_BUF_TYPE_VIDEO_CAPTURE || !n_buffers)
+            return EINVAL;
+        streaming = 1;
+        stalled = 0;
+        if (!producer_started) {
+            pthread_create(&producer, NULL, producer_main, NULL);
+            pthread_detach(producer);
+            producer_started = 1;
+        }
+        return 0;
+    case VIDIOC_STREAMOFF:
+        if (*type != V4L2_BUF_TYPE_VIDEO_CAPTURE)
+            return EINVAL;
+        streaming = 0;
+        queue_error = 0;
+        stalled = 0;
+        for (unsigned int i = 0; i < n_buffers; i++)
+            buffers[i].state = BUF_IDLE;
+        drain_file(file);
+        return 0;
+    }
+    return ENOTTY;
+}
+
+// --- interposed libc functions ------------------------------------------------
+
+extern "C" {
+
+int open(const char *path, int flags, ...) {
+    resolve_symbols();
+    va_list ap;
+    va_start(ap, flags);
+    mode_t mode = va_arg(ap, mode_t);
+    va_end(ap);
+
+    if (strcmp(path, device_path))
+        return real_open(path, flags, mode);
+
+    pthread_mutex_lock(&lock);
+    int file = 0;
+    while (file < FAKE_MAX_FILES && files[file].used)
+        file++;
+    if (now_ms() < unplugged_until_ms || file == FAKE_MAX_FILES || n_handles == FAKE_MAX_HANDLES) {
+        pthread_mutex_unlock(&lock);
+        errno = file == FAKE_MAX_FILES ? EMFILE : ENOENT;
+        return -1;
+    }
+    int fd = eventfd(0, EFD_SEMAPHORE | EFD_NONBLOCK | (flags & O_CLOEXEC ? EFD_CLOEXEC : 0));
+    if (fd >= 0) {
+        files[file] = (struct fake_file){ 1, generation };
+        handles[n_handles++] = (struct fake_handle){ fd, file };
+    }
+    pthread_mutex_unlock(&lock);
+    return fd;
+}
+
+int open64(const char *path, int flags, ...) {
+    va_list ap;
+    va_start(ap, flags);
+    mode_t mode = va_arg(ap, mode_t);
+    va_end(ap);
+    return open(path, flags, mode);
+}
+
+int close(int fd) {
+    resolve_symbols();
+    pthread_mutex_lock(&lock);
+    int h = find_handle(fd);
+    if (h >= 0)
+        drop_handle(h);
+    pthread_mutex_unlock(&lock);
+    return real_close(fd);
+}
+
+static void moved_fd(int oldfd, int newfd) {
+    if (oldfd == newfd)
+        return;
+    pthread_mutex_lock(&lock);
+    int h = find_handle(newfd);
+    if (h >= 0)
+        drop_handle(h);
+    int old = find_handle(oldfd);
+    if (old >= 0 && n_handles < FAKE_MAX_HANDLES)
+        handles[n_handles++] = (struct fake_handle){ newfd, handles[old].file };
+    pthread_mutex_unlock(&lock);
+}
+
+int dup2(int oldfd, int newfd) {
+    resolve_symbols();
+    int r = real_dup2(oldfd, newfd);
+    if (r >= 0)
+        moved_fd(oldfd, newfd);
+    return r;
+}
+
+int dup3(int oldfd, int newfd, int flags) {
+    resolve_symbols();
+    int r = real_dup3(oldfd, newfd, flags);
+    if (r >= 0)
+        moved_fd(oldfd, newfd);
+    return r;
+}
+
+int ioctl(int fd, unsigned long request, ...) {
+    resolve_symbols();
+    va_list ap;
+    va_start(ap, request);
+    void *arg = va_arg(ap, void *);
+    va_end(ap);
+
+    pthread_mutex_lock(&lock);
+    int h = find_handle(fd);
+    if (h < 0) {
+        pthread_mutex_unlock(&lock);
+        return real_ioctl(fd, request, arg);
+    }
+    int err = fake_ioctl(handles[h].file, request, arg);
+    pthread_mutex_unlock(&lock);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    resolve_symbols();
+    pthread_mutex_lock(&lock);
+    int h = find_handle(fd);
+    if (h < 0) {
+        pthread_mutex_unlock(&lock);
+        return real_mmap(addr, length, prot, flags, fd, offset);
+    }
+
+    int file = handles[h].file, err = 0;
+    unsigned int index = buffer_stride ? offset / buffer_stride : 0;
+    void *p = MAP_FAILED;
+    if (files[file].generation != generation)
+        err = ENODEV;
+    else if (file != owner || index >= n_buffers || buffers[index].app_addr)
+        err = EINVAL;
+    else if ((p = real_mmap(addr, length, prot, flags, buffers[index].memfd, 0)) == MAP_FAILED)
+        err = errno;
+    else
+        buffers[index].app_addr = p;
+    pthread_mutex_unlock(&lock);
+    if (err)
+        errno = err;
+    return p;
+}
+
+void *mmap64(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+    return mmap(addr, length, prot, flags, fd, offset);
+}
+
+int munmap(void *addr, size_t length) {
+    resolve_symbols();
+    pthread_mutex_lock(&lock);
+    for (unsigned int i = 0; i < n_buffers; i++) {
+        if (buffers[i].app_addr == addr) {
+            buffers[i].app_addr = NULL;
+            if (owner_closed && !buffers_mapped())
+                free_buffers();
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return real_munmap(addr, length);
+}
+
+}
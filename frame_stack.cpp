@@ -0,0 +1,126 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdio.h>
+#include <string.h>
+#include "cpu_dispatch.h"
+#include "frame_stack.h"
+
+int frame_stack_parse_mode(const char *name, int *mode) {
+    if (!strcmp(name, "mean")) {
+        *mode = STACK_MEAN;
+    } else if (!strcmp(name, "median")) {
+        *mode = STACK_MEDIAN;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int frame_stack_init(struct frame_stack *s, int width, int height, int depth, int mode) {
+    memset(s, 0, sizeof(*s));
+    if (depth < 1 || depth > FRAME_STACK_MAX_DEPTH ||
+        (mode == STACK_MEDIAN && depth > FRAME_STACK_MAX_MEDIAN)) {
+        fprintf(stderr, "Unsupported stack depth %d\n", depth);
+        return -1;
+    }
+
+    s->pixels = (size_t)width * height;
+    s->depth = depth;
+    s->mode = mode;
+
+    // Arena pages come zeroed, so the ring starts out as all-black frames
+    // and the first pushes subtract nothing.
+    size_t frame_bytes = s->pixels * sizeof(uint16_t);
+    if (-1 == arena_init(&s->mem, (depth + 1) * (frame_bytes + 64)))
+        return -1;
+    s->history = (uint16_t *)arena_alloc(&s->mem, depth * frame_bytes);
+    s->sum = (uint16_t *)arena_alloc(&s->mem, frame_bytes);
+    return 0;
+}
+
+void frame_stack_free(struct frame_stack *s) {
+    arena_free(&s->mem);
+    memset(s, 0, sizeof(*s));
+}
+
+// One pass in 16-bit lanes: the sum of up to 64 10-bit samples fits in 16
+// bits, and unsigned wraparound keeps add-new/subtract-old exact.
+KERNEL_CLONES
+void frame_stack_push(struct frame_stack *s, const uint16_t *raw) {
+    uint16_t *__restrict old = s->history + (size_t)s->head * s->pixels;
+    uint16_t *__restrict sum = s->sum;
+    const uint16_t *__restrict src = raw;
+
+    for (size_t i = 0; i < s->pixels; i++) {
+        uint16_t v = src[i] & 0x03FF;
+        sum[i] += v - old[i];
+        old[i] = v;
+    }
+
+    if (++s->head == s->depth)
+        s->head = 0;
+    if (s->count < s->depth)
+        s->count++;
+}
+
+KERNEL_CLONES
+static void output_mean(const struct frame_stack *s, uint16_t *__restrict dst) {
+    const uint16_t *__restrict sum = s->sum;
+    uint32_t n = s->count;
+
+    // Rounded sum / n as a multiply and shift in 32-bit lanes; with a
+    // 22-bit reciprocal this is exact for every n <= 64 and 10-bit input.
+    uint32_t recip = ((1u << 22) + n - 1) / n;
+    uint32_t half = n / 2;
+    for (size_t i = 0; i < s->pixels; i++)
+        dst[i] = ((sum[i] + half) * recip) >> 22;
+}
+
+static void output_median(const struct frame_stack *s, uint16_t *dst) {
+    uint16_t v[FRAME_STACK_MAX_MEDIAN];
+    int n = s->count;
+
+    for (size_t i = 0; i < s->pixels; i++) {
+        // Insertion sort: n is small and the ring frames are read as n
+        // sequential streams.
+        for (int k = 0; k < n; k++) {
+            uint16_t x = s->history[(size_t)k * s->pixels + i];
+            int j = k;
+            while (j > 0 && v[j - 1] > x) {
+                v[j] = v[j - 1];
+                j--;
+            }
+            v[j] = x;
+        }
+        dst[i] = (n & 1) ? v[n / 2] : (v[n / 2 - 1] + v[n / 2] + 1) / 2;
+    }
+}
+
+// Writes the stacked frame as 10-bit samples in the sensor's layout, ready
+// for the demosaic.
+void frame_stack_output(const struct frame_stack *s, uint16_t *dst) {
+    if (s->count == 0) {
+        memset(dst, 0, s->pixels * sizeof(uint16_t));
+    } else if (s->mode == STACK_MEDIAN) {
+        output_median(s, dst);
+    } else {
+        output_mean(s, dst);
+    }
+}
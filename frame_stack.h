@@ -0,0 +1,59 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef FRAME_STACK_H
+#define FRAME_STACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+
+#define FRAME_STACK_MAX_DEPTH   64  // 64 * 1023 still fits a 16-bit sum
+#define FRAME_STACK_MAX_MEDIAN  16
+
+enum frame_stack_mode {
+    STACK_MEAN,
+    STACK_MEDIAN,
+};
+
+// Temporal denoise on raw Bayer frames, ahead of demosaic. The last
+// `depth` frames are kept in a ring and every push updates a per-pixel
+// running sum by adding the new frame and subtracting the one it evicts,
+// so a push and a mean output each cost one pass over the frame whatever
+// the depth. Until the ring has filled, outputs average the frames seen
+// so far. Median stacking has no running form and reads the whole ring
+// per output, so its depth is capped lower.
+struct frame_stack {
+    struct arena mem;
+    uint16_t     *history;      // depth frames of 10-bit samples
+    uint16_t     *sum;
+    size_t       pixels;
+    int          depth;
+    int          count;         // frames in the ring, <= depth
+    int          head;          // next frame to overwrite
+    int          mode;
+};
+
+int  frame_stack_parse_mode(const char *name, int *mode);
+int  frame_stack_init(struct frame_stack *s, int width, int height, int depth, int mode);
+void frame_stack_free(struct frame_stack *s);
+void frame_stack_push(struct frame_stack *s, const uint16_t *raw);
+void frame_stack_output(const struct frame_stack *s, uint16_t *dst);
+
+#endif
@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
@@ -31,484 +32,559 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <math.h>
-#include <png.h>
+#include <time.h>
+#include "arena.h"
+#include "capture_config.h"
+#include "cpu_dispatch.h"
+#include "debayer.h"
+#include "encode.h"
+#include "frame_stack.h"
+#include "memstats.h"
+#include "metrics.h"
+#include "pyramid.h"
+#include "raw_correct.h"
+#include "reorder.h"
+#include "snapshot.h"
+#include "v4l2_capture.h"
+#include "work_pool.h"
+
+// Output codec, from --encoder / --quality.
+static int output_format = ENCODE_PNG;
+static int output_quality = 90;
+// Raw correction stage, from --calibration; NULL when not configured.
+static const struct raw_calibration *calibration = NULL;
+// SIGINT/SIGTERM during a sequence: finish the frames in flight and exit.
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
 
-#define MIN(a,b) (((a)<(b))?(a):(b))
-#define MAX(a,b) (((a)>(b))?(a):(b))
-
-void ahd_debayer(const uint16_t *src, uint8_t *row, int width, int height, int y)
-{
-    // Temporary buffers for horizontal and vertical interpolations
-    uint16_t *h_interp = (uint16_t *)malloc(width * 3 * sizeof(uint16_t));
-    uint16_t *v_interp = (uint16_t *)malloc(width * 3 * sizeof(uint16_t));
-
-    // Perform horizontal and vertical interpolations
-    for (int x = 0; x < width; x++) {
-        int is_green = ((x + y) % 2 == 0);
-        int is_blue = (y % 2 == 1 && x % 2 == 0);
-        int is_red = (y % 2 == 0 && x % 2 == 1);
-
-        // Horizontal interpolation
-        if (is_green) {
-            h_interp[x*3 + 1] = src[y * width + x] & 0x03FF;
-            h_interp[x*3 + 0] = (x > 0) ? (src[y * width + x - 1] & 0x03FF) : h_interp[x*3 + 1];
-            h_interp[x*3 + 2] = (x < width - 1) ? (src[y * width + x + 1] & 0x03FF) : h_interp[x*3 + 1];
-        } else if (is_blue) {
-            h_interp[x*3 + 2] = src[y * width + x] & 0x03FF;
-            h_interp[x*3 + 1] = (x > 0 && x < width - 1) ? 
-                ((src[y * width + x - 1] & 0x03FF) + (src[y * width + x + 1] & 0x03FF)) / 2 : h_interp[x*3 + 2];
-            h_interp[x*3 + 0] = h_interp[x*3 + 1];
-        } else { // is_red
-            h_interp[x*3 + 0] = src[y * width + x] & 0x03FF;
-            h_interp[x*3 + 1] = (x > 0 && x < width - 1) ? 
-                ((src[y * width + x - 1] & 0x03FF) + (src[y * width + x + 1] & 0x03FF)) / 2 : h_interp[x*3 + 0];
-            h_interp[x*3 + 2] = h_interp[x*3 + 1];
-        }
+static int is_yuv_format(int format) {
+    return format == ENCODE_NV12 || format == ENCODE_I420;
+}
 
-        // Vertical interpolation (similar to horizontal, but using y-1 and y+1)
-        if (is_green) {
-            v_interp[x*3 + 1] = src[y * width + x] & 0x03FF;
-            v_interp[x*3 + 0] = (y > 0) ? (src[(y - 1) * width + x] & 0x03FF) : v_interp[x*3 + 1];
-            v_interp[x*3 + 2] = (y < height - 1) ? (src[(y + 1) * width + x] & 0x03FF) : v_interp[x*3 + 1];
-        } else if (is_blue) {
-            v_interp[x*3 + 2] = src[y * width + x] & 0x03FF;
-            v_interp[x*3 + 1] = (y > 0 && y < height - 1) ? 
-                ((src[(y - 1) * width + x] & 0x03FF) + (src[(y + 1) * width + x] & 0x03FF)) / 2 : v_interp[x*3 + 2];
-            v_interp[x*3 + 0] = v_interp[x*3 + 1];
-        } else { // is_red
-            v_interp[x*3 + 0] = src[y * width + x] & 0x03FF;
-            v_interp[x*3 + 1] = (y > 0 && y < height - 1) ? 
-                ((src[(y - 1) * width + x] & 0x03FF) + (src[(y + 1) * width + x] & 0x03FF)) / 2 : v_interp[x*3 + 0];
-            v_interp[x*3 + 2] = v_interp[x*3 + 1];
-        }
+// NV12/I420: the demosaic writes planar YUV straight into one frame buffer,
+// two rows at a time, and the frame is written out whole. There is no RGB
+// row and no separate colour conversion pass.
+static void process_yuv(const uint16_t *src, const char *filename, int width, int height,
+                        struct arena *scratch) {
+    size_t size = yuv_frame_size(width, height);
+    uint8_t *buf = (uint8_t *)arena_alloc(scratch, size);
+    if (!buf) {
+        fprintf(stderr, "Encode scratch arena exhausted\n");
+        exit(EXIT_FAILURE);
+    }
 
-        // Calculate homogeneity
-        float h_homogeneity = 0, v_homogeneity = 0;
-        for (int c = 0; c < 3; c++) {
-            h_homogeneity += fabs(h_interp[MAX(0, x-1)*3 + c] - h_interp[x*3 + c]) + 
-                             fabs(h_interp[MIN(width-1, x+1)*3 + c] - h_interp[x*3 + c]);
-            v_homogeneity += fabs(v_interp[MAX(0, x-1)*3 + c] - v_interp[x*3 + c]) + 
-                             fabs(v_interp[MIN(width-1, x+1)*3 + c] - v_interp[x*3 + c]);
+    struct yuv_frame frame;
+    yuv_frame_init(&frame, buf, width, height, output_format == ENCODE_NV12 ? YUV_NV12 : YUV_I420);
+    if (calibration) {
+        uint16_t *ring = (uint16_t *)arena_alloc(scratch, 3 * width * sizeof(uint16_t));
+        if (!ring) {
+            fprintf(stderr, "Encode scratch arena exhausted\n");
+            exit(EXIT_FAILURE);
+        }
+        raw_correct_yuv_frame(calibration, src, ring, &frame);
+    } else {
+        for (int y = 0; y < height; y += 2) {
+            int below = y + 2 < height ? y + 2 : y;
+            debayer_yuv_rows(src + (size_t)y * width, src + (size_t)(y + 1) * width,
+                             src + (size_t)below * width, &frame, y);
         }
-
-        // Choose interpolation with better homogeneity
-        uint16_t *chosen = (h_homogeneity <= v_homogeneity) ? h_interp : v_interp;
-
-        // Write to output
-        row[x * 3] = chosen[x*3 + 0] >> 2;
-        row[x * 3 + 1] = chosen[x*3 + 1] >> 2;
-        row[x * 3 + 2] = chosen[x*3 + 2] >> 2;
     }
 
-    free(h_interp);
-    free(v_interp);
+    encode_raw_frame(buf, size, filename);
+    metrics_add(METRIC_BYTES_WRITTEN, size);
 }
 
-#define CLEAR(x) memset(&(x), 0, sizeof(x))
-
-struct buffer {
-    void   *start;
-    size_t length;
-};
-
-static void process_image(const void *p, int size, const char *filename, int width, int height) {
-    FILE *fp = fopen(filename, "wb");
-    if (!fp) {
-        perror("Error opening output file");
-        exit(EXIT_FAILURE);
-    }
+// Per-thread encode scratch: codec state and row buffers, plus the whole
+// output frame for formats that are written in one piece.
+static size_t scratch_size_for(const struct capture_device *dev) {
+    return encode_arena_size(dev->fmt.fmt.pix.width) +
+           encode_frame_size(output_format, dev->fmt.fmt.pix.width, dev->fmt.fmt.pix.height);
+}
 
-    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png) {
-        fclose(fp);
-        exit(EXIT_FAILURE);
-    }
+static void process_image(const void *p, int size, const char *filename, int width, int height,
+                          struct arena *scratch) {
+    struct metrics_timer timer;
+    metrics_timer_start(&timer);
 
-    png_infop info = png_create_info_struct(png);
-    if (!info) {
-        png_destroy_write_struct(&png, NULL);
-        fclose(fp);
-        exit(EXIT_FAILURE);
+    if (output_format == ENCODE_RAW) {
+        encode_raw_frame(p, size, filename);
+        metrics_add(METRIC_BYTES_WRITTEN, size);
+        metrics_timer_stop(&timer, STAGE_PROCESS);
+        return;
     }
-
-    if (setjmp(png_jmpbuf(png))) {
-        png_destroy_write_struct(&png, &info);
-        fclose(fp);
-        exit(EXIT_FAILURE);
+    if (is_yuv_format(output_format)) {
+        size_t mark = arena_mark(scratch);
+        process_yuv((const uint16_t *)p, filename, width, height, scratch);
+        arena_rewind(scratch, mark);
+        metrics_timer_stop(&timer, STAGE_PROCESS);
+        return;
     }
 
-    png_init_io(png, fp);
-
-    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB,
-                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-    png_write_info(png, info);
-    png_bytep row = (png_bytep)malloc(3 * width * sizeof(uint8_t));
+    size_t mark = arena_mark(scratch);
+    uint8_t *row = (uint8_t *)arena_alloc(scratch, 3 * width * sizeof(uint8_t));
     if (!row) {
-        perror("Error allocating memory for row");
-        png_destroy_write_struct(&png, &info);
-        fclose(fp);
+        fprintf(stderr, "Encode scratch arena exhausted\n");
         exit(EXIT_FAILURE);
     }
 
+    struct encoder enc;
+    encoder_begin(&enc, output_format, output_quality, filename, width, height, scratch);
+    struct pyramid *pyr = pyramid_enabled() ? pyramid_begin(filename) : NULL;
+
     const uint16_t *src = (const uint16_t *)p;
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            uint16_t r, g, b;
-            if (y % 2 == 0) {
-                if (x % 2 == 0) {
-                    r = src[y * width + x] & 0x03FF;
-                    g = (uint16_t)(((uint32_t)(src[y * width + x + (x < width - 1 ? 1 : -1)] & 0x03FF) +
-                        (uint32_t)(src[(y < height - 1 ? y + 1 : y - 1) * width + x] & 0x03FF)) >> 1);
-                    b = src[(y < height - 1 ? y + 1 : y - 1) * width + 
-                            (x < width - 1 ? x + 1 : x - 1)] & 0x03FF;
-                } else {
-                    r = (uint16_t)(((uint32_t)(src[y * width + x - 1] & 0x03FF) +
-                        (uint32_t)(src[y * width + (x < width - 1 ? x + 1 : x - 1)] & 0x03FF)) >> 1);
-                    g = src[y * width + x] & 0x03FF;
-                    b = (uint16_t)(((uint32_t)(src[(y < height - 1 ? y + 1 : y - 1) * width + x - 1] & 0x03FF) +
-                        (uint32_t)(src[(y < height - 1 ? y + 1 : y - 1) * width + 
-                            (x < width - 1 ? x + 1 : x - 1)] & 0x03FF)) >> 1);
-                }
-            } else {
-                if (x % 2 == 0) {
-                    r = (uint16_t)(((uint32_t)(src[(y > 0 ? y - 1 : y + 1) * width + x] & 0x03FF) +
-                        (uint32_t)(src[(y < height - 1 ? y + 1 : y) * width + x] & 0x03FF)) >> 1);
-                    g = src[y * width + x] & 0x03FF;
-                    b = (uint16_t)(((uint32_t)(src[y * width + x - 1] & 0x03FF) +
-                        (uint32_t)(src[y * width + (x < width - 1 ? x + 1 : x - 1)] & 0x03FF)) >> 1);
-                } else {
-                    r = src[(y > 0 ? y - 1 : 0) * width + 
-                            (x < width - 1 ? x + 1 : x)] & 0x03FF;
-                    g = (uint16_t)(((uint32_t)(src[(y > 0 ? y - 1 : y + 1) * width + x] & 0x03FF) +
-                        (uint32_t)(src[y * width + (x < width - 1 ? x + 1 : x - 1)] & 0x03FF)) >> 1);
-                    b = src[y * width + x] & 0x03FF;
-                }
+    if (calibration) {
+        // Corrected raw rows are produced one row ahead of the demosaic
+        // into a three-row ring, so the correction is never a separate
+        // full-frame pass.
+        uint16_t *ring[3];
+        for (int i = 0; i < 3; i++) {
+            ring[i] = (uint16_t *)arena_alloc(scratch, width * sizeof(uint16_t));
+            if (!ring[i]) {
+                fprintf(stderr, "Encode scratch arena exhausted\n");
+                exit(EXIT_FAILURE);
             }
-            row[x * 3] = b;
-            row[x * 3 + 1] = g;
-            row[x * 3 + 2] = r;
         }
-        png_write_row(png, row);
+        raw_correct_row(calibration, src, ring[0], 0);
+        raw_correct_row(calibration, src, ring[1], 1);
+        for (int y = 0; y < height; y++) {
+            if (y >= 1 && y + 1 < height)
+                raw_correct_row(calibration, src, ring[(y + 1) % 3], y + 1);
+            int above = y > 0 ? y - 1 : y + 1;
+            int below = y < height - 1 ? y + 1 : y - 1;
+            debayer_rows(ring[above % 3], ring[y % 3], ring[below % 3], row, width, y);
+            encoder_write_row(&enc, row);
+            if (pyr)
+                pyramid_push_row(pyr, row);
+        }
+    } else {
+        for (int y = 0; y < height; y++) {
+            debayer_row(src, row, width, height, y);
+            encoder_write_row(&enc, row);
+            if (pyr)
+                pyramid_push_row(pyr, row);
+        }
     }
 
-    free(row);
-    png_write_end(png, NULL);
-    png_destroy_write_struct(&png, &info);
-    fclose(fp);
+    encoder_end(&enc);
+    if (pyr)
+        pyramid_end(pyr);
+    arena_rewind(scratch, mark);
+    metrics_add(METRIC_BYTES_WRITTEN, enc.sink.written);
+    metrics_timer_stop(&timer, STAGE_PROCESS);
 }
 
-static void process_buffer(void *p, int size, int width, int height){
-    uint16_t *src = (uint16_t *)p;
-    for (uint16_t i = 0; i < width * height; i+=1){
-        src[i] = src[i] << 6;
-    }
+// Frame-parallel capture: every dequeued buffer becomes a job on the work
+// pool, each worker encodes with its own scratch arena and re-queues the
+// buffer as soon as it is done, and finished files are published (renamed
+// from .part) strictly in buf.sequence order through the reorder buffer.
+struct capture_ctx;
+
+struct frame_job {
+    struct capture_ctx *ctx;
+    struct v4l2_buffer buf;
+    const void         *data;       // driver buffer, or a stacked frame
+    int                size;
+    int                slot;
+    char               out_name[256];
+    char               part_name[264];
+};
 
-}
+struct capture_ctx {
+    struct capture_device *dev;
+    const char            *pattern;
+    struct arena          scratch[WORK_POOL_MAX_THREADS];
+    struct reorder_buffer reorder;
+    struct frame_job      jobs[REORDER_SLOTS];
+
+    // With --stack, frames are stacked on the capture thread and workers
+    // encode from these output frames (indexed by slot) instead of the
+    // driver buffers, which are re-queued immediately.
+    struct frame_stack    *stack;
+    struct arena          stacked_mem;
+    uint16_t              *stacked[REORDER_SLOTS];
+    int                   n_stacked;    // power of two, bounds frames in flight
+};
+
+static void encode_frame_job(void *arg, int worker) {
+    struct frame_job *job = (struct frame_job *)arg;
+    struct capture_device *dev = job->ctx->dev;
 
+    process_image(job->data, job->size, job->part_name,
+                  dev->fmt.fmt.pix.width, dev->fmt.fmt.pix.height, &job->ctx->scratch[worker]);
 
-static void process_image_rgb(const char *filename, int width, int height, uint8_t r, uint8_t g, uint8_t b) {
-    FILE *fp = fopen(filename, "wb");
-    if (!fp) {
-        perror("Error opening output file");
+    if (!job->ctx->stack)
+        capture_requeue(dev, &job->buf);
+    reorder_complete(&job->ctx->reorder, job->slot);
+}
+
+static void publish_frame(struct capture_ctx *ctx, int slot, uint32_t sequence) {
+    struct frame_job *job = &ctx->jobs[slot];
+    if (-1 == rename(job->part_name, job->out_name)) {
+        perror("rename");
         exit(EXIT_FAILURE);
     }
-    
-    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png) {
-        fclose(fp);
-        exit(EXIT_FAILURE);
+    for (int i = 0; i < pyramid_level_count(); i++) {
+        char part[300], out[300];
+        pyramid_level_name(part, sizeof(part), job->part_name, i);
+        pyramid_level_name(out, sizeof(out), job->out_name, i);
+        if (-1 == rename(part, out)) {
+            perror("rename");
+            exit(EXIT_FAILURE);
+        }
     }
-    
-    png_infop info = png_create_info_struct(png);
-    if (!info) {
-        png_destroy_write_struct(&png, NULL);
-        fclose(fp);
-        exit(EXIT_FAILURE);
+    metrics_add(METRIC_FRAMES_SAVED, 1);
+    INFO_PRINT("Image saved as %s (sequence %u)\n", job->out_name, sequence);
+}
+
+// Hands a dequeued buffer to the pool. Returns the number of frames that
+// had to be published first to make room in the reorder window.
+static int dispatch_frame(struct capture_ctx *ctx, struct work_pool *pool, const struct v4l2_buffer *buf) {
+    int slot, published = 0;
+    uint32_t sequence;
+
+    // Slots are handed out in ring order, so keeping at most n_stacked
+    // frames in flight gives each one its own stacked output frame.
+    while ((ctx->stack && reorder_pending(&ctx->reorder) == ctx->n_stacked) ||
+           (slot = reorder_push(&ctx->reorder, buf->sequence)) < 0) {
+        // Reorder window full: the oldest frame is still encoding.
+        int done = reorder_pop(&ctx->reorder, &sequence, 1);
+        publish_frame(ctx, done, sequence);
+        published++;
+    }
+
+    struct frame_job *job = &ctx->jobs[slot];
+    job->ctx = ctx;
+    job->buf = *buf;
+    job->slot = slot;
+    if (ctx->stack) {
+        uint16_t *frame = ctx->stacked[slot & (ctx->n_stacked - 1)];
+        struct metrics_timer timer;
+        metrics_timer_start(&timer);
+        frame_stack_push(ctx->stack, (const uint16_t *)ctx->dev->buffers[buf->index].start);
+        capture_requeue(ctx->dev, &job->buf);
+        frame_stack_output(ctx->stack, frame);
+        metrics_timer_stop(&timer, STAGE_STACK);
+        job->data = frame;
+        job->size = ctx->stack->pixels * sizeof(uint16_t);
+    } else {
+        job->data = ctx->dev->buffers[buf->index].start;
+        job->size = buf->bytesused;
     }
-    
-    if (setjmp(png_jmpbuf(png))) {
-        png_destroy_write_struct(&png, &info);
-        fclose(fp);
+    if (capture_output_name(job->out_name, sizeof(job->out_name), ctx->pattern,
+                            buf->timestamp.tv_sec, buf->sequence)) {
+        fprintf(stderr, "Output name too long\n");
         exit(EXIT_FAILURE);
     }
-    
-    png_init_io(png, fp);
-    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB,
-                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-    png_write_info(png, info);
-    
-    png_bytep row = (png_bytep)malloc(3 * width * sizeof(uint8_t));
-    if (!row) {
-        perror("Error allocating memory for row");
-        png_destroy_write_struct(&png, &info);
-        fclose(fp);
+    size_t len = strlen(job->out_name);
+    memcpy(job->part_name, job->out_name, len);
+    memcpy(job->part_name + len, ".part", sizeof(".part"));
+
+    if (-1 == work_pool_submit(pool, encode_frame_job, job)) {
+        fprintf(stderr, "Work pool queue full\n");
         exit(EXIT_FAILURE);
     }
-    
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            row[x * 3] = r;      // Red channel set to maximum (255)
-            row[x * 3 + 1] = g;    // Green channel set to 0
-            row[x * 3 + 2] = b;    // Blue channel set to 0
-        }
-        png_write_row(png, row);
-    }
-    
-    free(row);
-    png_write_end(png, NULL);
-    png_destroy_write_struct(&png, &info);
-    fclose(fp);
+    metrics_set(GAUGE_QUEUE_DEPTH, reorder_pending(&ctx->reorder));
+    return published;
 }
 
-int main() {
-    struct v4l2_format              fmt;
-    struct v4l2_buffer              buf;
-    struct v4l2_requestbuffers      req;
-    enum v4l2_buf_type              type;
-    fd_set                          fds;
-    struct timeval                  tv;
-    int                             r, fd = -1;
-    unsigned int                    i, n_buffers;
-    const char                      *dev_name = "/dev/video0";
-    char                            out_name[256];
-    struct buffer                   *buffers;
+static double elapsed_s(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
 
-    printf("Opening device: %s\n", dev_name);
-    fd = open(dev_name, O_RDWR | O_NONBLOCK, 0);
-    if (fd < 0) {
-        perror("Cannot open device");
+// Returns -1 if the device failed and could not be recovered; the frames
+// already captured are still saved.
+static int capture_frames(struct capture_device *dev, const struct capture_config *cfg,
+                          struct frame_stack *stack) {
+    struct capture_ctx *ctx = static_cast<capture_ctx*>(calloc(1, sizeof(*ctx)));
+    struct work_pool pool;
+    struct v4l2_buffer buf;
+    struct timespec start;
+    int frames = cfg->frames, dispatched = 0, saved = 0, failed = 0, slot;
+    uint32_t sequence;
+
+    if (!ctx) {
+        perror("Out of memory");
         exit(EXIT_FAILURE);
     }
-    printf("Device opened successfully\n");
+    ctx->dev = dev;
+    ctx->pattern = cfg->output;
+    reorder_init(&ctx->reorder);
 
-    // Check if the device supports video capture
-    v4l2_capability cap;
-    if (-1 == ioctl(fd, VIDIOC_QUERYCAP, &cap)) {
-        perror("VIDIOC_QUERYCAP");
+    if (-1 == work_pool_init(&pool, cfg->threads)) {
         exit(EXIT_FAILURE);
     }
-
-    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
-        fprintf(stderr, "The device does not support video capture\n");
-        exit(EXIT_FAILURE);
+    for (int t = 0; t < pool.n_threads; t++) {
+        if (-1 == arena_init(&ctx->scratch[t], scratch_size_for(dev))) {
+            exit(EXIT_FAILURE);
+        }
     }
-
-    printf("Device capabilities: %08x\n", cap.capabilities);
-
-    // Set format
-    CLEAR(fmt);
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    fmt.fmt.pix.width       = 1920;
-    fmt.fmt.pix.height      = 1080;
-    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_SRGGB10;
-    fmt.fmt.pix.field       = V4L2_FIELD_NONE;
-
-    printf("Setting format...\n");
-    if (-1 == ioctl(fd, VIDIOC_S_FMT, &fmt)) {
-        perror("VIDIOC_S_FMT");
-        exit(EXIT_FAILURE);
+    if (stack) {
+        size_t frame_bytes = stack->pixels * sizeof(uint16_t);
+        ctx->stack = stack;
+        ctx->n_stacked = 1;
+        while (ctx->n_stacked < pool.n_threads + 1)
+            ctx->n_stacked *= 2;
+        if (-1 == arena_init(&ctx->stacked_mem, ctx->n_stacked * (frame_bytes + 64))) {
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < ctx->n_stacked; i++)
+            ctx->stacked[i] = (uint16_t *)arena_alloc(&ctx->stacked_mem, frame_bytes);
     }
+    INFO_PRINT("Capturing %d frames on %d worker threads\n", frames, pool.n_threads);
 
-    // Query the set format
-    if (-1 == ioctl(fd, VIDIOC_G_FMT, &fmt)) {
-        perror("VIDIOC_G_FMT");
+    if (capture_first_frame(dev, cfg, &buf)) {
         exit(EXIT_FAILURE);
     }
+    printf("Time to first frame: %.0f ms\n", capture_process_age_ms());
+
+#ifdef ALLOC_STATS
+    unsigned long allocs_before = 0;
+#endif
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    saved += dispatch_frame(ctx, &pool, &buf);
+    dispatched++;
+
+    while (saved < frames) {
+        while ((slot = reorder_pop(&ctx->reorder, &sequence, dispatched == frames)) >= 0) {
+            publish_frame(ctx, slot, sequence);
+#ifdef ALLOC_STATS
+            // Everything after the first published frame is steady state.
+            if (saved == 0)
+                allocs_before = memstats_alloc_count();
+#endif
+            if (++saved == frames)
+                break;
+        }
+        if (dispatched == frames)
+            continue;
+        if (stop_requested) {
+            INFO_PRINT("Stopping after %d frames\n", dispatched);
+            frames = dispatched;
+            continue;
+        }
 
-    printf("Format set:\n");
-    printf("  Width: %d\n", fmt.fmt.pix.width);
-    printf("  Height: %d\n", fmt.fmt.pix.height);
-    printf("  Pixel format: %c%c%c%c\n",
-           fmt.fmt.pix.pixelformat & 0xFF,
-           (fmt.fmt.pix.pixelformat >> 8) & 0xFF,
-           (fmt.fmt.pix.pixelformat >> 16) & 0xFF,
-           (fmt.fmt.pix.pixelformat >> 24) & 0xFF);
-
-    // Set frame interval (try to set 30 fps)
-    struct v4l2_streamparm streamparm;
-    CLEAR(streamparm);
-    streamparm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    streamparm.parm.capture.timeperframe.numerator = 1;
-    streamparm.parm.capture.timeperframe.denominator = 15;
-
-    if (-1 == ioctl(fd, VIDIOC_S_PARM, &streamparm)) {
-        perror("VIDIOC_S_PARM");
-    } else {
-        printf("Frame interval set to %d/%d\n", 
-               streamparm.parm.capture.timeperframe.numerator,
-               streamparm.parm.capture.timeperframe.denominator);
+        int r = capture_dequeue(dev, &buf, 1000);
+        if (r < 0) {
+            if (capture_recover(dev)) {
+                failed = 1;
+                frames = dispatched;
+            }
+            continue;
+        }
+        if (!r) {
+            fprintf(stderr, "select timeout\n");
+            continue;
+        }
+        if (buf.flags & V4L2_BUF_FLAG_ERROR) {
+            capture_requeue(dev, &buf);
+            continue;
+        }
+        saved += dispatch_frame(ctx, &pool, &buf);
+        dispatched++;
     }
 
-    // Try to set some camera-specific controls
-    struct v4l2_control control;
-    CLEAR(control);
-    control.id = 0x009a2009;  // gain
-    control.value = 100;  // arbitrary value, adjust as needed
-    if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-        perror("VIDIOC_S_CTRL for gain");
+    work_pool_wait(&pool);
+    double seconds = elapsed_s(&start);
+
+#ifdef ALLOC_STATS
+    unsigned long steady_allocs = memstats_alloc_count() - allocs_before;
+    printf("Steady-state heap allocations: %lu\n", steady_allocs);
+    // libjpeg's memory manager allocates per image; see encode.cpp.
+    if (steady_allocs != 0 && output_format != ENCODE_JPEG) {
+        fprintf(stderr, "Capture loop is not allocation-free\n");
+        exit(EXIT_FAILURE);
     }
+#endif
 
-    CLEAR(control);
-    control.id = 0x009a200a;  // exposure
-    control.value = 10000;  // arbitrary value, adjust as needed
-    if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-        perror("VIDIOC_S_CTRL for exposure");
+    printf("Captured %d frames in %.2f s (%.2f fps)\n", saved, seconds, saved / seconds);
+    size_t scratch_peak = 0, scratch_size = 0;
+    for (int t = 0; t < pool.n_threads; t++) {
+        scratch_peak += ctx->scratch[t].peak;
+        scratch_size += ctx->scratch[t].size;
+        arena_free(&ctx->scratch[t]);
     }
+    printf("Scratch arena peak: %zu of %zu bytes, peak RSS: %ld KiB\n",
+           scratch_peak, scratch_size, memstats_peak_rss_kb());
 
-    // Request buffers
-    CLEAR(req);
-    req.count = 4;
-    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_MMAP;
+    work_pool_destroy(&pool);
+    reorder_destroy(&ctx->reorder);
+    arena_free(&ctx->stacked_mem);
+    free(ctx);
+    return failed ? -1 : 0;
+}
 
-    printf("Requesting buffers...\n");
-    if (-1 == ioctl(fd, VIDIOC_REQBUFS, &req)) {
-        perror("VIDIOC_REQBUFS");
+int main(int argc, char **argv) {
+    struct capture_config           cfg;
+    struct capture_device           dev;
+    struct v4l2_buffer              buf;
+    char                            out_name[256];
+    struct arena                    scratch;
+    struct frame_stack              stack;
+    struct raw_calibration          cal;
+    const void                      *frame;
+    int                             frame_size;
+
+    capture_config_init(&cfg);
+    capture_config_add_control(&cfg, 0x009a2009, 100);      // gain
+    capture_config_add_control(&cfg, 0x009a200a, 10000);    // exposure
+    if (capture_config_parse_args(&cfg, argc, argv)) {
         exit(EXIT_FAILURE);
     }
-    printf("Buffers requested successfully\n");
-
-    buffers = static_cast<buffer*>(calloc(req.count, sizeof(*buffers)));
-    if (!buffers) {
-        perror("Out of memory");
+    output_format = cfg.encoder;
+    output_quality = cfg.quality;
+    if (is_yuv_format(output_format) && (cfg.pyramid || cfg.thumbnail)) {
+        fprintf(stderr, "--pyramid and --thumbnail need an image encoder, not %s\n",
+                encode_format_ext(output_format));
         exit(EXIT_FAILURE);
     }
+    if (!cfg.output[0]) {
+        snprintf(cfg.output, sizeof(cfg.output), "%s.%s",
+                 cfg.motion > 0 ? "motion_%t_%s" : cfg.snapshot ? "snapshot_%t_%s" :
+                 cfg.frames > 1 ? "output_%t_%s" : "output_%t",
+                 encode_format_ext(output_format));
+    }
 
-    for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
-        CLEAR(buf);
-
-        buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory      = V4L2_MEMORY_MMAP;
-        buf.index       = n_buffers;
-
-        printf("Querying buffer %d...\n", n_buffers);
-        if (-1 == ioctl(fd, VIDIOC_QUERYBUF, &buf)) {
-            perror("VIDIOC_QUERYBUF");
-            exit(EXIT_FAILURE);
-        }
-        printf("Buffer %d queried successfully\n", n_buffers);
-
-        buffers[n_buffers].length = buf.length;
-        buffers[n_buffers].start = mmap(NULL, buf.length,
-                      PROT_READ | PROT_WRITE, MAP_SHARED,
-                      fd, buf.m.offset);
-
-        if (MAP_FAILED == buffers[n_buffers].start) {
-            perror("mmap");
+    capture_open(&dev, &cfg);
+    if (is_yuv_format(output_format) && (dev.fmt.fmt.pix.width % 2 || dev.fmt.fmt.pix.height % 2)) {
+        fprintf(stderr, "4:2:0 output needs even frame dimensions, got %ux%u\n",
+                dev.fmt.fmt.pix.width, dev.fmt.fmt.pix.height);
+        exit(EXIT_FAILURE);
+    }
+    if (cfg.calibration[0]) {
+        if (raw_calibration_load(&cal, cfg.calibration, dev.fmt.fmt.pix.width, dev.fmt.fmt.pix.height)) {
             exit(EXIT_FAILURE);
         }
-    }
-
-    for (i = 0; i < n_buffers; ++i) {
-        CLEAR(buf);
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index = i;
-
-        printf("Queueing buffer %d...\n", i);
-        if (-1 == ioctl(fd, VIDIOC_QBUF, &buf)) {
-            perror("VIDIOC_QBUF");
+        INFO_PRINT("Calibration: black level %d, %d defects, %dx%d shading grid\n",
+                   cal.black_level, cal.n_defects, cal.grid_w, cal.grid_h);
+        calibration = &cal;
+    }
+    if (cfg.metrics[0]) {
+        uint32_t ids[CAPTURE_MAX_CONTROLS];
+        for (int i = 0; i < cfg.n_controls; i++)
+            ids[i] = cfg.controls[i].id;
+        metrics_watch_controls(dev.fd, ids, cfg.n_controls);
+        if (metrics_start(cfg.metrics)) {
             exit(EXIT_FAILURE);
         }
-        printf("Buffer %d queued successfully\n", i);
     }
-
-    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-
-    printf("Starting stream...\n");
-    if (-1 == ioctl(fd, VIDIOC_STREAMON, &type)) {
-        perror("VIDIOC_STREAMON");
+    // Lower pyramid levels are encoded by helper threads, one per level for
+    // each thread that can be inside process_image() at the same time.
+    if (output_format != ENCODE_RAW && !is_yuv_format(output_format) &&
+        pyramid_init(cfg.snapshot || cfg.motion > 0 || cfg.frames > 1 ? cfg.threads : 1,
+                     dev.fmt.fmt.pix.width, dev.fmt.fmt.pix.height, cfg.pyramid, cfg.thumbnail,
+                     output_format, output_quality)) {
         exit(EXIT_FAILURE);
     }
-    printf("Stream started successfully\n");
-
-    sleep(1);
-
-    FD_ZERO(&fds);
-    FD_SET(fd, &fds);
-
-    tv.tv_sec = 10;  // Increase timeout to 10 seconds
-    tv.tv_usec = 0;
-
-    for (int attempt = 0; attempt < 5; attempt++) {
-        printf("Attempt %d: Waiting for frame (timeout: %ld seconds)...\n", attempt + 1, tv.tv_sec);
-        r = select(fd + 1, &fds, NULL, NULL, &tv);
-
-        if (-1 == r) {
-            perror("select");
-            exit(EXIT_FAILURE);
-        }
+    printf("Pixel kernels: %s\n", cpu_kernel_variant());
+    capture_start(&dev);
 
-        if (0 == r) {
-            fprintf(stderr, "select timeout\n");
-        } else {
-            printf("Frame is ready\n");
-            break;
-        }
-
-        // Check stream status
-        v4l2_input input;
-        CLEAR(input);
-        if (-1 == ioctl(fd, VIDIOC_G_INPUT, &input.index)) {
-            perror("VIDIOC_G_INPUT");
-        } else if (-1 == ioctl(fd, VIDIOC_ENUMINPUT, &input)) {
-            perror("VIDIOC_ENUMINPUT");
-        } else {
-            printf("Current input status: 0x%08X\n", input.status);
-        }
+    // Motion-triggered capture runs inside the snapshot server.
+    if (cfg.snapshot || cfg.motion > 0) {
+        int rc = snapshot_serve(&dev, &cfg, process_image, scratch_size_for(&dev));
+        capture_stop(&dev);
+        pyramid_shutdown();
+        metrics_stop();
+        return rc ? EXIT_FAILURE : 0;
     }
 
-    if (r == 0) {
-        int flags = fcntl(fd, F_GETFL, 0);
-        printf("File descriptor flags: %d\n", flags);
-        char buffer[4096];
-        ssize_t bytes_read = read(fd, buffer, sizeof(buffer));
-        if (bytes_read == -1) {
-            perror("read");
-        } else if (bytes_read == 0) {
-            printf("End of file reached\n");
-        } else {
-            printf("Read %zd bytes from device\n", bytes_read);
-        }
+    if (cfg.stack_depth > 1 &&
+        frame_stack_init(&stack, dev.fmt.fmt.pix.width, dev.fmt.fmt.pix.height,
+                         cfg.stack_depth, cfg.stack_mode)) {
         exit(EXIT_FAILURE);
     }
 
-    CLEAR(buf);
-    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
-
-    printf("Dequeuing buffer...\n");
-    if (-1 == ioctl(fd, VIDIOC_DQBUF, &buf)) {
-        perror("VIDIOC_DQBUF");
+    if (cfg.frames > 1) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = handle_stop;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+
+        int rc = capture_frames(&dev, &cfg, cfg.stack_depth > 1 ? &stack : NULL);
+        capture_stop(&dev);
+        pyramid_shutdown();
+        metrics_stop();
+        if (cfg.stack_depth > 1)
+            frame_stack_free(&stack);
+        return rc ? EXIT_FAILURE : 0;
+    }
+
+    // All per-frame working memory is reserved here, before the first frame,
+    // including the stacked output frame when --stack is used.
+    size_t scratch_size = scratch_size_for(&dev);
+    if (cfg.stack_depth > 1)
+        scratch_size += stack.pixels * sizeof(uint16_t) + 64;
+    if (-1 == arena_init(&scratch, scratch_size)) {
         exit(EXIT_FAILURE);
     }
-    printf("Buffer dequeued successfully\n");
-
-    snprintf(out_name, sizeof(out_name), "output_%ld.png", buf.timestamp.tv_sec);
-    process_image(buffers[buf.index].start, buf.bytesused, out_name, fmt.fmt.pix.width, fmt.fmt.pix.height);
-    // process_image_rgb(out_name, fmt.fmt.pix.width, fmt.fmt.pix.height, 0, 0, 0xFF);
 
-    printf("Queueing buffer...\n");
-    if (-1 == ioctl(fd, VIDIOC_QBUF, &buf)) {
-        perror("VIDIOC_QBUF");
+    if (capture_first_frame(&dev, &cfg, &buf)) {
         exit(EXIT_FAILURE);
     }
-    printf("Buffer queued successfully\n");
+    printf("Time to first frame: %.0f ms\n", capture_process_age_ms());
+
+    frame = dev.buffers[buf.index].start;
+    frame_size = buf.bytesused;
+    if (cfg.stack_depth > 1) {
+        // Clean still: stack the first stack_depth frames into one output.
+        frame_stack_push(&stack, (const uint16_t *)frame);
+        while (stack.count < stack.depth) {
+            int r;
+            capture_requeue(&dev, &buf);
+            while ((r = capture_dequeue(&dev, &buf, 1000)) <= 0) {
+                if (r < 0 && capture_recover(&dev)) {
+                    exit(EXIT_FAILURE);
+                }
+            }
+            if (!(buf.flags & V4L2_BUF_FLAG_ERROR))
+                frame_stack_push(&stack, (const uint16_t *)dev.buffers[buf.index].start);
+        }
+        uint16_t *stacked = (uint16_t *)arena_alloc(&scratch, stack.pixels * sizeof(uint16_t));
+        frame_stack_output(&stack, stacked);
+        frame = stacked;
+        frame_size = stack.pixels * sizeof(uint16_t);
+        INFO_PRINT("Stacked %d frames\n", stack.count);
+    }
 
-    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    printf("Stopping stream...\n");
-    if (-1 == ioctl(fd, VIDIOC_STREAMOFF, &type)) {
-        perror("VIDIOC_STREAMOFF");
+    if (capture_output_name(out_name, sizeof(out_name), cfg.output,
+                            buf.timestamp.tv_sec, buf.sequence)) {
+        fprintf(stderr, "Output name too long\n");
+        exit(EXIT_FAILURE);
+    }
+#ifdef ALLOC_STATS
+    unsigned long allocs_before = memstats_alloc_count();
+#endif
+    process_image(frame, frame_size, out_name, dev.fmt.fmt.pix.width,
+                  dev.fmt.fmt.pix.height, &scratch);
+#ifdef ALLOC_STATS
+    unsigned long frame_allocs = memstats_alloc_count() - allocs_before;
+    printf("Heap allocations while encoding: %lu\n", frame_allocs);
+    if (frame_allocs != 0 && output_format != ENCODE_JPEG) {
+        fprintf(stderr, "Encode path is not allocation-free\n");
         exit(EXIT_FAILURE);
     }
-    printf("Stream stopped successfully\n");
+#endif
 
-    for (i = 0; i < n_buffers; ++i)
-        munmap(buffers[i].start, buffers[i].length);
+    INFO_PRINT("Queueing buffer...\n");
+    capture_requeue(&dev, &buf);
 
-    close(fd);
+    capture_stop(&dev);
+    pyramid_shutdown();
+    metrics_add(METRIC_FRAMES_SAVED, 1);
+    metrics_stop();
 
     printf("Image saved as %s\n", out_name);
+    printf("Scratch arena peak: %zu of %zu bytes, peak RSS: %ld KiB\n",
+           scratch.peak, scratch.size, memstats_peak_rss_kb());
+    arena_free(&scratch);
+    if (cfg.stack_depth > 1)
+        frame_stack_free(&stack);
 
     return 0;
 }
\ No newline at end of file
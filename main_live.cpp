@@ -25,11 +25,16 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <linux/videodev2.h>
-#include <png.h>
 #include <stdint.h>
+#include <signal.h>
 #include <cerrno>
 #include <opencv2/opencv.hpp>
 #include <opencv2/imgproc.hpp>
+#include "capture_config.h"
+#include "memstats.h"
+#include "metrics.h"
+#include "mjpeg_server.h"
+#include "v4l2_capture.h"
 
 #ifdef DEBUG
 #define DEBUG_PRINT(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
@@ -37,472 +42,161 @@
 #define DEBUG_PRINT(fmt, ...)
 #endif
 
-#define CLEAR(x) memset(&(x), 0, sizeof(x))
-
-struct buffer {
-    void   *start;
-    size_t length;
-};
-
-cv::Mat process_image(const void *p, int width, int height) {
-    cv::Mat rgb_frame(height, width, CV_8UC3);
-    uint8_t* dst = rgb_frame.data;
-
-    const uint16_t *src = (const uint16_t *)p;
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            uint16_t r, g, b;
-            if (y % 2 == 0) {
-                if (x % 2 == 0) {
-                    r = src[y * width + x] & 0x03FF;
-                    g = (src[y * width + x + 1] & 0x03FF + src[(y + 1) * width + x] & 0x03FF) / 2;
-                    b = src[(y + 1) * width + x + 1] & 0x03FF;
-                } else {
-                    r = (src[y * width + x - 1] & 0x03FF + src[y * width + x + 1] & 0x03FF) / 2;
-                    g = src[y * width + x] & 0x03FF;
-                    b = (src[(y + 1) * width + x - 1] & 0x03FF + src[(y + 1) * width + x + 1] & 0x03FF) / 2;
-                }
-            } else {
-                if (x % 2 == 0) {
-                    r = (src[(y - 1) * width + x] & 0x03FF + src[(y + 1) * width + x] & 0x03FF) / 2;
-                    g = src[y * width + x] & 0x03FF;
-                    b = (src[y * width + x - 1] & 0x03FF + src[y * width + x + 1] & 0x03FF) / 2;
-                } else {
-                    r = src[(y - 1) * width + x + 1] & 0x03FF;
-                    g = (src[(y - 1) * width + x] & 0x03FF + src[y * width + x + 1] & 0x03FF) / 2;
-                    b = src[y * width + x] & 0x03FF;
-                }
-            }
-
-            dst[y * width * 3 + x * 3] = (r * 255) / 1023;
-            dst[y * width * 3 + x * 3 + 1] = (g * 255) / 1023;
-            dst[y * width * 3 + x * 3 + 2] = (b * 255) / 1023;
-        }
-    }
-
-    return rgb_frame;
-}
-
-static void process_image(const void *p, int size, const char *filename, int width, int height) {
-    FILE *fp = fopen(filename, "wb");
-    if (!fp) {
-        perror("Error opening output file");
-        exit(EXIT_FAILURE);
-    }
-
-    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png) {
-        fclose(fp);
-        exit(EXIT_FAILURE);
-    }
-
-    png_infop info = png_create_info_struct(png);
-    if (!info) {
-        png_destroy_write_struct(&png, NULL);
-        fclose(fp);
-        exit(EXIT_FAILURE);
-    }
-
-    if (setjmp(png_jmpbuf(png))) {
-        png_destroy_write_struct(&png, &info);
-        fclose(fp);
-        exit(EXIT_FAILURE);
-    }
-
-    png_init_io(png, fp);
-
-    png_set_IHDR(png, info, width, height, 8, PNG_COLOR_TYPE_RGB,
-                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-    png_write_info(png, info);
-    png_bytep row = (png_bytep)malloc(3 * width * sizeof(uint8_t));
-    if (!row) {
-        perror("Error allocating memory for row");
-        png_destroy_write_struct(&png, &info);
-        fclose(fp);
-        exit(EXIT_FAILURE);
-    }
-
-    const uint16_t *src = (const uint16_t *)p;
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            uint16_t r, g, b;
-            if (y % 2 == 0) {
-                if (x % 2 == 0) {
-                    r = src[y * width + x] & 0x03FF;
-                    g = (src[y * width + x + 1] & 0x03FF + src[(y + 1) * width + x] & 0x03FF) / 2;
-                    b = src[(y + 1) * width + x + 1] & 0x03FF;
-                } else {
-                    r = (src[y * width + x - 1] & 0x03FF + src[y * width + x + 1] & 0x03FF) / 2;
-                    g = src[y * width + x] & 0x03FF;
-                    b = (src[(y + 1) * width + x - 1] & 0x03FF + src[(y + 1) * width + x + 1] & 0x03FF) / 2;
-                }
-            } else {
-                if (x % 2 == 0) {
-                    r = (src[(y - 1) * width + x] & 0x03FF + src[(y + 1) * width + x] & 0x03FF) / 2;
-                    g = src[y * width + x] & 0x03FF;
-                    b = (src[y * width + x - 1] & 0x03FF + src[y * width + x + 1] & 0x03FF) / 2;
-                } else {
-                    r = src[(y - 1) * width + x + 1] & 0x03FF;
-                    g = (src[(y - 1) * width + x] & 0x03FF + src[y * width + x + 1] & 0x03FF) / 2;
-                    b = src[y * width + x] & 0x03FF;
-                }
-            }
-            
-            row[x * 3] = (r * 255) / 1023;
-            row[x * 3 + 1] = (g * 255) / 1023;
-            row[x * 3 + 2] = (b * 255) / 1023;
-        }
-        png_write_row(png, row);
-    }
-
-    free(row);
-    png_write_end(png, NULL);
-    png_destroy_write_struct(&png, &info);
-    fclose(fp);
-}
-
-static void process_buffer(void *p, int width, int height){
-    uint16_t *src = (uint16_t *)p;
-    for (uint16_t i = 0; i < width * height; i+=1){
-        src[i] = src[i] << 6;
-    }
+static volatile sig_atomic_t stop_requested = 0;
 
+static void handle_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
 }
 
-int main() {
-    struct v4l2_format              fmt;
+int main(int argc, char **argv) {
+    struct capture_config           cfg;
+    struct capture_device           dev;
     struct v4l2_buffer              buf;
-    struct v4l2_requestbuffers      req;
-    enum v4l2_buf_type              type;
-    fd_set                          fds;
-    struct timeval                  tv;
-    int                             r, fd = -1;
-    unsigned int                    i, n_buffers;
-    const char                      *dev_name = "/dev/video0";
-    char                            out_name[256];
-    struct buffer                   *buffers;
-
-    printf("Opening device: %s\n", dev_name);
-    fd = open(dev_name, O_RDWR | O_NONBLOCK, 0);
-    if (fd < 0) {
-        perror("Cannot open device");
-        exit(EXIT_FAILURE);
-    }
-    printf("Device opened successfully\n");
-
-    // Check if the device supports video capture
-    v4l2_capability cap;
-    if (-1 == ioctl(fd, VIDIOC_QUERYCAP, &cap)) {
-        perror("VIDIOC_QUERYCAP");
-        exit(EXIT_FAILURE);
-    }
-
-    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
-        fprintf(stderr, "The device does not support video capture\n");
+    struct mjpeg_server             preview;
+
+    capture_config_init(&cfg);
+    // The viewer runs on the sensor's auto controls and has no settle delay.
+    capture_config_add_control(&cfg, V4L2_CID_AUTOGAIN, 1);
+    capture_config_add_control(&cfg, V4L2_CID_EXPOSURE_AUTO, V4L2_EXPOSURE_AUTO);
+    capture_config_add_control(&cfg, V4L2_CID_AUTO_WHITE_BALANCE, 1);
+    cfg.settle_ms = 0;
+    if (capture_config_parse_args(&cfg, argc, argv)) {
         exit(EXIT_FAILURE);
     }
 
-    printf("Device capabilities: %08x\n", cap.capabilities);
-
-    // Set format
-    CLEAR(fmt);
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    fmt.fmt.pix.width       = 1920;
-    fmt.fmt.pix.height      = 1080;
-    fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_SRGGB10;
-    fmt.fmt.pix.field       = V4L2_FIELD_NONE;
-
-    printf("Setting format...\n");
-    if (-1 == ioctl(fd, VIDIOC_S_FMT, &fmt)) {
-        perror("VIDIOC_S_FMT");
-        exit(EXIT_FAILURE);
-    }
-
-    // Query the set format
-    if (-1 == ioctl(fd, VIDIOC_G_FMT, &fmt)) {
-        perror("VIDIOC_G_FMT");
-        exit(EXIT_FAILURE);
-    }
-
-    printf("Format set:\n");
-    printf("  Width: %d\n", fmt.fmt.pix.width);
-    printf("  Height: %d\n", fmt.fmt.pix.height);
-    printf("  Pixel format: %c%c%c%c\n",
-           fmt.fmt.pix.pixelformat & 0xFF,
-           (fmt.fmt.pix.pixelformat >> 8) & 0xFF,
-           (fmt.fmt.pix.pixelformat >> 16) & 0xFF,
-           (fmt.fmt.pix.pixelformat >> 24) & 0xFF);
-
-    // Set frame interval (try to set 30 fps)
-    struct v4l2_streamparm streamparm;
-    CLEAR(streamparm);
-    streamparm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    streamparm.parm.capture.timeperframe.numerator = 1;
-    streamparm.parm.capture.timeperframe.denominator = 15;
-
-    if (-1 == ioctl(fd, VIDIOC_S_PARM, &streamparm)) {
-        perror("VIDIOC_S_PARM");
-    } else {
-        printf("Frame interval set to %d/%d\n", 
-               streamparm.parm.capture.timeperframe.numerator,
-               streamparm.parm.capture.timeperframe.denominator);
-    }
-
-    // Try to set some camera-specific controls
-    struct v4l2_control control;
-    CLEAR(control);
-    control.id = 0x009a2009;  // gain
-    control.value = 100;  // arbitrary value, adjust as needed
-    if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-        perror("VIDIOC_S_CTRL for gain");
-    }
-
-    CLEAR(control);
-    control.id = 0x009a200a;  // exposure
-    control.value = 10000;  // arbitrary value, adjust as needed
-    if (-1 == ioctl(fd, VIDIOC_S_CTRL, &control)) {
-        perror("VIDIOC_S_CTRL for exposure");
-    }
-
-    // Request buffers
-    CLEAR(req);
-    req.count = 4;
-    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    req.memory = V4L2_MEMORY_MMAP;
-
-    printf("Requesting buffers...\n");
-    if (-1 == ioctl(fd, VIDIOC_REQBUFS, &req)) {
-        perror("VIDIOC_REQBUFS");
-        exit(EXIT_FAILURE);
-    }
-    printf("Buffers requested successfully\n");
-
-    buffers = static_cast<buffer*>(calloc(req.count, sizeof(*buffers)));
-    if (!buffers) {
-        perror("Out of memory");
-        exit(EXIT_FAILURE);
-    }
-
-    for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
-        CLEAR(buf);
-
-        buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory      = V4L2_MEMORY_MMAP;
-        buf.index       = n_buffers;
-
-        printf("Querying buffer %d...\n", n_buffers);
-        if (-1 == ioctl(fd, VIDIOC_QUERYBUF, &buf)) {
-            perror("VIDIOC_QUERYBUF");
-            exit(EXIT_FAILURE);
-        }
-        printf("Buffer %d queried successfully\n", n_buffers);
-
-        buffers[n_buffers].length = buf.length;
-        buffers[n_buffers].start = mmap(NULL, buf.length,
-                      PROT_READ | PROT_WRITE, MAP_SHARED,
-                      fd, buf.m.offset);
-
-        if (MAP_FAILED == buffers[n_buffers].start) {
-            perror("mmap");
+    capture_open(&dev, &cfg);
+    if (cfg.metrics[0]) {
+        uint32_t ids[CAPTURE_MAX_CONTROLS];
+        for (int i = 0; i < cfg.n_controls; i++)
+            ids[i] = cfg.controls[i].id;
+        metrics_watch_controls(dev.fd, ids, cfg.n_controls);
+        if (metrics_start(cfg.metrics)) {
             exit(EXIT_FAILURE);
         }
     }
+    capture_start(&dev);
 
-    for (i = 0; i < n_buffers; ++i) {
-        CLEAR(buf);
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        buf.index = i;
+    // Create a window to display the video
+    if (!cfg.headless)
+        cv::namedWindow("Live Video", cv::WINDOW_NORMAL);
 
-        printf("Queueing buffer %d...\n", i);
-        if (-1 == ioctl(fd, VIDIOC_QBUF, &buf)) {
-            perror("VIDIOC_QBUF");
+    if (cfg.preview_port) {
+        if (mjpeg_server_start(&preview, cfg.preview_port, 1280, 720, cfg.quality))
             exit(EXIT_FAILURE);
-        }
-        printf("Buffer %d queued successfully\n", i);
-    }
-
-    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        INFO_PRINT("Preview at http://localhost:%d/\n", cfg.preview_port);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // Frame buffers for the processing stack are sized once here, in the
+    // type each conversion produces (demosaicing 16-bit Bayer gives 16-bit
+    // colour), so the conversions below write into them in place.
+    cv::Mat rgb_frame(dev.fmt.fmt.pix.height, dev.fmt.fmt.pix.width, CV_16UC3);
+    cv::Mat resized_frame(720, 1280, CV_16UC3);
+    cv::Mat display_frame(720, 1280, CV_8UC3);
+    cv::Mat preview_frame(720, 1280, CV_8UC3);
+    unsigned long frame_count = 0;
+    int failed = 0;
+#ifdef ALLOC_STATS
+    unsigned long steady_allocs = 0;
+#endif
 
-    printf("Starting stream...\n");
-    if (-1 == ioctl(fd, VIDIOC_STREAMON, &type)) {
-        perror("VIDIOC_STREAMON");
+    if (capture_first_frame(&dev, &cfg, &buf)) {
         exit(EXIT_FAILURE);
     }
-    printf("Stream started successfully\n");
+    printf("Time to first frame: %.0f ms\n", capture_process_age_ms());
 
-    // Create a window to display the video
-    cv::namedWindow("Live Video", cv::WINDOW_NORMAL);
-
-    // Enable auto controls
-    v4l2_control ctrl;
-
-    // Auto gain
-    ctrl.id = V4L2_CID_AUTOGAIN;
-    ctrl.value = 1;
-    if (ioctl(fd, VIDIOC_S_CTRL, &ctrl) == -1) {
-        perror("Failed to set auto gain");
-    }
+    while (!stop_requested) {
+        if (frame_count > 0) {
+            int r = capture_dequeue(&dev, &buf, 1000);
+            if (r < 0) {
+                if (capture_recover(&dev)) {
+                    failed = 1;
+                    break;
+                }
+                continue;
+            }
+            if (!r) {
+                fprintf(stderr, "select timeout\n");
+                continue;
+            }
+            if (buf.flags & V4L2_BUF_FLAG_ERROR) {
+                capture_requeue(&dev, &buf);
+                continue;
+            }
+        }
 
-    // Auto exposure
-    ctrl.id = V4L2_CID_EXPOSURE_AUTO;
-    ctrl.value = V4L2_EXPOSURE_AUTO;
-    if (ioctl(fd, VIDIOC_S_CTRL, &ctrl) == -1) {
-        perror("Failed to set auto exposure");
-    }
+#ifdef ALLOC_STATS
+        unsigned long allocs_before = memstats_alloc_count();
+#endif
 
-    // Auto white balance
-    ctrl.id = V4L2_CID_AUTO_WHITE_BALANCE;
-    ctrl.value = 1;
-    if (ioctl(fd, VIDIOC_S_CTRL, &ctrl) == -1) {
-        perror("Failed to set auto white balance");
-    }
+        struct metrics_timer timer;
+        metrics_timer_start(&timer);
 
-    while (true) {
-        FD_ZERO(&fds);
-        FD_SET(fd, &fds);
+        // The driver buffer is only read: the 10-bit samples go through the
+        // demosaic and resize as they are and are scaled to 8 bits once, on
+        // the 720p frame.
+        cv::Mat bayer_frame(dev.fmt.fmt.pix.height, dev.fmt.fmt.pix.width, CV_16UC1, dev.buffers[buf.index].start);
 
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
+        // OpenCV names Bayer patterns from the second row and column, so
+        // the sensor's RGGB is its BayerBG. The result is BGR, as imshow
+        // expects.
+        cv::cvtColor(bayer_frame, rgb_frame, cv::COLOR_BayerBG2BGR);
 
-        r = select(fd + 1, &fds, NULL, NULL, &tv);
+        // Resize to 720p (1280x720)
+        cv::resize(rgb_frame, resized_frame, cv::Size(1280, 720), 0, 0, cv::INTER_LINEAR);
+        resized_frame.convertTo(display_frame, CV_8U, 1.0 / 4);
+        metrics_timer_stop(&timer, STAGE_PROCESS);
 
-        if (-1 == r) {
-            perror("select");
-            exit(EXIT_FAILURE);
+        // The display frame is BGR; the preview encoder takes RGB.
+        if (cfg.preview_port) {
+            cv::cvtColor(display_frame, preview_frame, cv::COLOR_BGR2RGB);
+            mjpeg_server_submit(&preview, preview_frame.data, preview_frame.step);
         }
 
-        if (0 == r) {
-            fprintf(stderr, "select timeout\n");
-            continue;
-        }
+#ifdef ALLOC_STATS
+        // The first frame starts OpenCV's worker threads, which allocate;
+        // the Mats themselves are never reallocated.
+        if (frame_count > 0)
+            steady_allocs += memstats_alloc_count() - allocs_before;
+#endif
 
-        CLEAR(buf);
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
+        if (!cfg.headless)
+            cv::imshow("Live Video", display_frame);
 
-        if (-1 == ioctl(fd, VIDIOC_DQBUF, &buf)) {
-            perror("VIDIOC_DQBUF");
-            exit(EXIT_FAILURE);
+        if (++frame_count % 300 == 0) {
+            INFO_PRINT("Frames: %lu, peak RSS: %ld KiB\n", frame_count, memstats_peak_rss_kb());
         }
 
-        //process_buffer(buffers[buf.index].start, fmt.fmt.pix.width, fmt.fmt.pix.height);
-
-        // Process the image and display it in the window
-        cv::Mat bayer_frame(fmt.fmt.pix.height, fmt.fmt.pix.width, CV_16UC1, buffers[buf.index].start);
-        cv::Mat rgb_frame;
-
-        for(int i = 0; i < bayer_frame.rows; i++)
-            for(int j = 0; j < bayer_frame.cols; j++)
-                bayer_frame.at<uint16_t>(i,j) = bayer_frame.at<uint16_t>(i,j) << 6;
-
-        cv::cvtColor(bayer_frame, rgb_frame, cv::COLOR_BayerRG2RGB);
-
-        // Resize to 720p (1280x720)
-        cv::Mat resized_frame;
-        //cv::resize(process_image(buffers[buf.index].start, fmt.fmt.pix.width, fmt.fmt.pix.height), resized_frame, cv::Size(1280, 720), 0, 0, cv::INTER_LINEAR);
-        cv::resize(rgb_frame, resized_frame, cv::Size(1280, 720), 0, 0, cv::INTER_LINEAR);
-
-        cv::imshow("Live Video", resized_frame);
-
-        if (-1 == ioctl(fd, VIDIOC_QBUF, &buf)) {
-            perror("VIDIOC_QBUF");
-            exit(EXIT_FAILURE);
-        }
+        capture_requeue(&dev, &buf);
 
         // Exit the loop if 'q' is pressed
-        if (cv::waitKey(1) == 'q') {
+        if (!cfg.headless && cv::waitKey(1) == 'q') {
             break;
         }
     }
 
+    capture_stop(&dev);
+    metrics_stop();
 
-    // sleep(1);
-
-    // FD_ZERO(&fds);
-    // FD_SET(fd, &fds);
-
-    // tv.tv_sec = 10;  // Increase timeout to 10 seconds
-    // tv.tv_usec = 0;
-
-    // for (int attempt = 0; attempt < 5; attempt++) {
-    //     printf("Attempt %d: Waiting for frame (timeout: %ld seconds)...\n", attempt + 1, tv.tv_sec);
-    //     r = select(fd + 1, &fds, NULL, NULL, &tv);
-
-    //     if (-1 == r) {
-    //         perror("select");
-    //         exit(EXIT_FAILURE);
-    //     }
-
-    //     if (0 == r) {
-    //         fprintf(stderr, "select timeout\n");
-    //     } else {
-    //         printf("Frame is ready\n");
-    //         break;
-    //     }
-
-    //     // Check stream status
-    //     v4l2_input input;
-    //     CLEAR(input);
-    //     if (-1 == ioctl(fd, VIDIOC_G_INPUT, &input.index)) {
-    //         perror("VIDIOC_G_INPUT");
-    //     } else if (-1 == ioctl(fd, VIDIOC_ENUMINPUT, &input)) {
-    //         perror("VIDIOC_ENUMINPUT");
-    //     } else {
-    //         printf("Current input status: 0x%08X\n", input.status);
-    //     }
-    // }
-
-    // if (r == 0) {
-    //     int flags = fcntl(fd, F_GETFL, 0);
-    //     printf("File descriptor flags: %d\n", flags);
-    //     char buffer[4096];
-    //     ssize_t bytes_read = read(fd, buffer, sizeof(buffer));
-    //     if (bytes_read == -1) {
-    //         perror("read");
-    //     } else if (bytes_read == 0) {
-    //         printf("End of file reached\n");
-    //     } else {
-    //         printf("Read %zd bytes from device\n", bytes_read);
-    //     }
-    //     exit(EXIT_FAILURE);
-    // }
-
-    // CLEAR(buf);
-    // buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    // buf.memory = V4L2_MEMORY_MMAP;
-
-    // printf("Dequeuing buffer...\n");
-    // if (-1 == ioctl(fd, VIDIOC_DQBUF, &buf)) {
-    //     perror("VIDIOC_DQBUF");
-    //     exit(EXIT_FAILURE);
-    // }
-    // printf("Buffer dequeued successfully\n");
-
-    // snprintf(out_name, sizeof(out_name), "output_%ld.png", buf.timestamp.tv_sec);
-    // process_image(buffers[buf.index].start, buf.bytesused, out_name, fmt.fmt.pix.width, fmt.fmt.pix.height);
-
-    // printf("Queueing buffer...\n");
-    // if (-1 == ioctl(fd, VIDIOC_QBUF, &buf)) {
-    //     perror("VIDIOC_QBUF");
-    //     exit(EXIT_FAILURE);
-    // }
-    // printf("Buffer queued successfully\n");
-
-    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    printf("Stopping stream...\n");
-    if (-1 == ioctl(fd, VIDIOC_STREAMOFF, &type)) {
-        perror("VIDIOC_STREAMOFF");
-        exit(EXIT_FAILURE);
+    if (cfg.preview_port) {
+        mjpeg_server_stop(&preview);
+        printf("Preview frames: %lu encoded, %lu skipped\n", preview.encoded, preview.skipped);
     }
-    printf("Stream stopped successfully\n");
-
-    for (i = 0; i < n_buffers; ++i)
-        munmap(buffers[i].start, buffers[i].length);
 
-    close(fd);
-
-    printf("Image saved as %s\n", out_name);
+    printf("Frames: %lu, peak RSS: %ld KiB\n", frame_count, memstats_peak_rss_kb());
+#ifdef ALLOC_STATS
+    printf("Steady-state heap allocations: %lu\n", steady_allocs);
+    if (steady_allocs != 0) {
+        fprintf(stderr, "Processing stack is not allocation-free\n");
+        return EXIT_FAILURE;
+    }
+#endif
 
-    return 0;
+    return failed ? EXIT_FAILURE : 0;
 }
\ No newline at end of file
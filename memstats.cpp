@@ -0,0 +1,93 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <errno.h>
+#include <stddef.h>
+#include <sys/resource.h>
+#include "memstats.h"
+
+long memstats_peak_rss_kb(void) {
+    struct rusage ru;
+    if (-1 == getrusage(RUSAGE_SELF, &ru))
+        return -1;
+    return ru.ru_maxrss;
+}
+
+#ifdef ALLOC_STATS
+
+// Counting allocator. glibc exports its real allocator under the __libc_
+// names, so these wrappers can sit in front of it without dlsym tricks.
+// Every C and C++ allocation is counted: operator new ends up in malloc,
+// aligned operator new and OpenCV's fastMalloc in aligned_alloc or
+// posix_memalign.
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+void *__libc_memalign(size_t align, size_t size);
+void  __libc_free(void *p);
+}
+
+static unsigned long alloc_count;
+
+unsigned long memstats_alloc_count(void) {
+    return __atomic_load_n(&alloc_count, __ATOMIC_RELAXED);
+}
+
+extern "C" void *malloc(size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+extern "C" void *realloc(void *p, size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(p, size);
+}
+
+extern "C" void *memalign(size_t align, size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_memalign(align, size);
+}
+
+extern "C" int posix_memalign(void **p, size_t align, size_t size) {
+    if (align % sizeof(void *) || (align & (align - 1)))
+        return EINVAL;
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    void *m = __libc_memalign(align, size);
+    if (!m)
+        return ENOMEM;
+    *p = m;
+    return 0;
+}
+
+extern "C" void *aligned_alloc(size_t align, size_t size) {
+    __atomic_add_fetch(&alloc_count, 1, __ATOMIC_RELAXED);
+    return __libc_memalign(align, size);
+}
+
+extern "C" void free(void *p) {
+    __libc_free(p);
+}
+
+#endif
@@ -0,0 +1,435 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <cerrno>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/videodev2.h>
+#include "memstats.h"
+#include "metrics.h"
+
+#define METRICS_RESPONSE_SIZE   (64 * 1024)
+
+// Upper bounds of the stage histogram buckets, in nanoseconds.
+static const uint64_t bucket_ns[METRICS_BUCKETS] = {
+    100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+    25000000, 50000000, 100000000, 250000000, 500000000, 1000000000, 2500000000,
+};
+
+static const char *stage_names[METRIC_N_STAGES] = {
+    "dequeue", "stack", "motion", "process", "preview", "recovery",
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} counter_info[METRIC_N_COUNTERS] = {
+    { "v4l2_frames_dequeued_total",   "Frames dequeued from the driver." },
+    { "v4l2_frames_dropped_total",    "Frames missing from the buffer sequence." },
+    { "v4l2_frames_errored_total",    "Frames the driver flagged as corrupt." },
+    { "v4l2_dequeue_timeouts_total",  "Waits for a frame that timed out." },
+    { "v4l2_frames_saved_total",      "Frames written to disk." },
+    { "v4l2_bytes_written_total",     "Bytes of image data written to disk." },
+    { "v4l2_stream_recoveries_total", "Stream restarts and device reopens after a fault." },
+};
+
+struct metrics_slot {
+    uint64_t counters[METRIC_N_COUNTERS];
+    uint64_t buckets[METRIC_N_STAGES][METRICS_BUCKETS + 1];
+    uint64_t count[METRIC_N_STAGES];
+    uint64_t wall_ns[METRIC_N_STAGES];
+    uint64_t cpu_ns[METRIC_N_STAGES];
+} __attribute__((aligned(64)));
+
+struct watched_control {
+    uint32_t id;
+    char     name[32];
+};
+
+static struct metrics_slot slots[METRICS_MAX_THREADS];
+static int n_slots;
+static __thread struct metrics_slot *thread_slot;
+
+static int64_t gauges[METRIC_N_GAUGES];
+static int64_t last_frame_stats;    // seconds, CLOCK_MONOTONIC_COARSE
+
+static int enabled;
+static int stop_requested;
+static int listen_fd = -1;
+static char unix_path[108];
+static pthread_t server_thread;
+
+static int control_fd = -1;
+static struct watched_control controls[METRICS_MAX_CONTROLS];
+static int n_controls;
+
+// Claims a slot for the calling thread. Threads beyond the last slot share
+// it; updates are atomic adds, so that stays correct, just not private.
+static struct metrics_slot *my_slot(void) {
+    if (!thread_slot) {
+        int index = __atomic_fetch_add(&n_slots, 1, __ATOMIC_RELAXED);
+        thread_slot = &slots[index < METRICS_MAX_THREADS ? index : METRICS_MAX_THREADS - 1];
+    }
+    return thread_slot;
+}
+
+int metrics_enabled(void) {
+    return __atomic_load_n(&enabled, __ATOMIC_RELAXED);
+}
+
+void metrics_add(enum metrics_counter counter, uint64_t n) {
+    if (!metrics_enabled())
+        return;
+    __atomic_fetch_add(&my_slot()->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+void metrics_set(enum metrics_gauge gauge, int64_t value) {
+    if (!metrics_enabled())
+        return;
+    __atomic_store_n(&gauges[gauge], value, __ATOMIC_RELAXED);
+}
+
+void metrics_timer_start(struct metrics_timer *t) {
+    if (!metrics_enabled())
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &t->wall);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t->cpu);
+}
+
+static uint64_t elapsed_ns(const struct timespec *since, clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000000ULL + now.tv_nsec - since->tv_nsec;
+}
+
+void metrics_timer_stop(struct metrics_timer *t, enum metrics_stage stage) {
+    if (!metrics_enabled())
+        return;
+    uint64_t wall = elapsed_ns(&t->wall, CLOCK_MONOTONIC);
+    uint64_t cpu = elapsed_ns(&t->cpu, CLOCK_THREAD_CPUTIME_ID);
+
+    int bucket = 0;
+    while (bucket < METRICS_BUCKETS && wall > bucket_ns[bucket])
+        bucket++;
+
+    struct metrics_slot *slot = my_slot();
+    __atomic_fetch_add(&slot->buckets[stage][bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&slot->count[stage], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&slot->wall_ns[stage], wall, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&slot->cpu_ns[stage], cpu, __ATOMIC_RELAXED);
+}
+
+void metrics_watch_controls(int fd, const uint32_t *ids, int n) {
+    // Always try the standard exposure and gain controls as well; the ones
+    // the device does not have are skipped.
+    uint32_t all[METRICS_MAX_CONTROLS * 2];
+    int n_all = 0;
+    for (int i = 0; i < n && n_all < METRICS_MAX_CONTROLS; i++)
+        all[n_all++] = ids[i];
+    all[n_all++] = V4L2_CID_EXPOSURE;
+    all[n_all++] = V4L2_CID_EXPOSURE_ABSOLUTE;
+    all[n_all++] = V4L2_CID_GAIN;
+    all[n_all++] = V4L2_CID_ANALOGUE_GAIN;
+
+    control_fd = fd;
+    n_controls = 0;
+    for (int i = 0; i < n_all && n_controls < METRICS_MAX_CONTROLS; i++) {
+        struct v4l2_queryctrl query;
+        memset(&query, 0, sizeof(query));
+        query.id = all[i];
+        if (-1 == ioctl(fd, VIDIOC_QUERYCTRL, &query) || (query.flags & V4L2_CTRL_FLAG_DISABLED))
+            continue;
+
+        int duplicate = 0;
+        for (int k = 0; k < n_controls; k++)
+            duplicate |= controls[k].id == all[i];
+        if (duplicate)
+            continue;
+
+        struct watched_control *c = &controls[n_controls++];
+        c->id = all[i];
+        // Label-safe copy of the driver's name.
+        size_t k = 0;
+        for (; k < sizeof(c->name) - 1 && query.name[k]; k++) {
+            char ch = query.name[k];
+            c->name[k] = (ch == '"' || ch == '\\' || ch < ' ') ? '_' : ch;
+        }
+        c->name[k] = '\0';
+    }
+}
+
+void metrics_frame_stats(const uint16_t *raw, size_t pixels) {
+    struct timespec now;
+    if (!metrics_enabled() || !pixels)
+        return;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    int64_t last = __atomic_load_n(&last_frame_stats, __ATOMIC_RELAXED);
+    if (now.tv_sec - last < 1)
+        return;
+    // Several threads may see the same frame period; one of them wins it.
+    if (!__atomic_compare_exchange_n(&last_frame_stats, &last, (int64_t)now.tv_sec, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+
+    uint64_t sum = 0, clipped = 0;
+    for (size_t i = 0; i < pixels; i++) {
+        uint32_t v = raw[i] & 0x03FF;
+        sum += v;
+        clipped += v == 0x03FF;
+    }
+    metrics_set(GAUGE_FRAME_MEAN, sum * 1000 / pixels);
+    metrics_set(GAUGE_FRAME_CLIPPED, clipped * 1000000 / pixels);
+}
+
+// --- exposition -----------------------------------------------------------
+
+struct text {
+    char   *buf;
+    size_t len;
+    size_t cap;
+};
+
+static void append(struct text *t, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(t->buf + t->len, t->cap - t->len, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        t->len = (size_t)n < t->cap - t->len ? t->len + n : t->cap - 1;
+}
+
+static uint64_t sum_slots(size_t offset) {
+    uint64_t total = 0;
+    for (int i = 0; i < METRICS_MAX_THREADS; i++)
+        total += __atomic_load_n((const uint64_t *)((const char *)&slots[i] + offset), __ATOMIC_RELAXED);
+    return total;
+}
+
+#define SLOT_OFFSET(field) ((size_t)((const char *)&slots[0].field - (const char *)&slots[0]))
+
+static void render(struct text *t) {
+    for (int c = 0; c < METRIC_N_COUNTERS; c++) {
+        append(t, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+               counter_info[c].name, counter_info[c].help, counter_info[c].name, counter_info[c].name,
+               (unsigned long long)sum_slots(SLOT_OFFSET(counters[c])));
+    }
+
+    append(t, "# HELP v4l2_stage_duration_seconds Wall time per frame and pipeline stage.\n"
+              "# TYPE v4l2_stage_duration_seconds histogram\n");
+    for (int s = 0; s < METRIC_N_STAGES; s++) {
+        uint64_t cumulative = 0;
+        for (int b = 0; b <= METRICS_BUCKETS; b++) {
+            cumulative += sum_slots(SLOT_OFFSET(buckets[s][b]));
+            if (b < METRICS_BUCKETS)
+                append(t, "v4l2_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+                       stage_names[s], bucket_ns[b] / 1e9, (unsigned long long)cumulative);
+            else
+                append(t, "v4l2_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+                       stage_names[s], (unsigned long long)cumulative);
+        }
+        append(t, "v4l2_stage_duration_seconds_sum{stage=\"%s\"} %.6f\n",
+               stage_names[s], sum_slots(SLOT_OFFSET(wall_ns[s])) / 1e9);
+        append(t, "v4l2_stage_duration_seconds_count{stage=\"%s\"} %llu\n",
+               stage_names[s], (unsigned long long)sum_slots(SLOT_OFFSET(count[s])));
+    }
+
+    append(t, "# HELP v4l2_stage_cpu_seconds_total CPU time spent per pipeline stage.\n"
+              "# TYPE v4l2_stage_cpu_seconds_total counter\n");
+    for (int s = 0; s < METRIC_N_STAGES; s++) {
+        append(t, "v4l2_stage_cpu_seconds_total{stage=\"%s\"} %.6f\n",
+               stage_names[s], sum_slots(SLOT_OFFSET(cpu_ns[s])) / 1e9);
+    }
+
+    append(t, "# HELP v4l2_queue_depth Frames dispatched for encoding but not yet saved.\n"
+              "# TYPE v4l2_queue_depth gauge\nv4l2_queue_depth %lld\n",
+           (long long)__atomic_load_n(&gauges[GAUGE_QUEUE_DEPTH], __ATOMIC_RELAXED));
+    append(t, "# HELP v4l2_frame_mean_level Mean raw sample level of a recent frame (0-1023).\n"
+              "# TYPE v4l2_frame_mean_level gauge\nv4l2_frame_mean_level %.3f\n",
+           __atomic_load_n(&gauges[GAUGE_FRAME_MEAN], __ATOMIC_RELAXED) / 1e3);
+    append(t, "# HELP v4l2_frame_clipped_ratio Share of saturated samples in a recent frame.\n"
+              "# TYPE v4l2_frame_clipped_ratio gauge\nv4l2_frame_clipped_ratio %.6f\n",
+           __atomic_load_n(&gauges[GAUGE_FRAME_CLIPPED], __ATOMIC_RELAXED) / 1e6);
+
+    if (n_controls) {
+        append(t, "# HELP v4l2_control_value Current value of a sensor control.\n"
+                  "# TYPE v4l2_control_value gauge\n");
+        for (int i = 0; i < n_controls; i++) {
+            struct v4l2_control ctrl;
+            ctrl.id = controls[i].id;
+            ctrl.value = 0;
+            if (-1 == ioctl(control_fd, VIDIOC_G_CTRL, &ctrl))
+                continue;
+            append(t, "v4l2_control_value{id=\"0x%08x\",name=\"%s\"} %d\n",
+                   controls[i].id, controls[i].name, ctrl.value);
+        }
+    }
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    append(t, "# HELP process_cpu_seconds_total Total user and system CPU time.\n"
+              "# TYPE process_cpu_seconds_total counter\nprocess_cpu_seconds_total %.3f\n",
+           ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6);
+    append(t, "# HELP process_max_resident_memory_bytes Peak resident set size.\n"
+              "# TYPE process_max_resident_memory_bytes gauge\nprocess_max_resident_memory_bytes %ld\n",
+           memstats_peak_rss_kb() * 1024);
+}
+
+// --- endpoint -------------------------------------------------------------
+
+static void serve_client(int fd, char *response) {
+    char request[1024];
+    size_t len = 0;
+
+    // Read the request head; a scraper sends it in one go.
+    struct timeval tv = { 1, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while (len < sizeof(request) - 1) {
+        ssize_t n = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+        if (n <= 0)
+            return;
+        len += n;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n"))
+            break;
+    }
+
+    struct text body = { response + 256, 0, METRICS_RESPONSE_SIZE - 256 };
+    int ok = !strncmp(request, "GET /metrics ", 13) || !strncmp(request, "GET / ", 6);
+    if (ok)
+        render(&body);
+
+    int head = snprintf(response, 256,
+                        "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                        ok ? "200 OK" : "404 Not Found", body.len);
+    // Slide the header up against the body and send both in one write.
+    char *start = body.buf - head;
+    memmove(start, response, head);
+    size_t total = head + body.len;
+    while (total > 0) {
+        ssize_t n = send(fd, start, total, MSG_NOSIGNAL);
+        if (n <= 0)
+            return;
+        start += n;
+        total -= n;
+    }
+}
+
+static void *server_main(void *arg) {
+    char *response = (char *)arg;
+    while (!__atomic_load_n(&stop_requested, __ATOMIC_ACQUIRE)) {
+        struct pollfd pfd = { listen_fd, POLLIN, 0 };
+        int r = poll(&pfd, 1, 500);
+        if (r <= 0)
+            continue;
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0)
+            continue;
+        serve_client(fd, response);
+        close(fd);
+    }
+    free(response);
+    return NULL;
+}
+
+static int open_endpoint(const char *addr) {
+    int fd;
+    if (addr[0] == '/') {
+        struct sockaddr_un sun;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        if (strlen(addr) >= sizeof(sun.sun_path)) {
+            fprintf(stderr, "Metrics socket path too long\n");
+            return -1;
+        }
+        strcpy(sun.sun_path, addr);
+        unlink(addr);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || -1 == bind(fd, (struct sockaddr *)&sun, sizeof(sun))) {
+            perror(addr);
+            return -1;
+        }
+        strcpy(unix_path, addr);
+    } else {
+        char *end;
+        long port = strtol(addr, &end, 10);
+        if (*end || port < 1 || port > 65535) {
+            fprintf(stderr, "Invalid metrics address '%s'\n", addr);
+            return -1;
+        }
+        struct sockaddr_in sin;
+        int one = 1;
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sin.sin_port = htons(port);
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0)
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (fd < 0 || -1 == bind(fd, (struct sockaddr *)&sin, sizeof(sin))) {
+            perror("metrics endpoint");
+            return -1;
+        }
+    }
+    if (-1 == listen(fd, 4)) {
+        perror("listen");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int metrics_start(const char *addr) {
+    listen_fd = open_endpoint(addr);
+    if (listen_fd < 0)
+        return -1;
+
+    char *response = (char *)malloc(METRICS_RESPONSE_SIZE);
+    if (!response) {
+        perror("Out of memory");
+        return -1;
+    }
+    __atomic_store_n(&enabled, 1, __ATOMIC_RELAXED);
+    if (pthread_create(&server_thread, NULL, server_main, response)) {
+        fprintf(stderr, "Cannot start metrics thread\n");
+        return -1;
+    }
+    return 0;
+}
+
+void metrics_stop(void) {
+    if (listen_fd < 0)
+        return;
+    __atomic_store_n(&stop_requested, 1, __ATOMIC_RELEASE);
+    pthread_join(server_thread, NULL);
+    close(listen_fd);
+    listen_fd = -1;
+    if (unix_path[0])
+        unlink(unix_path);
+}
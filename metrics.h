@@ -0,0 +1,89 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define METRICS_MAX_THREADS     32
+#define METRICS_BUCKETS         14
+#define METRICS_MAX_CONTROLS    8
+
+enum metrics_counter {
+    METRIC_FRAMES_DEQUEUED,
+    METRIC_FRAMES_DROPPED,      // sequence gaps: frames the driver dropped
+    METRIC_FRAMES_ERRORED,      // V4L2_BUF_FLAG_ERROR
+    METRIC_DEQUEUE_TIMEOUTS,
+    METRIC_FRAMES_SAVED,
+    METRIC_BYTES_WRITTEN,
+    METRIC_RECOVERIES,          // stream restarts and device reopens
+    METRIC_N_COUNTERS,
+};
+
+enum metrics_stage {
+    STAGE_DEQUEUE,              // waiting for the driver
+    STAGE_STACK,
+    STAGE_MOTION,
+    STAGE_PROCESS,              // correction, demosaic and encode
+    STAGE_PREVIEW,
+    STAGE_RECOVERY,             // fault to streaming again
+    METRIC_N_STAGES,
+};
+
+enum metrics_gauge {
+    GAUGE_QUEUE_DEPTH,          // frames dispatched but not yet saved
+    GAUGE_FRAME_MEAN,           // mean raw level, 0-1023, x1000
+    GAUGE_FRAME_CLIPPED,        // share of samples at 1023, x1000000
+    METRIC_N_GAUGES,
+};
+
+// Counters and stage histograms live in per-thread slots: each thread
+// claims its own cache-line-aligned slot on first use, so hot-path updates
+// never share a cache line, and a scrape sums the slots. Gauges are single
+// values set by whichever thread owns them. When no endpoint was started
+// every update is a single branch.
+//
+// The endpoint serves Prometheus text format over HTTP, on a localhost TCP
+// port or on a UNIX socket when the address starts with '/':
+//
+//   curl http://localhost:9100/metrics
+//   curl --unix-socket /run/v4l2_png.sock http://x/metrics
+struct metrics_timer {
+    struct timespec wall;
+    struct timespec cpu;
+};
+
+int  metrics_start(const char *addr);
+void metrics_stop(void);
+int  metrics_enabled(void);
+
+void metrics_add(enum metrics_counter counter, uint64_t n);
+void metrics_set(enum metrics_gauge gauge, int64_t value);
+void metrics_timer_start(struct metrics_timer *t);
+void metrics_timer_stop(struct metrics_timer *t, enum metrics_stage stage);
+
+// Sensor controls read back at scrape time (exposure, gain, ...).
+void metrics_watch_controls(int fd, const uint32_t *ids, int n);
+// Full-frame level statistics, recomputed at most once per second.
+void metrics_frame_stats(const uint16_t *raw, size_t pixels);
+
+#endif
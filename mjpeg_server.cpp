@@ -0,0 +1,496 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <cerrno>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <jpeglib.h>
+#include "metrics.h"
+#include "mjpeg_server.h"
+
+static const char stream_header[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Pragma: no-cache\r\n"
+    "Connection: close\r\n"
+    "Content-Type: multipart/x-mixed-replace; boundary=frame\r\n"
+    "\r\n";
+
+static const char index_page[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/html\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "<html><body style=\"margin:0;background:#000\">"
+    "<img src=\"/stream\" style=\"width:100%\"></body></html>\n";
+
+static const char not_found[] =
+    "HTTP/1.0 404 Not Found\r\n"
+    "Content-Type: text/plain\r\n"
+    "Connection: close\r\n"
+    "\r\n"
+    "not found\n";
+
+static const char part_trailer[] = "\r\n";
+
+// --- encoder thread -------------------------------------------------------
+
+static int free_slot(struct mjpeg_server *srv) {
+    for (int i = 0; i < MJPEG_SLOTS; i++) {
+        if (i != srv->latest && srv->frames[i].refs == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Worst-case JPEG size for the 4:2:0 sampling jpeg_set_defaults() picks,
+// as libjpeg-turbo's tjBufSize() computes it: three bytes per pixel of the
+// MCU-padded image plus headers.
+static unsigned long jpeg_bound(int width, int height) {
+    return (unsigned long)((width + 15) & ~15) * ((height + 15) & ~15) * 3 + 2048;
+}
+
+static void *encoder_main(void *arg) {
+    struct mjpeg_server *srv = (struct mjpeg_server *)arg;
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    uint64_t one = 1;
+
+    // One compressor for the lifetime of the server; only the destination
+    // buffer changes per frame.
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    cinfo.image_width = srv->width;
+    cinfo.image_height = srv->height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, srv->quality, TRUE);
+    cinfo.dct_method = JDCT_IFAST;
+
+    for (;;) {
+        pthread_mutex_lock(&srv->input_lock);
+        while (!srv->input_ready && !srv->stop)
+            pthread_cond_wait(&srv->input_cond, &srv->input_lock);
+        int stop = srv->stop;
+        pthread_mutex_unlock(&srv->input_lock);
+        if (stop)
+            break;
+
+        pthread_mutex_lock(&srv->frame_lock);
+        int slot = free_slot(srv);
+        pthread_mutex_unlock(&srv->frame_lock);
+
+        if (slot >= 0) {
+            struct mjpeg_frame *frame = &srv->frames[slot];
+            unsigned char *buf = frame->data;
+            unsigned long size = frame->cap;
+            struct metrics_timer timer;
+            metrics_timer_start(&timer);
+
+            // Slots are allocated at the worst-case size, so jpeg_mem_dest
+            // writes into the slot and never reallocates; afterwards size is
+            // the length of the JPEG.
+            jpeg_mem_dest(&cinfo, &buf, &size);
+            jpeg_start_compress(&cinfo, TRUE);
+            while (cinfo.next_scanline < cinfo.image_height) {
+                JSAMPROW row = srv->input + (size_t)cinfo.next_scanline * srv->width * 3;
+                jpeg_write_scanlines(&cinfo, &row, 1);
+            }
+            jpeg_finish_compress(&cinfo);
+
+            if (buf != frame->data) {
+                // Only if the bound is ever wrong: keep libjpeg's buffer,
+                // which holds at least size bytes.
+                free(frame->data);
+                frame->data = buf;
+                frame->cap = size;
+            }
+            frame->size = size;
+            metrics_timer_stop(&timer, STAGE_PREVIEW);
+
+            pthread_mutex_lock(&srv->frame_lock);
+            frame->generation = ++srv->generation;
+            srv->latest = slot;
+            srv->encoded++;
+            pthread_mutex_unlock(&srv->frame_lock);
+
+            if (write(srv->wake_fd, &one, sizeof(one)) < 0)
+                perror("eventfd write");
+        }
+
+        pthread_mutex_lock(&srv->input_lock);
+        srv->input_ready = 0;
+        pthread_mutex_unlock(&srv->input_lock);
+    }
+
+    jpeg_destroy_compress(&cinfo);
+    return NULL;
+}
+
+void mjpeg_server_submit(struct mjpeg_server *srv, const uint8_t *rgb, size_t stride) {
+    // Never wait on the encoder: if it is still busy with the previous
+    // preview frame, this one is skipped.
+    if (pthread_mutex_trylock(&srv->input_lock)) {
+        srv->skipped++;
+        return;
+    }
+    srv->submitted++;
+    if (srv->input_ready || __atomic_load_n(&srv->n_clients, __ATOMIC_RELAXED) == 0) {
+        if (srv->input_ready)
+            srv->skipped++;
+        pthread_mutex_unlock(&srv->input_lock);
+        return;
+    }
+    for (int y = 0; y < srv->height; y++)
+        memcpy(srv->input + (size_t)y * srv->width * 3, rgb + y * stride, (size_t)srv->width * 3);
+    srv->input_ready = 1;
+    pthread_cond_signal(&srv->input_cond);
+    pthread_mutex_unlock(&srv->input_lock);
+}
+
+// --- network thread -------------------------------------------------------
+
+static void release_slot(struct mjpeg_server *srv, struct mjpeg_client *c) {
+    if (c->slot < 0)
+        return;
+    pthread_mutex_lock(&srv->frame_lock);
+    srv->frames[c->slot].refs--;
+    pthread_mutex_unlock(&srv->frame_lock);
+    c->slot = -1;
+}
+
+static void drop_client(struct mjpeg_server *srv, int index) {
+    struct mjpeg_client *c = &srv->clients[index];
+    release_slot(srv, c);
+    close(c->fd);
+    struct mjpeg_client *last = &srv->clients[srv->n_clients - 1];
+    if (c != last) {
+        *c = *last;
+        // out[0] may point into the moved client's own header buffer.
+        uint8_t *base = (uint8_t *)c->out[0].iov_base;
+        if (base >= (uint8_t *)last->header && base <= (uint8_t *)last->header + sizeof(last->header))
+            c->out[0].iov_base = c->header + (base - (uint8_t *)last->header);
+    }
+    __atomic_store_n(&srv->n_clients, srv->n_clients - 1, __ATOMIC_RELAXED);
+}
+
+static void queue_static(struct mjpeg_client *c, const char *text, size_t len) {
+    c->out[0].iov_base = (void *)text;
+    c->out[0].iov_len = len;
+    c->n_out = 1;
+}
+
+// Attaches the newest frame to an idle client if it has not sent it yet.
+static void attach_latest(struct mjpeg_server *srv, struct mjpeg_client *c) {
+    pthread_mutex_lock(&srv->frame_lock);
+    if (srv->latest >= 0 && srv->frames[srv->latest].generation != c->generation) {
+        struct mjpeg_frame *frame = &srv->frames[srv->latest];
+        frame->refs++;
+        c->slot = srv->latest;
+        c->generation = frame->generation;
+
+        int n;
+        if (c->streaming) {
+            n = snprintf(c->header, sizeof(c->header),
+                         "--frame\r\nContent-Type: image/jpeg\r\nContent-Length: %lu\r\n\r\n",
+                         frame->size);
+        } else {
+            n = snprintf(c->header, sizeof(c->header),
+                         "HTTP/1.0 200 OK\r\nContent-Type: image/jpeg\r\n"
+                         "Content-Length: %lu\r\nConnection: close\r\n\r\n", frame->size);
+            c->closing = 1;
+        }
+        c->out[0].iov_base = c->header;
+        c->out[0].iov_len = n;
+        c->out[1].iov_base = frame->data;
+        c->out[1].iov_len = frame->size;
+        c->out[2].iov_base = (void *)part_trailer;
+        c->out[2].iov_len = c->streaming ? sizeof(part_trailer) - 1 : 0;
+        c->n_out = 3;
+    }
+    pthread_mutex_unlock(&srv->frame_lock);
+}
+
+static void handle_request(struct mjpeg_server *srv, struct mjpeg_client *c) {
+    char method[8], path[128];
+
+    if (sscanf(c->request, "%7s %127s", method, path) != 2 || strcmp(method, "GET")) {
+        queue_static(c, not_found, sizeof(not_found) - 1);
+        c->closing = 1;
+    } else if (!strcmp(path, "/stream")) {
+        c->streaming = 1;
+        queue_static(c, stream_header, sizeof(stream_header) - 1);
+    } else if (!strcmp(path, "/frame.jpg")) {
+        // If nothing has been encoded yet the network loop attaches the
+        // first frame once it is published.
+        attach_latest(srv, c);
+    } else if (!strcmp(path, "/")) {
+        queue_static(c, index_page, sizeof(index_page) - 1);
+        c->closing = 1;
+    } else {
+        queue_static(c, not_found, sizeof(not_found) - 1);
+        c->closing = 1;
+    }
+    c->request_len = sizeof(c->request);    // request consumed
+}
+
+// Returns -1 if the client should be dropped.
+static int read_request(struct mjpeg_server *srv, struct mjpeg_client *c) {
+    char discard[256];
+    if (c->request_len >= sizeof(c->request)) {
+        // Request already handled; drain whatever else the client sends.
+        ssize_t n = recv(c->fd, discard, sizeof(discard), 0);
+        return (n == 0 || (n < 0 && errno != EAGAIN)) ? -1 : 0;
+    }
+
+    ssize_t n = recv(c->fd, c->request + c->request_len, sizeof(c->request) - 1 - c->request_len, 0);
+    if (n == 0 || (n < 0 && errno != EAGAIN))
+        return -1;
+    if (n < 0)
+        return 0;
+    c->request_len += n;
+    c->request[c->request_len] = '\0';
+
+    if (strstr(c->request, "\r\n\r\n") || strstr(c->request, "\n\n"))
+        handle_request(srv, c);
+    else if (c->request_len == sizeof(c->request) - 1)
+        return -1;
+    return 0;
+}
+
+// Sends as much pending output as the socket takes. Returns -1 on error.
+static int flush_client(struct mjpeg_server *srv, struct mjpeg_client *c) {
+    while (c->n_out > 0) {
+        int first = 0;
+        while (first < c->n_out && c->out[first].iov_len == 0)
+            first++;
+        if (first == c->n_out) {
+            c->n_out = 0;
+            break;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = c->out + first;
+        msg.msg_iovlen = c->n_out - first;
+        ssize_t n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0)
+            return errno == EAGAIN ? 0 : -1;
+        for (int i = first; i < c->n_out && n > 0; i++) {
+            size_t k = (size_t)n < c->out[i].iov_len ? (size_t)n : c->out[i].iov_len;
+            c->out[i].iov_base = (uint8_t *)c->out[i].iov_base + k;
+            c->out[i].iov_len -= k;
+            n -= k;
+        }
+    }
+
+    release_slot(srv, c);
+    if (c->closing)
+        return -1;
+    return 0;
+}
+
+static void accept_clients(struct mjpeg_server *srv) {
+    for (;;) {
+        int fd = accept4(srv->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN)
+                perror("accept");
+            return;
+        }
+        if (srv->n_clients == MJPEG_MAX_CLIENTS) {
+            close(fd);
+            continue;
+        }
+        struct mjpeg_client *c = &srv->clients[srv->n_clients];
+        memset(c, 0, sizeof(*c));
+        c->fd = fd;
+        c->slot = -1;
+        __atomic_store_n(&srv->n_clients, srv->n_clients + 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void *network_main(void *arg) {
+    struct mjpeg_server *srv = (struct mjpeg_server *)arg;
+    struct pollfd fds[2 + MJPEG_MAX_CLIENTS];
+
+    while (!__atomic_load_n(&srv->stop, __ATOMIC_ACQUIRE)) {
+        int n = 0;
+        fds[n++] = (struct pollfd){ srv->listen_fd, POLLIN, 0 };
+        fds[n++] = (struct pollfd){ srv->wake_fd, POLLIN, 0 };
+        for (int i = 0; i < srv->n_clients; i++) {
+            struct mjpeg_client *c = &srv->clients[i];
+            fds[n++] = (struct pollfd){ c->fd, (short)(POLLIN | (c->n_out ? POLLOUT : 0)), 0 };
+        }
+
+        if (-1 == poll(fds, n, 200)) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        if (fds[1].revents) {
+            uint64_t count;
+            if (read(srv->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                perror("eventfd read");
+        }
+
+        // Walk backwards: drop_client() moves the last client into the
+        // freed slot.
+        for (int i = n - 1; i >= 2; i--) {
+            struct mjpeg_client *c = &srv->clients[i - 2];
+            if ((fds[i].revents & (POLLERR | POLLHUP)) ||
+                ((fds[i].revents & POLLIN) && read_request(srv, c))) {
+                drop_client(srv, i - 2);
+                continue;
+            }
+            // Idle viewers pick up the newest frame, skipping any they
+            // were too slow to receive.
+            int waiting = c->streaming || (c->request_len >= sizeof(c->request) && !c->closing);
+            int dropped = 0;
+            for (int round = 0; round < 2 && !dropped; round++) {
+                if (!c->n_out && waiting)
+                    attach_latest(srv, c);
+                if (!c->n_out)
+                    break;
+                dropped = flush_client(srv, c);
+            }
+            if (dropped)
+                drop_client(srv, i - 2);
+        }
+
+        if (fds[0].revents)
+            accept_clients(srv);
+    }
+    return NULL;
+}
+
+// Listens on every address. A dual-stack IPv6 socket takes IPv4 clients as
+// well; hosts booted with ipv6.disable=1 cannot create one, so fall back to
+// IPv4 only.
+static int open_listener(int port) {
+    int one = 1;
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd >= 0) {
+        struct sockaddr_in6 addr;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        memset(&addr, 0, sizeof(addr));
+        addr.sin6_family = AF_INET6;
+        addr.sin6_addr = in6addr_any;
+        addr.sin6_port = htons(port);
+        if (0 == bind(fd, (struct sockaddr *)&addr, sizeof(addr)))
+            return fd;
+        close(fd);
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    struct sockaddr_in addr;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (-1 == bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        perror("preview server");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int mjpeg_server_start(struct mjpeg_server *srv, int port, int width, int height, int quality) {
+    memset(srv, 0, sizeof(*srv));
+    srv->width = width;
+    srv->height = height;
+    srv->quality = quality;
+    srv->latest = -1;
+    pthread_mutex_init(&srv->input_lock, NULL);
+    pthread_cond_init(&srv->input_cond, NULL);
+    pthread_mutex_init(&srv->frame_lock, NULL);
+
+    srv->input = (uint8_t *)malloc((size_t)width * height * 3);
+    if (!srv->input) {
+        perror("Out of memory");
+        return -1;
+    }
+    for (int i = 0; i < MJPEG_SLOTS; i++) {
+        srv->frames[i].cap = jpeg_bound(width, height);
+        srv->frames[i].data = (uint8_t *)malloc(srv->frames[i].cap);
+        if (!srv->frames[i].data) {
+            perror("Out of memory");
+            return -1;
+        }
+    }
+
+    srv->listen_fd = open_listener(port);
+    if (srv->listen_fd < 0)
+        return -1;
+    if (-1 == listen(srv->listen_fd, MJPEG_MAX_CLIENTS)) {
+        perror("preview server");
+        close(srv->listen_fd);
+        return -1;
+    }
+
+    srv->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (srv->wake_fd < 0) {
+        perror("eventfd");
+        close(srv->listen_fd);
+        return -1;
+    }
+
+    if (pthread_create(&srv->encoder_thread, NULL, encoder_main, srv) ||
+        pthread_create(&srv->network_thread, NULL, network_main, srv)) {
+        fprintf(stderr, "Cannot start preview server threads\n");
+        return -1;
+    }
+    return 0;
+}
+
+void mjpeg_server_stop(struct mjpeg_server *srv) {
+    pthread_mutex_lock(&srv->input_lock);
+    __atomic_store_n(&srv->stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_signal(&srv->input_cond);
+    pthread_mutex_unlock(&srv->input_lock);
+
+    pthread_join(srv->encoder_thread, NULL);
+    pthread_join(srv->network_thread, NULL);
+
+    while (srv->n_clients > 0)
+        drop_client(srv, srv->n_clients - 1);
+    for (int i = 0; i < MJPEG_SLOTS; i++)
+        free(srv->frames[i].data);
+    free(srv->input);
+    close(srv->wake_fd);
+    close(srv->listen_fd);
+    pthread_cond_destroy(&srv->input_cond);
+    pthread_mutex_destroy(&srv->frame_lock);
+    pthread_mutex_destroy(&srv->input_lock);
+}
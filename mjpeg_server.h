@@ -0,0 +1,100 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef MJPEG_SERVER_H
+#define MJPEG_SERVER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define MJPEG_MAX_CLIENTS   8
+#define MJPEG_SLOTS         (MJPEG_MAX_CLIENTS + 2)
+
+// One encoded preview frame. Clients hold a reference while sending it, so
+// a slow viewer can finish an old frame while newer ones are published.
+struct mjpeg_frame {
+    uint8_t         *data;
+    unsigned long   size;           // JPEG length
+    unsigned long   cap;            // bytes allocated at data
+    int             refs;
+    uint64_t        generation;
+};
+
+struct mjpeg_client {
+    int             fd;
+    int             streaming;      // multipart stream vs. single frame
+    char            request[512];
+    size_t          request_len;
+    int             slot;           // frame being sent, -1 when idle
+    uint64_t        generation;     // last frame sent
+    char            header[256];
+    struct iovec    out[3];
+    int             n_out;
+    int             closing;        // close once out[] has drained
+};
+
+// Headless preview: an HTTP server that streams the downscaled preview as
+// multipart MJPEG. The capture loop only copies a frame into the input
+// slot if the encoder thread is idle (otherwise the frame is skipped); the
+// encoder compresses it once and every viewer shares that JPEG. Viewers
+// that fall behind jump to the newest frame instead of queueing.
+//
+// mjpeg_server_submit() takes a width x height frame of 8-bit RGB, three
+// bytes per pixel in R, G, B order, with rows stride bytes apart. OpenCV
+// frames are BGR and must be converted first.
+//
+//   /           small HTML page showing the stream
+//   /stream     multipart/x-mixed-replace MJPEG
+//   /frame.jpg  the latest frame as a single JPEG
+struct mjpeg_server {
+    int                 width;
+    int                 height;
+    int                 quality;
+    int                 listen_fd;
+    int                 wake_fd;        // eventfd, new frame published
+
+    pthread_t           encoder_thread;
+    pthread_t           network_thread;
+    int                 stop;
+
+    pthread_mutex_t     input_lock;
+    pthread_cond_t      input_cond;
+    uint8_t             *input;
+    int                 input_ready;
+
+    pthread_mutex_t     frame_lock;
+    struct mjpeg_frame  frames[MJPEG_SLOTS];
+    int                 latest;
+    uint64_t            generation;
+
+    struct mjpeg_client clients[MJPEG_MAX_CLIENTS];
+    int                 n_clients;
+
+    unsigned long       submitted;
+    unsigned long       skipped;
+    unsigned long       encoded;
+};
+
+int  mjpeg_server_start(struct mjpeg_server *srv, int port, int width, int height, int quality);
+void mjpeg_server_submit(struct mjpeg_server *srv, const uint8_t *rgb, size_t stride);
+void mjpeg_server_stop(struct mjpeg_server *srv);
+
+#endif
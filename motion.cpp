@@ -0,0 +1,111 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu_dispatch.h"
+#include "motion.h"
+
+int motion_init(struct motion_detector *md, int width, int height, int delta) {
+    memset(md, 0, sizeof(*md));
+    md->width = width;
+    md->height = height;
+    md->thumb_w = width / MOTION_STEP;
+    md->thumb_h = height / MOTION_STEP;
+    md->delta = delta;
+    if (md->thumb_w < 1 || md->thumb_h < 1) {
+        fprintf(stderr, "Frame too small for motion detection\n");
+        return -1;
+    }
+
+    size_t n = (size_t)md->thumb_w * md->thumb_h;
+    size_t row = 2 * (size_t)md->thumb_w * MOTION_STEP * sizeof(uint16_t);
+    if (-1 == arena_init(&md->mem, 2 * (n * sizeof(uint16_t) + 64) + row + 64))
+        return -1;
+    md->thumb = (uint16_t *)arena_alloc(&md->mem, n * sizeof(uint16_t));
+    md->background = (uint16_t *)arena_alloc(&md->mem, n * sizeof(uint16_t));
+    md->sums = (uint16_t *)arena_alloc(&md->mem, row);
+    return 0;
+}
+
+void motion_free(struct motion_detector *md) {
+    arena_free(&md->mem);
+    memset(md, 0, sizeof(*md));
+}
+
+// Mean of the green samples in each block. Even and odd raw rows are added
+// into running sums per column, a plain vectorizable add; every MOTION_STEP
+// rows the block totals pick the green columns out of them: Gr at odd
+// columns of even rows, Gb at even columns of odd rows.
+KERNEL_CLONES
+static void build_thumbnail(struct motion_detector *md, const uint16_t *raw) {
+    const int greens = MOTION_STEP * MOTION_STEP / 2;
+    const int width = md->thumb_w * MOTION_STEP;
+    uint16_t *__restrict even_sums = md->sums;
+    uint16_t *__restrict odd_sums = md->sums + width;
+    for (int ty = 0; ty < md->thumb_h; ty++) {
+        memset(md->sums, 0, 2 * width * sizeof(uint16_t));
+        for (int y = ty * MOTION_STEP; y < (ty + 1) * MOTION_STEP; y += 2) {
+            const uint16_t *__restrict even = raw + (size_t)y * md->width;
+            const uint16_t *__restrict odd = even + md->width;
+            for (int x = 0; x < width; x++) {
+                even_sums[x] += even[x] & 0x03FF;
+                odd_sums[x] += odd[x] & 0x03FF;
+            }
+        }
+        uint16_t *out = md->thumb + (size_t)ty * md->thumb_w;
+        for (int tx = 0; tx < md->thumb_w; tx++) {
+            uint32_t total = 0;
+            for (int k = tx * MOTION_STEP; k < (tx + 1) * MOTION_STEP; k += 2)
+                total += even_sums[k + 1] + odd_sums[k];
+            out[tx] = (total + greens / 2) / greens;
+        }
+    }
+}
+
+// Folds the frame into the background and returns the percentage of the
+// thumbnail that changed. The first frame only seeds the background.
+float motion_update(struct motion_detector *md, const uint16_t *raw) {
+    int n = md->thumb_w * md->thumb_h;
+    build_thumbnail(md, raw);
+
+    if (!md->primed) {
+        for (int i = 0; i < n; i++)
+            md->background[i] = md->thumb[i] << 4;
+        md->primed = 1;
+        return 0;
+    }
+
+    int64_t total = 0;
+    for (int i = 0; i < n; i++)
+        total += (md->thumb[i] << 4) - md->background[i];
+    int32_t bias = total / n;
+
+    int changed = 0;
+    for (int i = 0; i < n; i++) {
+        int32_t d = (md->thumb[i] << 4) - md->background[i];
+        int32_t diff = d - bias;
+        if (diff < 0)
+            diff = -diff;
+        changed += diff > (md->delta << 4);
+        md->background[i] += d >> MOTION_BG_SHIFT;
+    }
+    return 100.0f * changed / n;
+}
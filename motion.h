@@ -0,0 +1,54 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef MOTION_H
+#define MOTION_H
+
+#include <stdint.h>
+#include "arena.h"
+
+#define MOTION_STEP         16      // raw pixels per thumbnail pixel, each way
+#define MOTION_BG_SHIFT     4       // background adapts by 1/16 per frame
+
+// Cheap motion detector on raw SRGGB10 frames. Each frame is reduced to a
+// green thumbnail by averaging all green samples of each MOTION_STEP x
+// MOTION_STEP block (128 per block, no demosaic), which averages away
+// sensor noise and single hot pixels, and compared with a running-average
+// background. A thumbnail pixel counts
+// as changed when it differs from the background by more than `delta`
+// after removing the mean difference, so exposure and lighting drifts do
+// not register as motion.
+struct motion_detector {
+    struct arena mem;
+    int          width;
+    int          height;
+    int          thumb_w;
+    int          thumb_h;
+    uint16_t     *thumb;
+    uint16_t     *background;   // Q4 fixed point
+    uint16_t     *sums;         // per-column totals of one block row, even then odd rows
+    int          delta;
+    int          primed;
+};
+
+int   motion_init(struct motion_detector *md, int width, int height, int delta);
+void  motion_free(struct motion_detector *md);
+float motion_update(struct motion_detector *md, const uint16_t *raw);
+
+#endif
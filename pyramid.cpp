@@ -0,0 +1,373 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cpu_dispatch.h"
+#include "metrics.h"
+#include "pyramid.h"
+
+static struct pyramid *pyramids;
+static int n_pyramids;
+static struct pyramid *free_list;
+static pthread_mutex_t free_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t free_cond = PTHREAD_COND_INITIALIZER;
+
+static int n_halvings;
+static int thumb_source;            // level feeding the thumbnail, -1 = full rows
+static int level_count;
+static int enc_format;
+static int enc_quality;
+static const char *level_suffix[PYRAMID_MAX_LEVELS];
+
+int pyramid_enabled(void) {
+    return n_pyramids > 0;
+}
+
+int pyramid_level_count(void) {
+    return level_count;
+}
+
+// Inserts the level suffix before the extension: out.png -> out_2.png,
+// and out.png.part -> out_2.png.part for files that are renamed later.
+int pyramid_level_name(char *out, size_t size, const char *filename, int level) {
+    size_t len = strlen(filename), end = len, ext;
+    if (len >= 5 && !strcmp(filename + len - 5, ".part"))
+        end -= 5;
+    for (ext = end; ext > 0 && filename[ext - 1] != '/'; ext--) {
+        if (filename[ext - 1] == '.')
+            break;
+    }
+    ext = (ext > 0 && filename[ext - 1] == '.') ? ext - 1 : end;
+
+    int n = snprintf(out, size, "%.*s%s%s", (int)ext, filename, level_suffix[level], filename + ext);
+    return (n < 0 || (size_t)n >= size) ? -1 : 0;
+}
+
+// --- walker side ----------------------------------------------------------
+
+static void publish(struct pyramid *p, int level, int rows) {
+    struct pyramid_level *lv = &p->levels[level];
+    __atomic_store_n(&lv->rows_ready, rows, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&p->lock);
+    pthread_cond_signal(&lv->ready);
+    pthread_mutex_unlock(&p->lock);
+}
+
+// One output row from two input rows: 2x2 box average per channel.
+KERNEL_CLONES
+static void halve_rows(const uint8_t *a, const uint8_t *b, uint8_t *out, int out_width) {
+    for (int x = 0; x < out_width; x++) {
+        for (int c = 0; c < 3; c++) {
+            int i = x * 6 + c;
+            out[x * 3 + c] = (a[i] + a[i + 3] + b[i] + b[i + 3] + 2) >> 2;
+        }
+    }
+}
+
+static void thumb_feed(struct pyramid *p, const uint8_t *row, int y) {
+    struct pyramid_level *thumb = &p->levels[p->thumb_level];
+    int src_h = p->thumb_src_h;
+
+    for (int x = 0; x < p->thumb_src_w; x++) {
+        uint32_t *acc = p->thumb_acc + p->thumb_col[x] * 3;
+        acc[0] += row[x * 3];
+        acc[1] += row[x * 3 + 1];
+        acc[2] += row[x * 3 + 2];
+    }
+    p->thumb_rows_in++;
+
+    int t = (int)((int64_t)y * thumb->height / src_h);
+    if (y < src_h - 1 && (int64_t)(y + 1) * thumb->height / src_h == t)
+        return;
+
+    uint8_t *out = thumb->pixels + (size_t)t * thumb->width * 3;
+    for (int tx = 0; tx < thumb->width; tx++) {
+        uint32_t n = p->thumb_span[tx] * p->thumb_rows_in;
+        for (int c = 0; c < 3; c++)
+            out[tx * 3 + c] = (p->thumb_acc[tx * 3 + c] + n / 2) / n;
+    }
+    memset(p->thumb_acc, 0, thumb->width * 3 * sizeof(uint32_t));
+    p->thumb_rows_in = 0;
+    publish(p, p->thumb_level, t + 1);
+}
+
+void pyramid_push_row(struct pyramid *p, const uint8_t *row) {
+    int y = p->full_rows++;
+
+    if (p->thumb_level >= 0 && thumb_source < 0)
+        thumb_feed(p, row, y);
+    if (n_halvings == 0)
+        return;
+
+    // Full-resolution rows are not kept: the even row of each pair waits in
+    // pair_row. Lower levels keep their rows, so their pairs are read back
+    // from the level image.
+    int width = p->levels[0].width * 2;
+    if ((y & 1) == 0) {
+        memcpy(p->pair_row, row, width * 3);
+        return;
+    }
+
+    const uint8_t *a = p->pair_row, *b = row;
+    int j = y / 2;
+    for (int k = 0; k < n_halvings; k++) {
+        struct pyramid_level *lv = &p->levels[k];
+        if (j >= lv->height)
+            break;
+        uint8_t *out = lv->pixels + (size_t)j * lv->width * 3;
+        halve_rows(a, b, out, lv->width);
+        publish(p, k, j + 1);
+        if (p->thumb_level >= 0 && thumb_source == k)
+            thumb_feed(p, out, j);
+
+        // A completed odd row finishes a pair for the next level down.
+        if ((j & 1) == 0)
+            break;
+        a = out - lv->width * 3;
+        b = out;
+        j /= 2;
+    }
+}
+
+// --- helper side ----------------------------------------------------------
+
+static void encode_level(struct pyramid *p, struct pyramid_level *lv) {
+    encoder_begin(&lv->enc, enc_format, enc_quality, lv->filename, lv->width, lv->height,
+                  &lv->scratch);
+    lv->rows_written = 0;
+
+    for (;;) {
+        int ready = __atomic_load_n(&lv->rows_ready, __ATOMIC_ACQUIRE);
+        while (lv->rows_written < ready) {
+            encoder_write_row(&lv->enc, lv->pixels + (size_t)lv->rows_written * lv->width * 3);
+            lv->rows_written++;
+        }
+        if (lv->rows_written == lv->height)
+            break;
+
+        pthread_mutex_lock(&p->lock);
+        while (__atomic_load_n(&lv->rows_ready, __ATOMIC_ACQUIRE) == lv->rows_written)
+            pthread_cond_wait(&lv->ready, &p->lock);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    encoder_end(&lv->enc);
+    metrics_add(METRIC_BYTES_WRITTEN, lv->enc.sink.written);
+}
+
+static void *helper_main(void *arg) {
+    struct pyramid_level *lv = (struct pyramid_level *)arg;
+    struct pyramid *p = lv->owner;
+    uint64_t frame = 0;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->frame == frame && !p->stop)
+            pthread_cond_wait(&lv->ready, &p->lock);
+        if (p->stop)
+            break;
+        frame = p->frame;
+        pthread_mutex_unlock(&p->lock);
+
+        encode_level(p, lv);
+
+        pthread_mutex_lock(&p->lock);
+        if (--p->busy == 0)
+            pthread_cond_signal(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+struct pyramid *pyramid_begin(const char *filename) {
+    pthread_mutex_lock(&free_lock);
+    while (!free_list)
+        pthread_cond_wait(&free_cond, &free_lock);
+    struct pyramid *p = free_list;
+    free_list = p->next_free;
+    pthread_mutex_unlock(&free_lock);
+
+    for (int i = 0; i < p->n_levels; i++) {
+        if (pyramid_level_name(p->levels[i].filename, sizeof(p->levels[i].filename), filename, i)) {
+            fprintf(stderr, "Output name too long\n");
+            exit(EXIT_FAILURE);
+        }
+        p->levels[i].rows_ready = 0;
+    }
+    p->full_rows = 0;
+    p->thumb_rows_in = 0;
+    if (p->thumb_level >= 0)
+        memset(p->thumb_acc, 0, p->levels[p->thumb_level].width * 3 * sizeof(uint32_t));
+
+    pthread_mutex_lock(&p->lock);
+    p->frame++;
+    p->busy = p->n_levels;
+    for (int i = 0; i < p->n_levels; i++)
+        pthread_cond_signal(&p->levels[i].ready);
+    pthread_mutex_unlock(&p->lock);
+    return p;
+}
+
+// Waits for the helpers to finish the lower levels and returns the pyramid.
+void pyramid_end(struct pyramid *p) {
+    pthread_mutex_lock(&p->lock);
+    while (p->busy)
+        pthread_cond_wait(&p->done, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+
+    pthread_mutex_lock(&free_lock);
+    p->next_free = free_list;
+    free_list = p;
+    pthread_cond_signal(&free_cond);
+    pthread_mutex_unlock(&free_lock);
+}
+
+// --- setup ----------------------------------------------------------------
+
+static int pyramid_setup(struct pyramid *p, int width, int height, int thumb_width) {
+    static const char *halving_suffix[PYRAMID_MAX_HALVINGS] = { "_2", "_4", "_8" };
+    size_t mem = (size_t)width * 3 + 64;
+    int w = width, h = height;
+
+    p->thumb_level = -1;
+    for (int k = 0; k < n_halvings; k++) {
+        w /= 2;
+        h /= 2;
+        p->levels[k].width = w;
+        p->levels[k].height = h;
+        level_suffix[k] = halving_suffix[k];
+        mem += (size_t)w * h * 3 + 64;
+    }
+    p->n_levels = n_halvings;
+
+    if (thumb_width) {
+        // Bin from the smallest level that is still at least as wide.
+        p->thumb_src_w = width;
+        p->thumb_src_h = height;
+        thumb_source = -1;
+        for (int k = 0; k < n_halvings && p->levels[k].width >= thumb_width; k++) {
+            thumb_source = k;
+            p->thumb_src_w = p->levels[k].width;
+            p->thumb_src_h = p->levels[k].height;
+        }
+        struct pyramid_level *thumb = &p->levels[p->n_levels];
+        thumb->width = thumb_width;
+        thumb->height = (p->thumb_src_h * thumb_width + p->thumb_src_w / 2) / p->thumb_src_w;
+        if (thumb->height < 1)
+            thumb->height = 1;
+        level_suffix[p->n_levels] = "_thumb";
+        p->thumb_level = p->n_levels++;
+        mem += (size_t)thumb->width * thumb->height * 3 + p->thumb_src_w * sizeof(uint16_t) +
+               thumb_width * (sizeof(uint16_t) + 3 * sizeof(uint32_t)) + 4 * 64;
+    }
+
+    if (-1 == arena_init(&p->mem, mem))
+        return -1;
+    p->pair_row = (uint8_t *)arena_alloc(&p->mem, (size_t)width * 3);
+    for (int i = 0; i < p->n_levels; i++) {
+        struct pyramid_level *lv = &p->levels[i];
+        lv->pixels = (uint8_t *)arena_alloc(&p->mem, (size_t)lv->width * lv->height * 3);
+        if (-1 == arena_init(&lv->scratch, encode_arena_size(lv->width)))
+            return -1;
+    }
+    if (p->thumb_level >= 0) {
+        p->thumb_col = (uint16_t *)arena_alloc(&p->mem, p->thumb_src_w * sizeof(uint16_t));
+        p->thumb_span = (uint16_t *)arena_alloc(&p->mem, thumb_width * sizeof(uint16_t));
+        p->thumb_acc = (uint32_t *)arena_alloc(&p->mem, thumb_width * 3 * sizeof(uint32_t));
+        for (int x = 0; x < p->thumb_src_w; x++) {
+            p->thumb_col[x] = (int64_t)x * thumb_width / p->thumb_src_w;
+            p->thumb_span[p->thumb_col[x]]++;
+        }
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->done, NULL);
+    for (int i = 0; i < p->n_levels; i++) {
+        struct pyramid_level *lv = &p->levels[i];
+        lv->owner = p;
+        pthread_cond_init(&lv->ready, NULL);
+        if (pthread_create(&lv->thread, NULL, helper_main, lv)) {
+            fprintf(stderr, "Cannot start pyramid thread\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int pyramid_init(int helpers, int width, int height, int halvings, int thumb_width,
+                 int format, int quality) {
+    if (halvings < 0 || halvings > PYRAMID_MAX_HALVINGS || (width >> halvings) < 1 ||
+        (height >> halvings) < 1) {
+        fprintf(stderr, "Unsupported pyramid depth %d\n", halvings);
+        return -1;
+    }
+    if (thumb_width > width) {
+        fprintf(stderr, "Thumbnail wider than the frame\n");
+        return -1;
+    }
+    if (helpers > PYRAMID_MAX_HELPERS)
+        helpers = PYRAMID_MAX_HELPERS;
+    if ((halvings == 0 && thumb_width == 0) || helpers < 1)
+        return 0;
+
+    n_halvings = halvings;
+    enc_format = format;
+    enc_quality = quality;
+    level_count = halvings + (thumb_width > 0);
+
+    pyramids = (struct pyramid *)calloc(helpers, sizeof(*pyramids));
+    if (!pyramids) {
+        perror("Out of memory");
+        return -1;
+    }
+    for (int i = 0; i < helpers; i++) {
+        if (pyramid_setup(&pyramids[i], width, height, thumb_width))
+            return -1;
+        n_pyramids++;
+        pyramids[i].next_free = free_list;
+        free_list = &pyramids[i];
+    }
+    return 0;
+}
+
+void pyramid_shutdown(void) {
+    for (int i = 0; i < n_pyramids; i++) {
+        struct pyramid *p = &pyramids[i];
+        pthread_mutex_lock(&p->lock);
+        p->stop = 1;
+        for (int k = 0; k < p->n_levels; k++)
+            pthread_cond_signal(&p->levels[k].ready);
+        pthread_mutex_unlock(&p->lock);
+
+        for (int k = 0; k < p->n_levels; k++) {
+            pthread_join(p->levels[k].thread, NULL);
+            pthread_cond_destroy(&p->levels[k].ready);
+            arena_free(&p->levels[k].scratch);
+        }
+        arena_free(&p->mem);
+        pthread_mutex_destroy(&p->lock);
+        pthread_cond_destroy(&p->done);
+    }
+    free(pyramids);
+    pyramids = NULL;
+    n_pyramids = 0;
+    free_list = NULL;
+}
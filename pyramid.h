@@ -0,0 +1,95 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "arena.h"
+#include "encode.h"
+
+#define PYRAMID_MAX_HALVINGS    3
+#define PYRAMID_MAX_LEVELS      (PYRAMID_MAX_HALVINGS + 1)  // plus thumbnail
+#define PYRAMID_MAX_HELPERS     16
+
+// Reduced-resolution outputs built from the rows of the one demosaic walk:
+// up to three halvings (1/2, 1/4, 1/8, each a 2x2 box average of the level
+// above, computed as soon as a row pair is complete) and a thumbnail of a
+// given width, area-averaged from the smallest level that is at least that
+// wide. No level reads the full frame again.
+//
+// Each level has its own helper thread, so the levels are encoded
+// concurrently with each other and with the caller's full frame: the walker
+// publishes rows per level and each helper streams its level's rows into
+// its encoder as they arrive. A frame takes as long as its slowest level,
+// not the sum of them. There is one pyramid per thread that can encode at
+// the same time, all created up front; pyramid_begin() hands a free one to
+// the caller for one frame.
+struct pyramid_level {
+    int             width;
+    int             height;
+    uint8_t         *pixels;        // whole level, interleaved RGB
+    int             rows_ready;     // published by the walker, atomic
+    int             rows_written;   // helper side
+    char            filename[300];
+    struct arena    scratch;
+    struct encoder  enc;
+    struct pyramid  *owner;
+    pthread_t       thread;
+    pthread_cond_t  ready;          // rows published, frame started or stop
+};
+
+struct pyramid {
+    struct arena            mem;
+    int                     n_levels;
+    struct pyramid_level    levels[PYRAMID_MAX_LEVELS];
+    int                     thumb_level;    // index of the thumbnail, -1 if none
+    uint8_t                 *pair_row;      // even full-resolution row
+    int                     full_rows;
+
+    // Thumbnail binning of the smallest halving (or the full frame).
+    int                     thumb_src_w;
+    int                     thumb_src_h;
+    uint16_t                *thumb_col;     // source column -> thumbnail column
+    uint16_t                *thumb_span;    // source columns per thumbnail column
+    uint32_t                *thumb_acc;
+    int                     thumb_rows_in;  // source rows in the current bin
+
+    pthread_mutex_t         lock;
+    pthread_cond_t          done;           // busy dropped to zero
+    uint64_t                frame;          // bumped by pyramid_begin()
+    int                     busy;           // levels still encoding the frame
+    int                     stop;
+    struct pyramid          *next_free;
+};
+
+int  pyramid_init(int helpers, int width, int height, int halvings, int thumb_width,
+                  int format, int quality);
+void pyramid_shutdown(void);
+int  pyramid_enabled(void);
+int  pyramid_level_count(void);
+int  pyramid_level_name(char *out, size_t size, const char *filename, int level);
+
+struct pyramid *pyramid_begin(const char *filename);
+void pyramid_push_row(struct pyramid *p, const uint8_t *row);
+void pyramid_end(struct pyramid *p);
+
+#endif
@@ -0,0 +1,354 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "cpu_dispatch.h"
+#include "raw_correct.h"
+
+// Bayer channels in calibration files, in SRGGB order.
+enum { CH_R, CH_GR, CH_GB, CH_B, N_CHANNELS };
+
+static const char *channel_keys[N_CHANNELS] = { "r", "gr", "gb", "b" };
+
+static char *trim(char *s) {
+    while (isspace((unsigned char)*s))
+        s++;
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+    return s;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int add_defect(struct raw_calibration *cal, int *cap, int x, int y) {
+    if (x < 0 || y < 0 || x >= cal->width || y >= cal->height)
+        return -1;
+    if (cal->n_defects == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        uint32_t *p = (uint32_t *)realloc(cal->defects, *cap * sizeof(uint32_t));
+        if (!p)
+            return -1;
+        cal->defects = p;
+    }
+    cal->defects[cal->n_defects++] = ((uint32_t)y << 16) | (uint32_t)x;
+    return 0;
+}
+
+// Horizontal pass of the bilinear upsample: grid column i sits at
+// x = i * (width - 1) / (grid_w - 1).
+static float grid_lerp_x(const float *grid_row, int grid_w, int width, int x) {
+    if (grid_w == 1)
+        return grid_row[0];
+    float pos = (float)x * (grid_w - 1) / (width - 1);
+    int i = (int)pos;
+    if (i >= grid_w - 1)
+        return grid_row[grid_w - 1];
+    float w = pos - i;
+    return grid_row[i] * (1 - w) + grid_row[i + 1] * w;
+}
+
+static int build_gains(struct raw_calibration *cal, float *grid[N_CHANNELS]) {
+    float range = 1023.0f / (cal->white_level - cal->black_level);
+
+    cal->gains = (uint16_t *)malloc((size_t)cal->grid_h * 2 * cal->width * sizeof(uint16_t));
+    if (!cal->gains)
+        return -1;
+
+    for (int j = 0; j < cal->grid_h; j++) {
+        for (int parity = 0; parity < 2; parity++) {
+            uint16_t *out = cal->gains + ((size_t)j * 2 + parity) * cal->width;
+            for (int x = 0; x < cal->width; x++) {
+                int ch = parity * 2 + (x & 1);
+                float g = grid[ch] ? grid_lerp_x(grid[ch] + j * cal->grid_w, cal->grid_w, cal->width, x)
+                                   : 1.0f;
+                float q = g * range * (1 << RAW_GAIN_SHIFT) + 0.5f;
+                out[x] = q < 0 ? 0 : q > 65535 ? 65535 : (uint16_t)q;
+            }
+        }
+    }
+    return 0;
+}
+
+// Calibration files use the config file syntax:
+//
+//   black_level = 64
+//   white_level = 1023
+//   defect = 812,44            # x,y; repeatable
+//   shading = 9x7              # grid size, then grid_h rows per channel
+//   r  = 1.42 1.31 1.25 ...    # one grid row (grid_w gains) per line
+//   gr = ...
+//   gb = ...
+//   b  = ...
+//
+// Missing shading means unity gain; missing channels default to unity too.
+int raw_calibration_load(struct raw_calibration *cal, const char *path, int width, int height) {
+    char line[4096];
+    int lineno = 0, defect_cap = 0, rc = 0;
+    int grid_rows[N_CHANNELS] = { 0 };
+    float *grid[N_CHANNELS] = { NULL };
+
+    memset(cal, 0, sizeof(*cal));
+    cal->width = width;
+    cal->height = height;
+    cal->white_level = 1023;
+    cal->grid_w = cal->grid_h = 1;
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+
+    while (rc == 0 && fgets(line, sizeof(line), fp)) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash)
+            *hash = '\0';
+        char *key = trim(line);
+        if (!*key)
+            continue;
+        char *eq = strchr(key, '=');
+        if (!eq) {
+            fprintf(stderr, "%s:%d: expected 'key = value'\n", path, lineno);
+            rc = -1;
+            break;
+        }
+        *eq = '\0';
+        char *value = trim(eq + 1);
+        key = trim(key);
+
+        int ch = -1;
+        for (int c = 0; c < N_CHANNELS; c++) {
+            if (!strcmp(key, channel_keys[c]))
+                ch = c;
+        }
+
+        int x, y;
+        char *end;
+        if (!strcmp(key, "black_level")) {
+            cal->black_level = strtol(value, &end, 0);
+            if (*end || cal->black_level < 0 || cal->black_level > 1022)
+                rc = -1;
+        } else if (!strcmp(key, "white_level")) {
+            cal->white_level = strtol(value, &end, 0);
+            if (*end || cal->white_level < 1 || cal->white_level > 1023)
+                rc = -1;
+        } else if (!strcmp(key, "defect")) {
+            if (sscanf(value, "%d , %d", &x, &y) != 2 || add_defect(cal, &defect_cap, x, y))
+                rc = -1;
+        } else if (!strcmp(key, "shading")) {
+            if (grid[CH_R] || grid[CH_GR] || grid[CH_GB] || grid[CH_B] ||
+                sscanf(value, "%dx%d", &x, &y) != 2 ||
+                x < 1 || y < 1 || x > RAW_MAX_GRID || y > RAW_MAX_GRID) {
+                rc = -1;
+            } else {
+                cal->grid_w = x;
+                cal->grid_h = y;
+            }
+        } else if (ch >= 0) {
+            if (!grid[ch])
+                grid[ch] = (float *)calloc((size_t)cal->grid_w * cal->grid_h, sizeof(float));
+            if (!grid[ch] || grid_rows[ch] == cal->grid_h) {
+                rc = -1;
+            } else {
+                float *row = grid[ch] + grid_rows[ch]++ * cal->grid_w;
+                char *p = value;
+                for (int i = 0; i < cal->grid_w && rc == 0; i++) {
+                    row[i] = strtof(p, &end);
+                    if (end == p || row[i] < 0)
+                        rc = -1;
+                    p = end;
+                }
+                if (*trim(p))
+                    rc = -1;
+            }
+        } else {
+            fprintf(stderr, "%s:%d: unknown key '%s'\n", path, lineno, key);
+            rc = -1;
+            break;
+        }
+        if (rc)
+            fprintf(stderr, "%s:%d: invalid value for %s: '%s'\n", path, lineno, key, value);
+    }
+    fclose(fp);
+
+    for (int c = 0; c < N_CHANNELS && rc == 0; c++) {
+        if (grid[c] && grid_rows[c] != cal->grid_h) {
+            fprintf(stderr, "%s: shading channel %s has %d of %d rows\n",
+                    path, channel_keys[c], grid_rows[c], cal->grid_h);
+            rc = -1;
+        }
+    }
+    if (rc == 0 && cal->white_level <= cal->black_level) {
+        fprintf(stderr, "%s: white_level must be above black_level\n", path);
+        rc = -1;
+    }
+    if (rc == 0)
+        rc = build_gains(cal, grid);
+    for (int c = 0; c < N_CHANNELS; c++)
+        free(grid[c]);
+
+    if (rc) {
+        raw_calibration_free(cal);
+        return -1;
+    }
+
+    qsort(cal->defects, cal->n_defects, sizeof(uint32_t), compare_u32);
+    int n = 0;
+    for (int i = 0; i < cal->n_defects; i++) {
+        if (n == 0 || cal->defects[i] != cal->defects[n - 1])
+            cal->defects[n++] = cal->defects[i];
+    }
+    cal->n_defects = n;
+    return 0;
+}
+
+void raw_calibration_free(struct raw_calibration *cal) {
+    free(cal->defects);
+    free(cal->gains);
+    memset(cal, 0, sizeof(*cal));
+}
+
+// Index of the first defect at or after key.
+static int defect_lower_bound(const struct raw_calibration *cal, uint32_t key) {
+    int lo = 0, hi = cal->n_defects;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cal->defects[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int is_defect(const struct raw_calibration *cal, int x, int y) {
+    uint32_t key = ((uint32_t)y << 16) | (uint32_t)x;
+    int i = defect_lower_bound(cal, key);
+    return i < cal->n_defects && cal->defects[i] == key;
+}
+
+// Vertical position of row y on the shading grid: the two gain rows to
+// blend and the weight of the second, in 1/256.
+static void grid_rows_for(const struct raw_calibration *cal, int y,
+                          const uint16_t **g0, const uint16_t **g1, uint32_t *wy) {
+    int j = 0;
+    *wy = 0;
+    if (cal->grid_h > 1 && cal->height > 1) {
+        uint32_t pos = (uint32_t)y * (cal->grid_h - 1) * 256 / (cal->height - 1);
+        j = pos >> 8;
+        *wy = pos & 255;
+        if (j >= cal->grid_h - 1) {
+            j = cal->grid_h - 1;
+            *wy = 0;
+        }
+    }
+    int j1 = j + 1 < cal->grid_h ? j + 1 : j;
+    *g0 = cal->gains + ((size_t)j * 2 + (y & 1)) * cal->width;
+    *g1 = cal->gains + ((size_t)j1 * 2 + (y & 1)) * cal->width;
+}
+
+static inline uint16_t correct_sample(uint32_t v, uint32_t black, uint32_t g0, uint32_t g1, uint32_t wy) {
+    v &= 0x03FF;
+    v = v > black ? v - black : 0;
+    uint32_t g = (g0 * (256 - wy) + g1 * wy) >> 8;
+    uint32_t o = (v * g + (1u << (RAW_GAIN_SHIFT - 1))) >> RAW_GAIN_SHIFT;
+    return o < 1023 ? o : 1023;
+}
+
+// A single sample of row y, corrected except for defect repair.
+static uint16_t corrected_at(const struct raw_calibration *cal, const uint16_t *src, int x, int y) {
+    const uint16_t *g0, *g1;
+    uint32_t wy;
+    grid_rows_for(cal, y, &g0, &g1, &wy);
+    return correct_sample(src[(size_t)y * cal->width + x], cal->black_level, g0[x], g1[x], wy);
+}
+
+// Replaces each defect on row y with the mean of its good same-colour
+// neighbours (two pixels away). Defects are visited left to right, so a
+// left neighbour that was itself defective has already been repaired.
+static void repair_defects(const struct raw_calibration *cal, const uint16_t *src, uint16_t *dst, int y) {
+    uint32_t row_key = (uint32_t)y << 16;
+    for (int i = defect_lower_bound(cal, row_key);
+         i < cal->n_defects && (cal->defects[i] >> 16) == (uint32_t)y; i++) {
+        int x = cal->defects[i] & 0xFFFF;
+        uint32_t sum = 0, n = 0;
+
+        if (x >= 2) {
+            sum += dst[x - 2];
+            n++;
+        }
+        if (x + 2 < cal->width && !is_defect(cal, x + 2, y)) {
+            sum += dst[x + 2];
+            n++;
+        }
+        if (y >= 2 && !is_defect(cal, x, y - 2)) {
+            sum += corrected_at(cal, src, x, y - 2);
+            n++;
+        }
+        if (y + 2 < cal->height && !is_defect(cal, x, y + 2)) {
+            sum += corrected_at(cal, src, x, y + 2);
+            n++;
+        }
+        if (n)
+            dst[x] = (sum + n / 2) / n;
+    }
+}
+
+// Corrects row y of the raw frame src into dst in one pass: the 10-bit
+// unpack, black level, range scale and shading gain are one multiply-add
+// per pixel in 32-bit lanes, followed by the (rare) defects on the row.
+KERNEL_CLONES
+void raw_correct_row(const struct raw_calibration *cal, const uint16_t *src, uint16_t *dst, int y) {
+    const uint16_t *__restrict in = src + (size_t)y * cal->width;
+    uint16_t *__restrict out = dst;
+    const uint16_t *g0, *g1;
+    uint32_t wy, black = cal->black_level;
+
+    grid_rows_for(cal, y, &g0, &g1, &wy);
+    for (int x = 0; x < cal->width; x++)
+        out[x] = correct_sample(in[x], black, g0[x], g1[x], wy);
+
+    if (cal->n_defects)
+        repair_defects(cal, src, dst, y);
+}
+
+void raw_correct_yuv_frame(const struct raw_calibration *cal, const uint16_t *src,
+                           uint16_t *ring, struct yuv_frame *f) {
+    int width = cal->width, height = cal->height;
+    uint16_t *rows[3] = { ring, ring + width, ring + 2 * width };
+
+    raw_correct_row(cal, src, rows[0], 0);
+    for (int y = 0; y < height; y += 2) {
+        int below = y + 2 < height ? y + 2 : y;
+        // Row y was corrected by the previous pair as its row below; y + 1
+        // and y + 2 replace the two rows that pair is done with.
+        raw_correct_row(cal, src, rows[(y + 1) % 3], y + 1);
+        if (below != y)
+            raw_correct_row(cal, src, rows[below % 3], below);
+        debayer_yuv_rows(rows[y % 3], rows[(y + 1) % 3], rows[below % 3], f, y);
+    }
+}
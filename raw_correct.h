@@ -0,0 +1,64 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef RAW_CORRECT_H
+#define RAW_CORRECT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "debayer.h"
+
+#define RAW_GAIN_SHIFT  12      // shading gains are Q12, 4096 = 1.0
+#define RAW_MAX_GRID    64
+
+// Per-sensor raw calibration, applied to SRGGB10 rows ahead of demosaic:
+// black-level subtraction (rescaled so white stays at 1023), lens-shading
+// gain from a low-resolution grid per Bayer channel, and repair of
+// defective pixels from their same-colour neighbours.
+//
+// The shading grid is upsampled horizontally once at load time into one
+// gain row per grid row and row parity (R/Gr rows and Gb/B rows), with the
+// black-level range scale folded in. Per image row only the vertical
+// interpolation is left, which the correction pass does inline. Defects
+// are kept sorted as (y << 16 | x) so each row finds its own with a
+// binary search.
+struct raw_calibration {
+    int         width;
+    int         height;
+    int         black_level;
+    int         white_level;
+    uint32_t    *defects;
+    int         n_defects;
+    int         grid_w;
+    int         grid_h;
+    uint16_t    *gains;         // grid_h * 2 rows of width Q12 gains
+};
+
+int  raw_calibration_load(struct raw_calibration *cal, const char *path, int width, int height);
+void raw_calibration_free(struct raw_calibration *cal);
+void raw_correct_row(const struct raw_calibration *cal, const uint16_t *src, uint16_t *dst, int y);
+
+// Corrects a whole frame and demosaics it to planar YUV two rows at a
+// time, through ring, caller-owned scratch for three corrected rows
+// (3 * width entries), so the correction is never a separate full-frame
+// pass. Width and height must be even.
+void raw_correct_yuv_frame(const struct raw_calibration *cal, const uint16_t *src,
+                           uint16_t *ring, struct yuv_frame *f);
+
+#endif
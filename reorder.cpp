@@ -0,0 +1,82 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <string.h>
+#include "reorder.h"
+
+#define SLOT_MASK (REORDER_SLOTS - 1)
+
+void reorder_init(struct reorder_buffer *rb) {
+    memset(rb, 0, sizeof(*rb));
+    pthread_mutex_init(&rb->lock, NULL);
+    pthread_cond_init(&rb->completed, NULL);
+}
+
+void reorder_destroy(struct reorder_buffer *rb) {
+    pthread_cond_destroy(&rb->completed);
+    pthread_mutex_destroy(&rb->lock);
+}
+
+// Returns the slot reserved for this frame, or -1 when the buffer is full
+// and the caller has to pop something first.
+int reorder_push(struct reorder_buffer *rb, uint32_t sequence) {
+    int slot = -1;
+    pthread_mutex_lock(&rb->lock);
+    if (rb->tail - rb->head < REORDER_SLOTS) {
+        slot = rb->tail & SLOT_MASK;
+        rb->entries[slot].sequence = sequence;
+        rb->entries[slot].done = 0;
+        rb->tail++;
+    }
+    pthread_mutex_unlock(&rb->lock);
+    return slot;
+}
+
+void reorder_complete(struct reorder_buffer *rb, int slot) {
+    pthread_mutex_lock(&rb->lock);
+    rb->entries[slot].done = 1;
+    pthread_cond_broadcast(&rb->completed);
+    pthread_mutex_unlock(&rb->lock);
+}
+
+// Pops the oldest frame once it has completed. Frames that finished early
+// stay parked behind an older one that is still being processed. Returns
+// the popped slot, or -1 if nothing is ready (or nothing is pending, even
+// when blocking).
+int reorder_pop(struct reorder_buffer *rb, uint32_t *sequence, int block) {
+    int slot = -1;
+    pthread_mutex_lock(&rb->lock);
+    while (block && rb->head != rb->tail && !rb->entries[rb->head & SLOT_MASK].done)
+        pthread_cond_wait(&rb->completed, &rb->lock);
+    if (rb->head != rb->tail && rb->entries[rb->head & SLOT_MASK].done) {
+        slot = rb->head & SLOT_MASK;
+        if (sequence)
+            *sequence = rb->entries[slot].sequence;
+        rb->head++;
+    }
+    pthread_mutex_unlock(&rb->lock);
+    return slot;
+}
+
+int reorder_pending(struct reorder_buffer *rb) {
+    pthread_mutex_lock(&rb->lock);
+    int n = rb->tail - rb->head;
+    pthread_mutex_unlock(&rb->lock);
+    return n;
+}
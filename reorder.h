@@ -0,0 +1,54 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef REORDER_H
+#define REORDER_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#define REORDER_SLOTS 64    // power of two
+
+// Reorder buffer keyed by V4L2 buf.sequence. The capture thread reserves a
+// slot per dequeued frame (sequences arrive in increasing order, possibly
+// with gaps for dropped frames), workers mark slots complete in any order,
+// and reorder_pop() hands completed frames back strictly in sequence order.
+// Slot numbers are stable until popped, so callers can index their own
+// per-frame state by slot.
+struct reorder_entry {
+    uint32_t sequence;
+    int      done;
+};
+
+struct reorder_buffer {
+    pthread_mutex_t      lock;
+    pthread_cond_t       completed;
+    struct reorder_entry entries[REORDER_SLOTS];
+    unsigned int         head;
+    unsigned int         tail;
+};
+
+void  reorder_init(struct reorder_buffer *rb);
+void  reorder_destroy(struct reorder_buffer *rb);
+int   reorder_push(struct reorder_buffer *rb, uint32_t sequence);
+void  reorder_complete(struct reorder_buffer *rb, int slot);
+int   reorder_pop(struct reorder_buffer *rb, uint32_t *sequence, int block);
+int   reorder_pending(struct reorder_buffer *rb);
+
+#endif
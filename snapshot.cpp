@@ -0,0 +1,531 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <cerrno>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "metrics.h"
+#include "motion.h"
+#include "snapshot.h"
+#include "work_pool.h"
+
+#define PREROLL_MAX             64
+#define SNAPSHOT_MAX_CLIENTS    8
+#define SNAPSHOT_MAX_PENDING    16
+#define SNAPSHOT_FUTURE_LIMIT   (10 * 1000000LL)    // usec a request may look ahead
+
+struct preroll_frame {
+    uint8_t  *data;
+    uint32_t bytesused;
+    uint32_t sequence;
+    int64_t  timestamp_us;      // CLOCK_MONOTONIC
+    int      valid;
+    int      pinned;            // jobs still reading the frame, atomic
+};
+
+struct snapshot_trigger {
+    int64_t requested_us;
+    int64_t received_us;
+    int     client_fd;          // -1 for signal and file triggers
+};
+
+struct snapshot_server;
+
+struct snapshot_job {
+    struct snapshot_server  *srv;
+    int                     in_use;     // atomic
+    int                     frame;
+    struct snapshot_trigger trigger;
+    char                    out_name[256];
+};
+
+struct snapshot_server {
+    struct capture_device       *dev;
+    const struct capture_config *cfg;
+    snapshot_encode_fn          encode;
+    const char                  *pattern;
+
+    struct arena                frames;
+    struct preroll_frame        ring[PREROLL_MAX];
+    int                         n_frames;
+    int                         next_frame;
+    size_t                      frame_size;
+    int64_t                     newest_us;
+    int64_t                     stored_us;  // last frame written to the ring
+
+    struct work_pool            pool;
+    struct arena                scratch[WORK_POOL_MAX_THREADS];
+    struct snapshot_job         jobs[SNAPSHOT_MAX_PENDING];
+    struct snapshot_trigger     pending[SNAPSHOT_MAX_PENDING];
+    int                         n_pending;
+
+    int                         listen_fd;
+    int                         clients[SNAPSHOT_MAX_CLIENTS];
+    int                         n_clients;
+    int                         signal_fd;
+    int                         trigger_fd;
+    int                         trigger_level;
+    int                         running;
+
+    struct motion_detector      motion;
+    int64_t                     last_motion_us;
+    unsigned long               motion_saves;
+    unsigned long               frames_seen;
+};
+
+static int64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void reply(int client_fd, const char *msg) {
+    if (client_fd < 0)
+        return;
+    if (dprintf(client_fd, "%s\n", msg) < 0)
+        perror("snapshot reply");
+    close(client_fd);
+}
+
+static void snapshot_job_run(void *arg, int worker) {
+    struct snapshot_job *job = (struct snapshot_job *)arg;
+    struct snapshot_server *srv = job->srv;
+    struct preroll_frame *frame = &srv->ring[job->frame];
+
+    srv->encode(frame->data, frame->bytesused, job->out_name,
+                srv->dev->fmt.fmt.pix.width, srv->dev->fmt.fmt.pix.height, &srv->scratch[worker]);
+    metrics_add(METRIC_FRAMES_SAVED, 1);
+
+    printf("Snapshot saved as %s (sequence %u, %+.1f ms from request, %.1f ms after trigger)\n",
+           job->out_name, frame->sequence,
+           (frame->timestamp_us - job->trigger.requested_us) / 1000.0,
+           (now_us() - job->trigger.received_us) / 1000.0);
+    fflush(stdout);
+
+    __atomic_sub_fetch(&frame->pinned, 1, __ATOMIC_RELEASE);
+    reply(job->trigger.client_fd, job->out_name);
+    __atomic_store_n(&job->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static int nearest_frame(struct snapshot_server *srv, int64_t requested_us) {
+    int best = -1;
+    int64_t best_delta = 0;
+    for (int i = 0; i < srv->n_frames; i++) {
+        if (!srv->ring[i].valid)
+            continue;
+        int64_t delta = llabs(srv->ring[i].timestamp_us - requested_us);
+        if (best < 0 || delta < best_delta) {
+            best = i;
+            best_delta = delta;
+        }
+    }
+    return best;
+}
+
+static void start_job(struct snapshot_server *srv, const struct snapshot_trigger *trigger) {
+    int frame = nearest_frame(srv, trigger->requested_us);
+    struct snapshot_job *job = NULL;
+
+    for (int i = 0; i < SNAPSHOT_MAX_PENDING; i++) {
+        if (!__atomic_load_n(&srv->jobs[i].in_use, __ATOMIC_ACQUIRE)) {
+            job = &srv->jobs[i];
+            break;
+        }
+    }
+    if (frame < 0 || !job) {
+        fprintf(stderr, "Snapshot dropped: %s\n", frame < 0 ? "no frame captured" : "encoder busy");
+        reply(trigger->client_fd, "error: busy");
+        return;
+    }
+
+    struct preroll_frame *f = &srv->ring[frame];
+    job->srv = srv;
+    job->frame = frame;
+    job->trigger = *trigger;
+    if (capture_output_name(job->out_name, sizeof(job->out_name), srv->pattern,
+                            f->timestamp_us / 1000000, f->sequence)) {
+        fprintf(stderr, "Output name too long\n");
+        reply(trigger->client_fd, "error: output name too long");
+        return;
+    }
+
+    job->in_use = 1;
+    __atomic_add_fetch(&f->pinned, 1, __ATOMIC_ACQUIRE);
+    if (-1 == work_pool_submit(&srv->pool, snapshot_job_run, job)) {
+        __atomic_sub_fetch(&f->pinned, 1, __ATOMIC_RELEASE);
+        job->in_use = 0;
+        reply(trigger->client_fd, "error: busy");
+    }
+}
+
+// Starts every pending trigger whose requested time is already covered by
+// the newest frame in the ring; later ones wait for the next frame.
+static void resolve_triggers(struct snapshot_server *srv) {
+    int kept = 0;
+    for (int i = 0; i < srv->n_pending; i++) {
+        if (srv->newest_us >= 0 && srv->pending[i].requested_us <= srv->newest_us)
+            start_job(srv, &srv->pending[i]);
+        else
+            srv->pending[kept++] = srv->pending[i];
+    }
+    srv->n_pending = kept;
+}
+
+static void add_trigger(struct snapshot_server *srv, int64_t requested_us, int client_fd) {
+    struct snapshot_trigger trigger;
+    trigger.received_us = now_us();
+    trigger.requested_us = requested_us ? requested_us : trigger.received_us;
+    trigger.client_fd = client_fd;
+
+    if (trigger.requested_us > trigger.received_us + SNAPSHOT_FUTURE_LIMIT) {
+        reply(client_fd, "error: timestamp too far in the future");
+        return;
+    }
+    if (srv->n_pending == SNAPSHOT_MAX_PENDING) {
+        reply(client_fd, "error: busy");
+        return;
+    }
+    srv->pending[srv->n_pending++] = trigger;
+    resolve_triggers(srv);
+}
+
+static void store_frame(struct snapshot_server *srv, const struct v4l2_buffer *buf) {
+    int slot = -1;
+
+    // Overwrite the oldest frame that no encode job is still reading.
+    for (int i = 0; i < srv->n_frames; i++) {
+        int candidate = (srv->next_frame + i) % srv->n_frames;
+        if (!__atomic_load_n(&srv->ring[candidate].pinned, __ATOMIC_ACQUIRE)) {
+            slot = candidate;
+            break;
+        }
+    }
+    if (slot < 0) {
+        fprintf(stderr, "Pre-roll ring pinned, dropping frame %u\n", buf->sequence);
+        return;
+    }
+
+    struct preroll_frame *f = &srv->ring[slot];
+    size_t n = buf->bytesused < srv->frame_size ? buf->bytesused : srv->frame_size;
+    memcpy(f->data, srv->dev->buffers[buf->index].start, n);
+    f->bytesused = n;
+    f->sequence = buf->sequence;
+    if ((buf->flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+        f->timestamp_us = buf->timestamp.tv_sec * 1000000LL + buf->timestamp.tv_usec;
+    else
+        f->timestamp_us = now_us();
+    f->valid = 1;
+
+    srv->next_frame = (slot + 1) % srv->n_frames;
+    srv->stored_us = f->timestamp_us;
+    if (f->timestamp_us > srv->newest_us)
+        srv->newest_us = f->timestamp_us;
+}
+
+// Motion trigger: runs on the driver buffer before it is re-queued and
+// saves the frame that showed the change. If the ring was pinned and that
+// frame was not stored, the trigger falls back to the last frame that was,
+// so it always names a frame the ring holds.
+static void check_motion(struct snapshot_server *srv, const struct v4l2_buffer *buf) {
+    const struct capture_config *cfg = srv->cfg;
+    struct metrics_timer timer;
+    metrics_timer_start(&timer);
+    float changed = motion_update(&srv->motion, (const uint16_t *)srv->dev->buffers[buf->index].start);
+    metrics_timer_stop(&timer, STAGE_MOTION);
+
+    if (changed < cfg->motion || srv->stored_us < 0)
+        return;
+    if (srv->last_motion_us && srv->stored_us - srv->last_motion_us < cfg->motion_interval_ms * 1000LL)
+        return;
+    srv->last_motion_us = srv->stored_us;
+    srv->motion_saves++;
+    INFO_PRINT("Motion: %.1f%% of the scene changed\n", changed);
+    add_trigger(srv, srv->stored_us, -1);
+}
+
+static int read_trigger_level(struct snapshot_server *srv) {
+    char value[8];
+    if (-1 == lseek(srv->trigger_fd, 0, SEEK_SET))
+        return srv->trigger_level;
+    ssize_t n = read(srv->trigger_fd, value, sizeof(value));
+    if (n <= 0)
+        return srv->trigger_level;
+    return value[0] == '1';
+}
+
+static void poll_trigger_file(struct snapshot_server *srv) {
+    int level = read_trigger_level(srv);
+    if (level && !srv->trigger_level)
+        add_trigger(srv, 0, -1);
+    srv->trigger_level = level;
+}
+
+static void handle_client(struct snapshot_server *srv, int index) {
+    char request[128];
+    int fd = srv->clients[index];
+
+    srv->clients[index] = srv->clients[--srv->n_clients];
+
+    ssize_t n = read(fd, request, sizeof(request) - 1);
+    if (n <= 0) {
+        close(fd);
+        return;
+    }
+    request[n] = '\0';
+
+    long long requested = 0;
+    if (strncmp(request, "snap", 4) || (request[4] && request[4] != '\n' && request[4] != '\r' &&
+        sscanf(request + 4, "%lld", &requested) != 1)) {
+        reply(fd, "error: expected 'snap [usec]'");
+        return;
+    }
+    add_trigger(srv, requested, fd);
+}
+
+static void accept_client(struct snapshot_server *srv) {
+    int fd = accept4(srv->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        if (errno != EAGAIN)
+            perror("accept");
+        return;
+    }
+    if (srv->n_clients == SNAPSHOT_MAX_CLIENTS) {
+        reply(fd, "error: too many clients");
+        return;
+    }
+    srv->clients[srv->n_clients++] = fd;
+}
+
+static void handle_signal(struct snapshot_server *srv) {
+    struct signalfd_siginfo si;
+    while (read(srv->signal_fd, &si, sizeof(si)) == sizeof(si)) {
+        if (si.ssi_signo == SIGUSR1)
+            add_trigger(srv, 0, -1);
+        else
+            srv->running = 0;
+    }
+}
+
+static int open_listen_socket(const char *path) {
+    struct sockaddr_un addr;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+    if (-1 == bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || -1 == listen(fd, SNAPSHOT_MAX_CLIENTS)) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int serve_setup(struct snapshot_server *srv, size_t scratch_size) {
+    const struct capture_config *cfg = srv->cfg;
+
+    srv->frame_size = srv->dev->fmt.fmt.pix.sizeimage;
+    if (!srv->frame_size)
+        srv->frame_size = (size_t)srv->dev->fmt.fmt.pix.width * srv->dev->fmt.fmt.pix.height * 2;
+    srv->n_frames = cfg->preroll < PREROLL_MAX ? cfg->preroll : PREROLL_MAX;
+
+    // The whole pre-roll is reserved up front, like the encode scratch.
+    if (-1 == arena_init(&srv->frames, srv->frame_size * srv->n_frames + 64 * srv->n_frames))
+        return -1;
+    for (int i = 0; i < srv->n_frames; i++)
+        srv->ring[i].data = (uint8_t *)arena_alloc(&srv->frames, srv->frame_size);
+
+    if (cfg->trigger_socket[0]) {
+        srv->listen_fd = open_listen_socket(cfg->trigger_socket);
+        if (srv->listen_fd < 0)
+            return -1;
+    }
+
+    if (cfg->trigger_file[0]) {
+        srv->trigger_fd = open(cfg->trigger_file, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (srv->trigger_fd < 0) {
+            perror(cfg->trigger_file);
+            return -1;
+        }
+        srv->trigger_level = read_trigger_level(srv);
+    }
+
+    // Block the signals before the pool starts so workers inherit the mask
+    // and every delivery goes through the signalfd.
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    srv->signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (srv->signal_fd < 0) {
+        perror("signalfd");
+        return -1;
+    }
+
+    if (cfg->motion > 0 &&
+        motion_init(&srv->motion, srv->dev->fmt.fmt.pix.width, srv->dev->fmt.fmt.pix.height,
+                    cfg->motion_delta))
+        return -1;
+
+    if (-1 == work_pool_init(&srv->pool, cfg->threads))
+        return -1;
+    for (int t = 0; t < srv->pool.n_threads; t++) {
+        if (-1 == arena_init(&srv->scratch[t], scratch_size))
+            return -1;
+    }
+    return 0;
+}
+
+int snapshot_serve(struct capture_device *dev, const struct capture_config *cfg,
+                   snapshot_encode_fn encode, size_t scratch_size) {
+    struct snapshot_server *srv = static_cast<snapshot_server*>(calloc(1, sizeof(*srv)));
+    struct pollfd fds[4 + SNAPSHOT_MAX_CLIENTS];
+    struct v4l2_buffer buf;
+    int64_t last_frame_us;
+    int rc = 0;
+
+    if (!srv) {
+        perror("Out of memory");
+        return -1;
+    }
+    srv->dev = dev;
+    srv->cfg = cfg;
+    srv->encode = encode;
+    srv->pattern = cfg->output;
+    srv->newest_us = -1;
+    srv->stored_us = -1;
+    srv->listen_fd = -1;
+    srv->signal_fd = -1;
+    srv->trigger_fd = -1;
+    srv->running = 1;
+
+    if (serve_setup(srv, scratch_size)) {
+        exit(EXIT_FAILURE);
+    }
+    printf("Snapshot server ready: %d pre-roll frames, pid %d%s%s\n", srv->n_frames, (int)getpid(),
+           cfg->trigger_socket[0] ? ", socket " : "", cfg->trigger_socket);
+    fflush(stdout);
+    last_frame_us = now_us();
+
+    while (srv->running) {
+        int n = 0, cam, sig, lsn = -1, trg = -1, cli;
+
+        fds[cam = n++] = (struct pollfd){ dev->fd, POLLIN, 0 };
+        fds[sig = n++] = (struct pollfd){ srv->signal_fd, POLLIN, 0 };
+        if (srv->listen_fd >= 0)
+            fds[lsn = n++] = (struct pollfd){ srv->listen_fd, POLLIN, 0 };
+        if (srv->trigger_fd >= 0)
+            fds[trg = n++] = (struct pollfd){ srv->trigger_fd, POLLPRI | POLLERR, 0 };
+        cli = n;
+        for (int i = 0; i < srv->n_clients; i++)
+            fds[n++] = (struct pollfd){ srv->clients[i], POLLIN, 0 };
+
+        if (-1 == poll(fds, n, 1000)) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        if (fds[sig].revents)
+            handle_signal(srv);
+        if (trg >= 0 && fds[trg].revents)
+            poll_trigger_file(srv);
+        if (lsn >= 0 && fds[lsn].revents)
+            accept_client(srv);
+        // Walk backwards: handle_client() moves the last client into the
+        // slot it frees.
+        for (int i = n - 1; i >= cli; i--) {
+            if (fds[i].revents)
+                handle_client(srv, i - cli);
+        }
+
+        // POLLERR as well: that is how a device that went away shows up.
+        int r = 0;
+        if (fds[cam].revents) {
+            if ((r = capture_dequeue(dev, &buf, 0)) > 0) {
+                if (!(buf.flags & V4L2_BUF_FLAG_ERROR)) {
+                    store_frame(srv, &buf);
+                    srv->frames_seen++;
+                    if (cfg->motion > 0)
+                        check_motion(srv, &buf);
+                }
+                capture_requeue(dev, &buf);
+                last_frame_us = now_us();
+                if (srv->trigger_fd >= 0)
+                    poll_trigger_file(srv);
+                resolve_triggers(srv);
+            }
+        } else if (now_us() - last_frame_us > cfg->timeout_s * 1000000LL) {
+            fprintf(stderr, "select timeout\n");
+            capture_set_fault(dev, CAPTURE_FAULT_STALL);
+            r = -1;
+        }
+        if (r < 0) {
+            // Pre-roll frames are copies and survive the recovery.
+            if (capture_recover(dev)) {
+                rc = -1;
+                srv->running = 0;
+            }
+            last_frame_us = now_us();
+        }
+    }
+
+    INFO_PRINT("Snapshot server stopping\n");
+    if (cfg->motion > 0) {
+        printf("Motion saves: %lu of %lu frames\n", srv->motion_saves, srv->frames_seen);
+        motion_free(&srv->motion);
+    }
+    work_pool_wait(&srv->pool);
+    work_pool_destroy(&srv->pool);
+
+    for (int i = 0; i < srv->n_pending; i++)
+        reply(srv->pending[i].client_fd, "error: shutting down");
+    for (int i = 0; i < srv->n_clients; i++)
+        close(srv->clients[i]);
+    if (srv->listen_fd >= 0) {
+        close(srv->listen_fd);
+        unlink(cfg->trigger_socket);
+    }
+    if (srv->trigger_fd >= 0)
+        close(srv->trigger_fd);
+    close(srv->signal_fd);
+
+    for (int t = 0; t < srv->pool.n_threads; t++)
+        arena_free(&srv->scratch[t]);
+    arena_free(&srv->frames);
+    free(srv);
+    return rc;
+}
@@ -0,0 +1,43 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "arena.h"
+#include "capture_config.h"
+#include "v4l2_capture.h"
+
+// Encodes one raw frame to filename using the caller's scratch arena.
+typedef void (*snapshot_encode_fn)(const void *raw, int size, const char *filename,
+                                   int width, int height, struct arena *scratch);
+
+// Resident snapshot server. Keeps the stream running, copies every frame
+// into a small pre-roll ring and hands the driver buffer straight back.
+// A trigger (SIGUSR1, a 'snap [usec]' request on the UNIX socket, or a
+// rising edge on the trigger file) saves the ring frame nearest to the
+// requested CLOCK_MONOTONIC time, waiting for the next frame if that time
+// has not been captured yet. With --motion, every frame is also checked
+// for motion and frames that show enough change are saved the same way.
+// Runs until SIGINT/SIGTERM, or returns -1 when the device fails and does
+// not come back.
+int snapshot_serve(struct capture_device *dev, const struct capture_config *cfg,
+                   snapshot_encode_fn encode, size_t scratch_size);
+
+#endif
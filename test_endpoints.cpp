@@ -0,0 +1,475 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+// Tests for the HTTP endpoints, run against the fake camera (fake_v4l2.cpp,
+// preloaded). "preview" feeds an MJPEG preview server from the capture in
+// this process, or runs a program that serves one, reads the first part of
+// /stream from 127.0.0.1 and decodes it. The fake's frames are tinted red,
+// so a swapped channel order fails the colour check. "metrics" runs a
+// program with --metrics and scrapes /metrics until frames have been saved,
+// then checks the core series and that the counters keep moving.
+//
+//   LD_PRELOAD=./fake_v4l2.so ./test_endpoints preview -p 18431
+//   LD_PRELOAD=./fake_v4l2.so ./test_endpoints preview -p 18431 -s 1280x720 --
+//       ./v4l2_live -d /dev/video-fake --headless --preview-port 18431
+//   LD_PRELOAD=./fake_v4l2.so ./test_endpoints metrics -p 18433 --
+//       ./v4l2_png -d /dev/video-fake --frames 1000 --metrics 18433
+//
+// A program under test gets SIGTERM once the endpoint has answered and must
+// exit with status 0.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <cerrno>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <jpeglib.h>
+#include "capture_config.h"
+#include "debayer.h"
+#include "mjpeg_server.h"
+#include "v4l2_capture.h"
+
+#define TIMEOUT_MS          10000
+#define PREVIEW_MIN_TINT    8       // fake red minus blue is 16 in 8 bits
+
+struct response {
+    uint8_t *data;
+    size_t  len;
+    size_t  cap;
+};
+
+// Keeps the source of the endpoint going while the client waits: one
+// capture step in-process, or a check that the program is still running.
+struct source {
+    int (*step)(struct source *src);
+    pid_t                   pid;
+    struct capture_device   dev;
+    struct mjpeg_server     preview;
+    uint8_t                 *rgb;
+};
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Connects to 127.0.0.1:port, retrying until the server is listening.
+static int connect_local(int port, double deadline) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    for (;;) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            perror("socket");
+            return -1;
+        }
+        if (0 == connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+            return fd;
+        close(fd);
+        if (now_ms() > deadline) {
+            fprintf(stderr, "Nothing listening on 127.0.0.1:%d\n", port);
+            return -1;
+        }
+        usleep(50000);
+    }
+}
+
+// Appends whatever arrives within wait_ms. Returns 0 at end of stream,
+// -1 on error and 1 otherwise.
+static int read_some(int fd, struct response *r, int wait_ms) {
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if (poll(&pfd, 1, wait_ms) <= 0)
+        return 1;
+    if (r->cap - r->len < 65536) {
+        r->cap = r->cap * 2 + 65536;
+        r->data = (uint8_t *)realloc(r->data, r->cap);
+        if (!r->data) {
+            perror("Out of memory");
+            exit(EXIT_FAILURE);
+        }
+    }
+    ssize_t n = recv(fd, r->data + r->len, r->cap - r->len - 1, 0);
+    if (n < 0)
+        return errno == EINTR ? 1 : -1;
+    r->len += n;
+    r->data[r->len] = '\0';
+    return n > 0;
+}
+
+static const uint8_t *find(const struct response *r, size_t from, const char *text) {
+    if (from > r->len)
+        return NULL;
+    return (const uint8_t *)memmem(r->data + from, r->len - from, text, strlen(text));
+}
+
+// Locates the first complete JPEG part of a /stream response.
+static int find_part(const struct response *r, const uint8_t **jpeg, size_t *size) {
+    const uint8_t *head = find(r, 0, "\r\n\r\n");
+    if (!head)
+        return 0;
+    const uint8_t *part = find(r, head - r->data, "--frame\r\n");
+    const uint8_t *body = part ? find(r, part - r->data, "\r\n\r\n") : NULL;
+    if (!body)
+        return 0;
+    const uint8_t *length = find(r, part - r->data, "Content-Length: ");
+    if (!length || length > body) {
+        fprintf(stderr, "Preview part has no Content-Length\n");
+        exit(EXIT_FAILURE);
+    }
+    *size = strtoul((const char *)length + 16, NULL, 10);
+    *jpeg = body + 4;
+    return (size_t)(*jpeg - r->data) + *size <= r->len;
+}
+
+// Decodes the preview frame and checks its size and the fake's red tint.
+static int check_jpeg(const uint8_t *data, size_t size, int width, int height) {
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    uint64_t sum[3] = { 0, 0, 0 };
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, data, size);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+    if ((int)cinfo.output_width != width || (int)cinfo.output_height != height) {
+        fprintf(stderr, "Preview is %ux%u, expected %dx%d\n",
+                cinfo.output_width, cinfo.output_height, width, height);
+        jpeg_destroy_decompress(&cinfo);
+        return -1;
+    }
+    uint8_t *row = (uint8_t *)malloc((size_t)width * 3);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        jpeg_read_scanlines(&cinfo, &row, 1);
+        for (int x = 0; x < width * 3; x++)
+            sum[x % 3] += row[x];
+    }
+    free(row);
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+
+    double pixels = (double)width * height;
+    double r = sum[0] / pixels, g = sum[1] / pixels, b = sum[2] / pixels;
+    printf("Preview frame: %dx%d, %zu bytes, mean R %.1f G %.1f B %.1f\n", width, height, size, r, g, b);
+    if (r < g || g < b || r - b < PREVIEW_MIN_TINT) {
+        fprintf(stderr, "Preview colours are off: expected R > G > B\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Sends a GET and collects the response until done() accepts it, the
+// server closes the connection or the deadline passes.
+static int fetch(struct source *src, int port, const char *path, struct response *r,
+                 int (*done)(const struct response *r)) {
+    double deadline = now_ms() + TIMEOUT_MS;
+    char request[256];
+
+    int fd = connect_local(port, deadline);
+    if (fd < 0)
+        return -1;
+    int n = snprintf(request, sizeof(request), "GET %s HTTP/1.0\r\n\r\n", path);
+    if (send(fd, request, n, MSG_NOSIGNAL) != n) {
+        perror("send");
+        close(fd);
+        return -1;
+    }
+
+    int rc = -1;
+    while (now_ms() < deadline) {
+        if (src->step(src))
+            break;
+        int got = read_some(fd, r, 10);
+        if (done(r)) {
+            rc = 0;
+            break;
+        }
+        if (got <= 0) {
+            fprintf(stderr, "%s: connection closed after %zu bytes\n", path, r->len);
+            break;
+        }
+    }
+    if (rc && now_ms() >= deadline)
+        fprintf(stderr, "%s: no answer within %d ms\n", path, TIMEOUT_MS);
+    close(fd);
+    return rc;
+}
+
+static int preview_done(const struct response *r) {
+    const uint8_t *jpeg;
+    size_t size;
+    return find_part(r, &jpeg, &size);
+}
+
+// A complete plain HTTP response: the head and Content-Length bytes of body.
+static int response_done(const struct response *r) {
+    const uint8_t *head = find(r, 0, "\r\n\r\n");
+    const uint8_t *length = find(r, 0, "Content-Length: ");
+    if (!head || !length || length > head)
+        return 0;
+    size_t size = strtoul((const char *)length + 16, NULL, 10);
+    return (size_t)(head + 4 - r->data) + size <= r->len;
+}
+
+// Value of an exposition line "series value". Returns -1 if it is missing.
+static double metric_value(const struct response *r, const char *series) {
+    char needle[160];
+    snprintf(needle, sizeof(needle), "\n%s ", series);
+    const uint8_t *line = find(r, 0, needle);
+    return line ? strtod((const char *)line + strlen(needle), NULL) : -1;
+}
+
+// --- sources ----------------------------------------------------------------
+
+// One frame from the fake device, demosaiced and offered to the preview.
+static int capture_step(struct source *src) {
+    struct capture_device *dev = &src->dev;
+    struct v4l2_buffer buf;
+    int width = dev->fmt.fmt.pix.width, height = dev->fmt.fmt.pix.height;
+
+    int r = capture_dequeue(dev, &buf, 10);
+    if (r < 0) {
+        fprintf(stderr, "Capture failed: %s\n", capture_fault_name(dev->fault));
+        return -1;
+    }
+    if (r == 0)
+        return 0;
+    if (!(buf.flags & V4L2_BUF_FLAG_ERROR)) {
+        const uint16_t *raw = (const uint16_t *)dev->buffers[buf.index].start;
+        for (int y = 0; y < height; y++)
+            debayer_row(raw, src->rgb + (size_t)y * width * 3, width, height, y);
+        mjpeg_server_submit(&src->preview, src->rgb, (size_t)width * 3);
+    }
+    capture_requeue(dev, &buf);
+    return 0;
+}
+
+static int program_step(struct source *src) {
+    int status;
+    if (waitpid(src->pid, &status, WNOHANG) == src->pid) {
+        fprintf(stderr, "Program exited before the test finished (status %d)\n", status);
+        src->pid = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static int start_program(struct source *src, char **argv) {
+    src->step = program_step;
+    src->pid = fork();
+    if (src->pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (src->pid == 0) {
+        execvp(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    return 0;
+}
+
+// Stops the program and reports whether it shut down cleanly.
+static int stop_program(struct source *src) {
+    int status;
+    if (src->pid < 0)
+        return -1;
+    kill(src->pid, SIGTERM);
+    if (waitpid(src->pid, &status, 0) != src->pid) {
+        perror("waitpid");
+        return -1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Program did not exit cleanly (status %d)\n", status);
+        return -1;
+    }
+    return 0;
+}
+
+// --- tests ------------------------------------------------------------------
+
+static int test_preview(const char *dev_name, int port, int width, int height, char **command) {
+    struct capture_config cfg;
+    struct source src;
+    struct response r;
+    const uint8_t *jpeg;
+    size_t size;
+    int rc;
+
+    memset(&src, 0, sizeof(src));
+    memset(&r, 0, sizeof(r));
+    if (command[0]) {
+        if (start_program(&src, command))
+            return -1;
+        rc = fetch(&src, port, "/stream", &r, preview_done);
+        if (stop_program(&src))
+            rc = -1;
+    } else {
+        capture_config_init(&cfg);
+        snprintf(cfg.dev_name, sizeof(cfg.dev_name), "%s", dev_name);
+        cfg.width = width;
+        cfg.height = height;
+        cfg.fast_start = 1;
+        cfg.settle_ms = 0;
+        capture_open(&src.dev, &cfg);
+        capture_start(&src.dev);
+        src.step = capture_step;
+        src.rgb = (uint8_t *)malloc((size_t)width * height * 3);
+        if (!src.rgb || mjpeg_server_start(&src.preview, port, width, height, 90))
+            return -1;
+        rc = fetch(&src, port, "/stream", &r, preview_done);
+        mjpeg_server_stop(&src.preview);
+        capture_stop(&src.dev);
+        free(src.rgb);
+    }
+
+    if (!rc && find_part(&r, &jpeg, &size))
+        rc = check_jpeg(jpeg, size, width, height);
+    free(r.data);
+    return rc;
+}
+
+static int scrape(struct source *src, int port, struct response *r) {
+    r->len = 0;
+    if (fetch(src, port, "/metrics", r, response_done))
+        return -1;
+    if (!find(r, 0, "HTTP/1.0 200 ")) {
+        fprintf(stderr, "/metrics: %.40s\n", (const char *)r->data);
+        return -1;
+    }
+    return 0;
+}
+
+static int test_metrics(int port, char **command) {
+    static const char *series[] = {
+        "v4l2_frames_dequeued_total",
+        "v4l2_frames_saved_total",
+        "v4l2_bytes_written_total",
+        "v4l2_stage_duration_seconds_count{stage=\"process\"}",
+        "v4l2_stage_cpu_seconds_total{stage=\"process\"}",
+        "v4l2_frame_mean_level",
+        "process_max_resident_memory_bytes",
+    };
+    struct source src;
+    struct response r;
+    int rc = -1;
+
+    if (!command[0]) {
+        fprintf(stderr, "metrics needs a command to scrape\n");
+        return -1;
+    }
+    memset(&src, 0, sizeof(src));
+    memset(&r, 0, sizeof(r));
+    if (start_program(&src, command))
+        return -1;
+
+    // The endpoint is up before the first frame; wait until one is saved.
+    double deadline = now_ms() + TIMEOUT_MS, dequeued = -1;
+    while (now_ms() < deadline && !scrape(&src, port, &r)) {
+        if (metric_value(&r, "v4l2_frames_saved_total") > 0) {
+            dequeued = metric_value(&r, "v4l2_frames_dequeued_total");
+            break;
+        }
+        usleep(100000);
+    }
+    if (dequeued < 0) {
+        fprintf(stderr, "No frame saved within %d ms\n", TIMEOUT_MS);
+    } else {
+        rc = 0;
+        for (size_t i = 0; i < sizeof(series) / sizeof(series[0]); i++) {
+            double v = metric_value(&r, series[i]);
+            printf("%-50s %g\n", series[i], v);
+            if (v <= 0) {
+                fprintf(stderr, "%s: missing or zero\n", series[i]);
+                rc = -1;
+            }
+        }
+        usleep(300000);
+        if (!rc && (scrape(&src, port, &r) || metric_value(&r, "v4l2_frames_dequeued_total") <= dequeued)) {
+            fprintf(stderr, "v4l2_frames_dequeued_total did not advance\n");
+            rc = -1;
+        }
+    }
+    if (stop_program(&src))
+        rc = -1;
+    free(r.data);
+    return rc;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s preview -p port [-d device] [-s WxH] [-- command ...]\n"
+                    "       %s metrics -p port -- command ...\n", prog, prog);
+}
+
+int main(int argc, char **argv) {
+    const char *dev_name = "/dev/video-fake";
+    int port = 0, width = 640, height = 480, c;
+
+    if (argc < 2 || (strcmp(argv[1], "preview") && strcmp(argv[1], "metrics"))) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    while ((c = getopt(argc - 1, argv + 1, "+d:p:s:h")) != -1) {
+        switch (c) {
+        case 'd':
+            dev_name = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 's':
+            if (sscanf(optarg, "%dx%d", &width, &height) != 2 || width < 2 || height < 2) {
+                fprintf(stderr, "Invalid size '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (port < 1 || port > 65535) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    capture_quiet = 1;
+    signal(SIGPIPE, SIG_IGN);
+    char **command = argv + 1 + optind;
+    int rc = !strcmp(argv[1], "preview") ? test_preview(dev_name, port, width, height, command)
+                                         : test_metrics(port, command);
+    if (rc) {
+        printf("FAILED\n");
+        return EXIT_FAILURE;
+    }
+    printf("OK\n");
+    return 0;
+}
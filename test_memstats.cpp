@@ -0,0 +1,99 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+
+// Checks that the ALLOC_STATS counting allocator (memstats.cpp) sees every
+// allocation entry point, including the aligned ones that aligned operator
+// new and OpenCV's Mat buffers use. Built and linked with -DALLOC_STATS;
+// exits 1 if any entry point leaves the count unchanged.
+//
+//   ./test_memstats
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <new>
+#include "memstats.h"
+
+// Allocations are stored here before they are freed, so the compiler cannot
+// drop an unused malloc/free pair.
+static void *volatile sink;
+
+struct alignas(64) aligned_block {
+    char bytes[256];
+};
+
+static int failures;
+
+static void check(const char *name, unsigned long before) {
+    unsigned long n = memstats_alloc_count() - before;
+    printf("%-16s %lu\n", name, n);
+    if (n == 0) {
+        fprintf(stderr, "%s is not counted\n", name);
+        failures++;
+    }
+}
+
+int main(void) {
+    unsigned long before;
+    void *p;
+
+    before = memstats_alloc_count();
+    sink = malloc(100);
+    check("malloc", before);
+    before = memstats_alloc_count();
+    sink = realloc(sink, 1000);
+    check("realloc", before);
+    free(sink);
+
+    before = memstats_alloc_count();
+    sink = calloc(10, 10);
+    check("calloc", before);
+    free(sink);
+
+    before = memstats_alloc_count();
+    sink = memalign(64, 100);
+    check("memalign", before);
+    free(sink);
+
+    before = memstats_alloc_count();
+    if (posix_memalign(&p, 64, 100) == 0)
+        sink = p;
+    check("posix_memalign", before);
+    free(sink);
+
+    before = memstats_alloc_count();
+    sink = aligned_alloc(64, 128);
+    check("aligned_alloc", before);
+    free(sink);
+
+    before = memstats_alloc_count();
+    char *bytes = new char[100];
+    sink = bytes;
+    check("new", before);
+    delete[] bytes;
+
+    before = memstats_alloc_count();
+    aligned_block *block = new aligned_block;
+    sink = block;
+    check("aligned new", before);
+    delete block;
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
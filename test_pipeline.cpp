@@ -0,0 +1,860 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// Golden-image and timing harness for the processing paths. Synthetic
+// scenes (flat field, gradients, colour bars, checkerboard) with a known
+// 10-bit RGB truth are mosaiced to SRGGB10 and fed through every path:
+// RGB and YUV demosaic, raw calibration, temporal stacking, the pyramid
+// levels and every encoder, decoded again. Each output is compared with
+// its golden image, derived from the truth, against a per-path PSNR
+// threshold, and each path is timed.
+//
+//   ./test_pipeline                    check at 640x480, exit status 1 on failure
+//   ./test_pipeline -w golden/         also save every output as PPM/PGM
+//   ./test_pipeline -g golden/         also compare with a saved run
+//   ./test_pipeline -t times.txt       record ms per frame for each path
+//   ./test_pipeline -b times.txt       fail when a path got slower than that
+//
+// -w then -g across a change shows whether it altered any output at all;
+// the truth thresholds only catch real regressions.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <png.h>
+#include <jpeglib.h>
+#include "arena.h"
+#include "cpu_dispatch.h"
+#include "debayer.h"
+#include "encode.h"
+#include "frame_stack.h"
+#include "pyramid.h"
+#include "raw_correct.h"
+
+#define MAX_RESULTS         4
+#define GOLDEN_MIN_PSNR     50.0    // against a saved run: bit noise only
+#define STACK_FRAMES        8
+#define STACK_NOISE         24      // peak noise on each 10-bit sample
+#define CAL_BLACK_LEVEL     64
+#define THUMB_WIDTH         40
+
+enum pattern {
+    PATTERN_FLAT,
+    PATTERN_GRADIENT,
+    PATTERN_BARS,
+    PATTERN_CHECKER,
+    N_PATTERNS,
+};
+
+static const char *pattern_names[N_PATTERNS] = { "flat", "gradient", "bars", "checker" };
+
+// A synthetic scene: the 10-bit RGB truth, its 8-bit golden image and the
+// SRGGB10 mosaic a sensor would deliver for it.
+struct scene {
+    int      width;
+    int      height;
+    uint16_t *truth;
+    uint8_t  *golden;
+    uint16_t *raw;
+};
+
+// One output plane of a path and the golden image it should match.
+struct result {
+    char     name[16];      // suffix after the path name, may be empty
+    int      width;
+    int      height;
+    int      channels;      // 3 for RGB, 1 for a plane
+    uint8_t  *out;
+    uint8_t  *ref;
+};
+
+struct run {
+    struct result res[MAX_RESULTS];
+    int           n;
+    double        ms;       // per frame, core of the path only
+};
+
+static const char *tmpdir;
+static int iterations = 5;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Paths keep their fastest iteration: the first one also pays for page
+// faults on fresh buffers, and the minimum is the stablest figure to
+// compare between runs.
+static void lap(struct run *r, double t0) {
+    double ms = now_ms() - t0;
+    if (r->ms == 0 || ms < r->ms)
+        r->ms = ms;
+}
+
+static void *xmalloc(size_t size) {
+    void *p = malloc(size);
+    if (!p) {
+        perror("Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static struct result *add_result(struct run *r, const char *name, int width, int height,
+                                 int channels) {
+    struct result *res = &r->res[r->n++];
+    size_t size = (size_t)width * height * channels;
+    snprintf(res->name, sizeof(res->name), "%s", name);
+    res->width = width;
+    res->height = height;
+    res->channels = channels;
+    res->out = (uint8_t *)xmalloc(size);
+    res->ref = (uint8_t *)xmalloc(size);
+    return res;
+}
+
+static double psnr(const uint8_t *a, const uint8_t *b, size_t n) {
+    double sse = 0;
+    for (size_t i = 0; i < n; i++) {
+        int d = a[i] - b[i];
+        sse += d * d;
+    }
+    return sse ? 10 * log10(255.0 * 255.0 * n / sse) : INFINITY;
+}
+
+// --- scenes ---------------------------------------------------------------
+
+static void scene_pixel(int pattern, int x, int y, int width, int height, uint16_t *rgb) {
+    // 75% SMPTE bars: white, yellow, cyan, green, magenta, red, blue, black.
+    static const uint8_t bars[8][3] = {
+        { 1, 1, 1 }, { 1, 1, 0 }, { 0, 1, 1 }, { 0, 1, 0 },
+        { 1, 0, 1 }, { 1, 0, 0 }, { 0, 0, 1 }, { 0, 0, 0 },
+    };
+    switch (pattern) {
+    case PATTERN_FLAT:
+        rgb[0] = 620;
+        rgb[1] = 480;
+        rgb[2] = 300;
+        break;
+    case PATTERN_GRADIENT:
+        rgb[0] = 1023 * x / (width - 1);
+        rgb[1] = 1023 * y / (height - 1);
+        rgb[2] = 1023 * (x + y) / (width + height - 2);
+        break;
+    case PATTERN_BARS:
+        for (int c = 0; c < 3; c++)
+            rgb[c] = bars[x * 8 / width][c] * 767;
+        break;
+    default: {
+        uint16_t v = ((x / 16 + y / 16) % 2) ? 900 : 100;
+        rgb[0] = rgb[1] = rgb[2] = v;
+        break;
+    }
+    }
+}
+
+static void scene_init(struct scene *s, int pattern, int width, int height) {
+    size_t pixels = (size_t)width * height;
+    s->width = width;
+    s->height = height;
+    s->truth = (uint16_t *)xmalloc(pixels * 3 * sizeof(uint16_t));
+    s->golden = (uint8_t *)xmalloc(pixels * 3);
+    s->raw = (uint16_t *)xmalloc(pixels * sizeof(uint16_t));
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            size_t i = (size_t)y * width + x;
+            uint16_t *rgb = s->truth + i * 3;
+            scene_pixel(pattern, x, y, width, height, rgb);
+            for (int c = 0; c < 3; c++)
+                s->golden[i * 3 + c] = rgb[c] >> 2;
+            // RGGB: R on even rows and columns, B on odd ones, G between.
+            s->raw[i] = rgb[(y % 2) + (x % 2)];
+        }
+    }
+}
+
+static void scene_free(struct scene *s) {
+    free(s->truth);
+    free(s->golden);
+    free(s->raw);
+}
+
+// --- paths ----------------------------------------------------------------
+
+static void debayer_frame(const uint16_t *raw, uint8_t *rgb, int width, int height) {
+    for (int y = 0; y < height; y++)
+        debayer_row(raw, rgb + (size_t)y * width * 3, width, height, y);
+}
+
+static void path_rgb(const struct scene *s, struct run *r) {
+    struct result *res = add_result(r, "", s->width, s->height, 3);
+    memcpy(res->ref, s->golden, (size_t)s->width * s->height * 3);
+
+    for (int i = 0; i < iterations; i++) {
+        double t0 = now_ms();
+        debayer_frame(s->raw, res->out, s->width, s->height);
+        lap(r, t0);
+    }
+}
+
+// The scene as a sensor with a black-level pedestal and a few stuck pixels
+// would see it, and the calibration that corrects it back.
+static uint16_t *calibrated_sensor(const struct scene *s, struct raw_calibration *cal) {
+    static const int defects[][2] = { { 10, 10 }, { 11, 21 }, { 100, 50 }, { 201, 133 } };
+    const int n_defects = sizeof(defects) / sizeof(defects[0]);
+    size_t pixels = (size_t)s->width * s->height;
+    char path[512];
+
+    snprintf(path, sizeof(path), "%s/test_pipeline.cal", tmpdir);
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(fp, "black_level = %d\nwhite_level = 1023\n", CAL_BLACK_LEVEL);
+    for (int i = 0; i < n_defects; i++)
+        fprintf(fp, "defect = %d,%d\n", defects[i][0], defects[i][1]);
+    fclose(fp);
+    if (raw_calibration_load(cal, path, s->width, s->height))
+        exit(EXIT_FAILURE);
+    unlink(path);
+
+    uint16_t *sensor = (uint16_t *)xmalloc(pixels * sizeof(uint16_t));
+    for (size_t i = 0; i < pixels; i++)
+        sensor[i] = CAL_BLACK_LEVEL + (s->raw[i] * (1023 - CAL_BLACK_LEVEL) + 511) / 1023;
+    for (int i = 0; i < n_defects; i++) {
+        if (defects[i][0] < s->width && defects[i][1] < s->height)
+            sensor[defects[i][1] * s->width + defects[i][0]] = i % 2 ? 0 : 1023;
+    }
+    return sensor;
+}
+
+// Corrected back by raw_correct_row().
+static void path_calibrated(const struct scene *s, struct run *r) {
+    size_t pixels = (size_t)s->width * s->height;
+    struct raw_calibration cal;
+    uint16_t *sensor = calibrated_sensor(s, &cal);
+    uint16_t *corrected = (uint16_t *)xmalloc(pixels * sizeof(uint16_t));
+
+    struct result *res = add_result(r, "", s->width, s->height, 3);
+    memcpy(res->ref, s->golden, pixels * 3);
+
+    for (int i = 0; i < iterations; i++) {
+        double t0 = now_ms();
+        for (int y = 0; y < s->height; y++)
+            raw_correct_row(&cal, sensor, corrected + (size_t)y * s->width, y);
+        debayer_frame(corrected, res->out, s->width, s->height);
+        lap(r, t0);
+    }
+
+    free(corrected);
+    free(sensor);
+    raw_calibration_free(&cal);
+}
+
+static uint8_t clamp_u8(double v) {
+    return v < 0 ? 0 : v > 255 ? 255 : (uint8_t)lround(v);
+}
+
+// BT.601 limited range in floating point from the truth, chroma averaged
+// over each 2x2 block: the reference for the fixed-point kernel.
+static void golden_yuv(const struct scene *s, uint8_t *y_plane, uint8_t *u_plane,
+                       uint8_t *v_plane, int uv_step) {
+    int w = s->width;
+    for (int y = 0; y < s->height; y += 2) {
+        for (int x = 0; x < w; x += 2) {
+            double sr = 0, sg = 0, sb = 0;
+            for (int k = 0; k < 4; k++) {
+                int px = x + k % 2, py = y + k / 2;
+                const uint16_t *rgb = s->truth + ((size_t)py * w + px) * 3;
+                double r = rgb[0] / 4.0, g = rgb[1] / 4.0, b = rgb[2] / 4.0;
+                y_plane[(size_t)py * w + px] = clamp_u8(16 + 0.257 * r + 0.504 * g + 0.098 * b);
+                sr += r / 4;
+                sg += g / 4;
+                sb += b / 4;
+            }
+            size_t c = ((size_t)y / 2 * (w / 2) + x / 2) * uv_step;
+            u_plane[c] = clamp_u8(128 - 0.148 * sr - 0.291 * sg + 0.439 * sb);
+            v_plane[c] = clamp_u8(128 + 0.439 * sr - 0.368 * sg - 0.071 * sb);
+        }
+    }
+}
+
+// With calibrated set, the calibrated sensor frame goes through
+// raw_correct_yuv_frame(), as the capture tool runs it with --calibration.
+static void run_yuv(const struct scene *s, struct run *r, int layout, int calibrated) {
+    int w = s->width, h = s->height;
+    size_t luma = (size_t)w * h;
+    uint8_t *buf = (uint8_t *)xmalloc(yuv_frame_size(w, h));
+    struct yuv_frame f;
+    struct raw_calibration cal;
+    uint16_t *sensor = NULL, *ring = NULL;
+    yuv_frame_init(&f, buf, w, h, layout);
+    if (calibrated) {
+        sensor = calibrated_sensor(s, &cal);
+        ring = (uint16_t *)xmalloc(3 * w * sizeof(uint16_t));
+    }
+
+    for (int i = 0; i < iterations; i++) {
+        double t0 = now_ms();
+        if (calibrated) {
+            raw_correct_yuv_frame(&cal, sensor, ring, &f);
+        } else {
+            for (int y = 0; y < h; y += 2) {
+                const uint16_t *cur = s->raw + (size_t)y * w;
+                debayer_yuv_rows(cur, cur + w, y + 2 < h ? cur + 2 * w : cur, &f, y);
+            }
+        }
+        lap(r, t0);
+    }
+    if (calibrated) {
+        free(ring);
+        free(sensor);
+        raw_calibration_free(&cal);
+    }
+
+    struct result *ry = add_result(r, "_y", w, h, 1);
+    memcpy(ry->out, f.y, luma);
+    if (layout == YUV_NV12) {
+        struct result *ruv = add_result(r, "_uv", w, h / 2, 1);
+        memcpy(ruv->out, f.u, luma / 2);
+        golden_yuv(s, ry->ref, ruv->ref, ruv->ref + 1, 2);
+    } else {
+        struct result *ru = add_result(r, "_u", w / 2, h / 2, 1);
+        struct result *rv = add_result(r, "_v", w / 2, h / 2, 1);
+        memcpy(ru->out, f.u, luma / 4);
+        memcpy(rv->out, f.v, luma / 4);
+        golden_yuv(s, ry->ref, ru->ref, rv->ref, 1);
+    }
+    free(buf);
+}
+
+static void path_nv12(const struct scene *s, struct run *r) {
+    run_yuv(s, r, YUV_NV12, 0);
+}
+
+static void path_i420(const struct scene *s, struct run *r) {
+    run_yuv(s, r, YUV_I420, 0);
+}
+
+static void path_calibrated_nv12(const struct scene *s, struct run *r) {
+    run_yuv(s, r, YUV_NV12, 1);
+}
+
+static void path_calibrated_i420(const struct scene *s, struct run *r) {
+    run_yuv(s, r, YUV_I420, 1);
+}
+
+// STACK_FRAMES copies of the scene with independent uniform noise; the
+// stacked frame must come out cleaner than any single one.
+static void run_stack(const struct scene *s, struct run *r, int mode) {
+    size_t pixels = (size_t)s->width * s->height;
+    uint16_t *frames = (uint16_t *)xmalloc(pixels * STACK_FRAMES * sizeof(uint16_t));
+    uint16_t *stacked = (uint16_t *)xmalloc(pixels * sizeof(uint16_t));
+    uint32_t seed = 2024;
+    struct frame_stack stack;
+
+    for (size_t i = 0; i < pixels * STACK_FRAMES; i++) {
+        seed = seed * 1103515245 + 12345;
+        int v = s->raw[i % pixels] + (int)((seed >> 16) % (2 * STACK_NOISE + 1)) - STACK_NOISE;
+        frames[i] = v < 0 ? 0 : v > 1023 ? 1023 : v;
+    }
+    if (frame_stack_init(&stack, s->width, s->height, STACK_FRAMES, mode))
+        exit(EXIT_FAILURE);
+
+    struct result *res = add_result(r, "", s->width, s->height, 3);
+    memcpy(res->ref, s->golden, pixels * 3);
+
+    for (int i = 0; i < iterations; i++) {
+        double t0 = now_ms();
+        for (int k = 0; k < STACK_FRAMES; k++)
+            frame_stack_push(&stack, frames + pixels * k);
+        frame_stack_output(&stack, stacked);
+        lap(r, t0);
+    }
+    r->ms /= STACK_FRAMES;
+    debayer_frame(stacked, res->out, s->width, s->height);
+
+    frame_stack_free(&stack);
+    free(stacked);
+    free(frames);
+}
+
+static void path_stack_mean(const struct scene *s, struct run *r) {
+    run_stack(s, r, STACK_MEAN);
+}
+
+static void path_stack_median(const struct scene *s, struct run *r) {
+    run_stack(s, r, STACK_MEDIAN);
+}
+
+// --- decoders -------------------------------------------------------------
+
+static void read_png(const char *path, uint8_t *rgb, int width, int height) {
+    png_image img;
+    memset(&img, 0, sizeof(img));
+    img.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_file(&img, path)) {
+        fprintf(stderr, "%s: %s\n", path, img.message);
+        exit(EXIT_FAILURE);
+    }
+    img.format = PNG_FORMAT_RGB;
+    if ((int)img.width != width || (int)img.height != height ||
+        !png_image_finish_read(&img, NULL, rgb, 0, NULL)) {
+        fprintf(stderr, "%s: not a %dx%d PNG\n", path, width, height);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void read_jpeg(const char *path, uint8_t *rgb, int width, int height) {
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, fp);
+    jpeg_read_header(&cinfo, TRUE);
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+    if ((int)cinfo.output_width != width || (int)cinfo.output_height != height) {
+        fprintf(stderr, "%s: not a %dx%d JPEG\n", path, width, height);
+        exit(EXIT_FAILURE);
+    }
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = rgb + (size_t)cinfo.output_scanline * width * 3;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    fclose(fp);
+}
+
+static uint8_t *read_file(const char *path, size_t *size) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    rewind(fp);
+    uint8_t *data = (uint8_t *)xmalloc(*size ? *size : 1);
+    if (fread(data, 1, *size, fp) != *size) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(fp);
+    return data;
+}
+
+// Independent QOI decoder written from the specification, so encoder bugs
+// are not mirrored on the way back.
+static void read_qoi(const char *path, uint8_t *rgb, int width, int height) {
+    size_t size, p = 14;
+    uint8_t *data = read_file(path, &size);
+    uint8_t index[64][4], px[4] = { 0, 0, 0, 255 };
+    int run = 0;
+
+    memset(index, 0, sizeof(index));
+    if (size < 22 || memcmp(data, "qoif", 4) ||
+        (data[4] << 24 | data[5] << 16 | data[6] << 8 | data[7]) != width ||
+        (data[8] << 24 | data[9] << 16 | data[10] << 8 | data[11]) != height) {
+        fprintf(stderr, "%s: not a %dx%d QOI image\n", path, width, height);
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < (size_t)width * height; i++) {
+        if (run) {
+            run--;
+        } else if (p < size - 8) {
+            int b = data[p++];
+            if (b == 0xfe) {
+                px[0] = data[p++];
+                px[1] = data[p++];
+                px[2] = data[p++];
+            } else if (b == 0xff) {
+                memcpy(px, data + p, 4);
+                p += 4;
+            } else if ((b & 0xc0) == 0x00) {
+                memcpy(px, index[b], 4);
+            } else if ((b & 0xc0) == 0x40) {
+                px[0] += ((b >> 4) & 3) - 2;
+                px[1] += ((b >> 2) & 3) - 2;
+                px[2] += (b & 3) - 2;
+            } else if ((b & 0xc0) == 0x80) {
+                int vg = (b & 0x3f) - 32, b2 = data[p++];
+                px[0] += vg - 8 + ((b2 >> 4) & 0x0f);
+                px[1] += vg;
+                px[2] += vg - 8 + (b2 & 0x0f);
+            } else {
+                run = b & 0x3f;
+            }
+            memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64], px, 4);
+        }
+        memcpy(rgb + i * 3, px, 3);
+    }
+    free(data);
+}
+
+// --- encoders and pyramid -------------------------------------------------
+
+// Each encoder gets the demosaiced frame and must give it back: exactly for
+// the lossless formats, within the threshold for JPEG.
+static void run_encoder(const struct scene *s, struct run *r, int format) {
+    int w = s->width, h = s->height;
+    struct arena scratch;
+    struct encoder enc;
+    char path[512];
+
+    if (arena_init(&scratch, encode_arena_size(w)))
+        exit(EXIT_FAILURE);
+    snprintf(path, sizeof(path), "%s/test_pipeline.%s", tmpdir, encode_format_ext(format));
+
+    struct result *res = add_result(r, "", w, h, 3);
+    debayer_frame(s->raw, res->ref, w, h);
+
+    for (int i = 0; i < iterations; i++) {
+        double t0 = now_ms();
+        encoder_begin(&enc, format, 90, path, w, h, &scratch);
+        for (int y = 0; y < h; y++)
+            encoder_write_row(&enc, res->ref + (size_t)y * w * 3);
+        encoder_end(&enc);
+        lap(r, t0);
+    }
+
+    if (format == ENCODE_PNG)
+        read_png(path, res->out, w, h);
+    else if (format == ENCODE_JPEG)
+        read_jpeg(path, res->out, w, h);
+    else
+        read_qoi(path, res->out, w, h);
+    unlink(path);
+    arena_free(&scratch);
+}
+
+static void path_png(const struct scene *s, struct run *r) {
+    run_encoder(s, r, ENCODE_PNG);
+}
+
+static void path_jpeg(const struct scene *s, struct run *r) {
+    run_encoder(s, r, ENCODE_JPEG);
+}
+
+static void path_qoi(const struct scene *s, struct run *r) {
+    run_encoder(s, r, ENCODE_QOI);
+}
+
+// The raw writer must store the sensor buffer byte for byte.
+static void path_raw(const struct scene *s, struct run *r) {
+    size_t bytes = (size_t)s->width * s->height * sizeof(uint16_t);
+    char path[512];
+    size_t size;
+
+    snprintf(path, sizeof(path), "%s/test_pipeline.raw", tmpdir);
+    struct result *res = add_result(r, "", s->width * 2, s->height, 1);
+    memcpy(res->ref, s->raw, bytes);
+
+    for (int i = 0; i < iterations; i++) {
+        double t0 = now_ms();
+        encode_raw_frame(s->raw, bytes, path);
+        lap(r, t0);
+    }
+
+    uint8_t *data = read_file(path, &size);
+    memset(res->out, 0, bytes);
+    memcpy(res->out, data, size < bytes ? size : bytes);
+    free(data);
+    unlink(path);
+}
+
+// Box-averaged golden image of `level_w` x `level_h` from the truth, each
+// output pixel covering the same area of the scene.
+static void golden_area(const struct scene *s, uint8_t *out, int level_w, int level_h) {
+    for (int ty = 0; ty < level_h; ty++) {
+        int y0 = ty * s->height / level_h, y1 = (ty + 1) * s->height / level_h;
+        for (int tx = 0; tx < level_w; tx++) {
+            int x0 = tx * s->width / level_w, x1 = (tx + 1) * s->width / level_w;
+            double acc[3] = { 0, 0, 0 };
+            for (int y = y0; y < y1; y++)
+                for (int x = x0; x < x1; x++)
+                    for (int c = 0; c < 3; c++)
+                        acc[c] += s->truth[((size_t)y * s->width + x) * 3 + c];
+            double n = 4.0 * (y1 - y0) * (x1 - x0);
+            for (int c = 0; c < 3; c++)
+                out[((size_t)ty * level_w + tx) * 3 + c] = clamp_u8(acc[c] / n);
+        }
+    }
+}
+
+// All halvings and a thumbnail from one walk, encoded as PNG by the pyramid
+// helper and decoded again.
+static void path_pyramid(const struct scene *s, struct run *r) {
+    int w = s->width, h = s->height;
+    uint8_t *rgb = (uint8_t *)xmalloc((size_t)w * h * 3);
+    char path[512], level[512];
+
+    debayer_frame(s->raw, rgb, w, h);
+    snprintf(path, sizeof(path), "%s/test_pipeline.png", tmpdir);
+
+    for (int i = 0; i < iterations; i++) {
+        double t0 = now_ms();
+        struct pyramid *p = pyramid_begin(path);
+        for (int y = 0; y < h; y++)
+            pyramid_push_row(p, rgb + (size_t)y * w * 3);
+        pyramid_end(p);
+        lap(r, t0);
+    }
+
+    for (int k = 0; k < pyramid_level_count(); k++) {
+        static const char *names[] = { "_2", "_4", "_8", "_thumb" };
+        int lw, lh;
+        if (k < PYRAMID_MAX_HALVINGS) {
+            lw = w >> (k + 1);
+            lh = h >> (k + 1);
+        } else {
+            lw = THUMB_WIDTH;
+            lh = (h * THUMB_WIDTH + w / 2) / w;
+        }
+        struct result *res = add_result(r, names[k], lw, lh, 3);
+        pyramid_level_name(level, sizeof(level), path, k);
+        read_png(level, res->out, lw, lh);
+        golden_area(s, res->ref, lw, lh);
+        unlink(level);
+    }
+    free(rgb);
+}
+
+// --- driver ---------------------------------------------------------------
+
+typedef void (*path_fn)(const struct scene *s, struct run *r);
+
+// Thresholds in dB per pattern (flat, gradient, bars, checker) against the
+// golden image, about 3 dB under what the current code reaches; INFINITY
+// demands an exact match. Bilinear demosaic is exact on flat fields and
+// smears every hard edge over a pixel, hence the low checkerboard figures.
+static const struct path {
+    const char *name;
+    path_fn    run;
+    double     min_psnr[N_PATTERNS];
+} paths[] = {
+    { "rgb",             path_rgb,              { INFINITY, 54, 28, 16 } },
+    { "calibrated",      path_calibrated,       { 50, 53, 28, 16 } },
+    { "nv12",            path_nv12,             { 45, 54, 37, 21 } },
+    { "i420",            path_i420,             { 45, 54, 37, 21 } },
+    { "calibrated_nv12", path_calibrated_nv12,  { 45, 54, 37, 21 } },
+    { "calibrated_i420", path_calibrated_i420,  { 45, 54, 37, 21 } },
+    { "stack_mean",      path_stack_mean,       { 43, 43, 28, 16 } },
+    { "stack_median",    path_stack_median,     { 40, 40, 28, 16 } },
+    { "pyramid",         path_pyramid,          { 50, 49, 31, 20 } },
+    { "png",             path_png,              { INFINITY, INFINITY, INFINITY, INFINITY } },
+    { "qoi",             path_qoi,              { INFINITY, INFINITY, INFINITY, INFINITY } },
+    { "jpeg",            path_jpeg,             { 45, 45, 30, 20 } },
+    { "raw",             path_raw,              { INFINITY, INFINITY, INFINITY, INFINITY } },
+};
+#define N_PATHS (int)(sizeof(paths) / sizeof(paths[0]))
+
+static void write_pnm(const char *path, const struct result *res) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fprintf(fp, "P%d\n%d %d\n255\n", res->channels == 3 ? 6 : 5, res->width, res->height);
+    fwrite(res->out, 1, (size_t)res->width * res->height * res->channels, fp);
+    fclose(fp);
+}
+
+// PSNR of the output against the same output of a saved run, or -1 when
+// the saved run has no such file.
+static double compare_pnm(const char *path, const struct result *res) {
+    size_t pixels = (size_t)res->width * res->height * res->channels, size;
+    char header[32];
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return -1;
+    fclose(fp);
+
+    uint8_t *data = read_file(path, &size);
+    int n = snprintf(header, sizeof(header), "P%d\n%d %d\n255\n", res->channels == 3 ? 6 : 5,
+                     res->width, res->height);
+    if (size != n + pixels || memcmp(data, header, n)) {
+        free(data);
+        return 0;
+    }
+    double db = psnr(res->out, data + n, pixels);
+    free(data);
+    return db;
+}
+
+static int load_timings(const char *path, double *ms) {
+    FILE *fp = fopen(path, "r");
+    char name[64];
+    double v;
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    for (int i = 0; i < N_PATHS; i++)
+        ms[i] = -1;
+    while (fscanf(fp, "%63s %lf", name, &v) == 2) {
+        for (int i = 0; i < N_PATHS; i++) {
+            if (!strcmp(name, paths[i].name))
+                ms[i] = v;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-s WxH] [-n iterations] [-w save-dir] [-g golden-dir]\n"
+                    "       [-t timings-out] [-b timings-baseline] [-r max-slowdown-%%]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    int width = 640, height = 480, c, failures = 0;
+    const char *save_dir = NULL, *golden_dir = NULL, *timings_out = NULL, *baseline = NULL;
+    double max_slowdown = 25, total_ms[N_PATHS], baseline_ms[N_PATHS];
+    char path[512];
+
+    tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    while ((c = getopt(argc, argv, "s:n:w:g:t:b:r:h")) != -1) {
+        switch (c) {
+        case 's':
+            // Every pyramid level and the 16-pixel checker must tile evenly.
+            if (sscanf(optarg, "%dx%d", &width, &height) != 2 || width < 64 || height < 64 ||
+                width % 16 || height % 16) {
+                fprintf(stderr, "Invalid size '%s', need multiples of 16 from 64x64\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'w':
+            save_dir = optarg;
+            break;
+        case 'g':
+            golden_dir = optarg;
+            break;
+        case 't':
+            timings_out = optarg;
+            break;
+        case 'b':
+            baseline = optarg;
+            break;
+        case 'r':
+            max_slowdown = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (iterations < 1)
+        iterations = 1;
+    if (baseline && load_timings(baseline, baseline_ms))
+        return EXIT_FAILURE;
+    if (pyramid_init(1, width, height, PYRAMID_MAX_HALVINGS, THUMB_WIDTH, ENCODE_PNG, 90))
+        return EXIT_FAILURE;
+
+    printf("%dx%d, %d iteration(s) per path, %s kernels\n", width, height, iterations,
+           cpu_kernel_variant());
+    printf("%-8s %-20s %9s %9s %9s %9s\n", "pattern", "output", "PSNR dB", "min dB", "saved dB", "ms");
+    memset(total_ms, 0, sizeof(total_ms));
+    for (int pat = 0; pat < N_PATTERNS; pat++) {
+        struct scene s;
+        scene_init(&s, pat, width, height);
+        for (int i = 0; i < N_PATHS; i++) {
+            struct run r;
+            memset(&r, 0, sizeof(r));
+            paths[i].run(&s, &r);
+            total_ms[i] += r.ms;
+
+            for (int k = 0; k < r.n; k++) {
+                struct result *res = &r.res[k];
+                size_t n = (size_t)res->width * res->height * res->channels;
+                double db = psnr(res->out, res->ref, n), saved = -1;
+                int ok = db >= paths[i].min_psnr[pat];
+                char name[64];
+
+                snprintf(name, sizeof(name), "%s%s", paths[i].name, res->name);
+                if (golden_dir) {
+                    snprintf(path, sizeof(path), "%s/%s_%s.pnm", golden_dir, pattern_names[pat], name);
+                    saved = compare_pnm(path, res);
+                    if (saved >= 0 && saved < GOLDEN_MIN_PSNR)
+                        ok = 0;
+                }
+                if (save_dir) {
+                    snprintf(path, sizeof(path), "%s/%s_%s.pnm", save_dir, pattern_names[pat], name);
+                    write_pnm(path, res);
+                }
+
+                printf("%-8s %-20s %9.2f %9.2f ", pattern_names[pat], name, db, paths[i].min_psnr[pat]);
+                if (saved >= 0)
+                    printf("%9.2f ", saved);
+                else
+                    printf("%9s ", "-");
+                if (k == 0)
+                    printf("%9.3f", r.ms);
+                else
+                    printf("%9s", "");
+                printf("%s\n", ok ? "" : "  FAIL");
+                failures += !ok;
+                free(res->out);
+                free(res->ref);
+            }
+        }
+        scene_free(&s);
+    }
+
+    // Timings are per frame, averaged over the patterns.
+    FILE *fp = timings_out ? fopen(timings_out, "w") : NULL;
+    if (timings_out && !fp) {
+        perror(timings_out);
+        return EXIT_FAILURE;
+    }
+    printf("\n%-20s %9s %9s\n", "path", "ms", "baseline");
+    for (int i = 0; i < N_PATHS; i++) {
+        double ms = total_ms[i] / N_PATTERNS;
+        printf("%-20s %9.3f", paths[i].name, ms);
+        if (baseline && baseline_ms[i] > 0) {
+            int slower = ms > baseline_ms[i] * (1 + max_slowdown / 100);
+            printf(" %9.3f %+6.1f%%%s", baseline_ms[i], 100 * (ms / baseline_ms[i] - 1),
+                   slower ? "  SLOWER" : "");
+            failures += slower;
+        }
+        printf("\n");
+        if (fp)
+            fprintf(fp, "%s %.4f\n", paths[i].name, ms);
+    }
+    if (fp)
+        fclose(fp);
+
+    pyramid_shutdown();
+    printf("\n%s\n", failures ? "FAILED" : "all paths passed");
+    return failures ? EXIT_FAILURE : 0;
+}
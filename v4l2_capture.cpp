@@ -0,0 +1,627 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <cerrno>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include "metrics.h"
+#include "v4l2_capture.h"
+
+static void print_format(const struct v4l2_format *fmt) {
+    INFO_PRINT("Format set:\n");
+    INFO_PRINT("  Width: %d\n", fmt->fmt.pix.width);
+    INFO_PRINT("  Height: %d\n", fmt->fmt.pix.height);
+    INFO_PRINT("  Pixel format: %c%c%c%c\n",
+               fmt->fmt.pix.pixelformat & 0xFF,
+               (fmt->fmt.pix.pixelformat >> 8) & 0xFF,
+               (fmt->fmt.pix.pixelformat >> 16) & 0xFF,
+               (fmt->fmt.pix.pixelformat >> 24) & 0xFF);
+}
+
+static int configure_format(struct capture_device *dev, const struct capture_config *cfg) {
+    struct v4l2_format *fmt = &dev->fmt;
+
+    // Fast start: a device left configured by a previous run already
+    // reports the format we want, and S_FMT would just be a round trip.
+    if (cfg->fast_start) {
+        CLEAR(*fmt);
+        fmt->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        if (0 == ioctl(dev->fd, VIDIOC_G_FMT, fmt) &&
+            fmt->fmt.pix.width == cfg->width &&
+            fmt->fmt.pix.height == cfg->height &&
+            fmt->fmt.pix.pixelformat == cfg->pixelformat) {
+            INFO_PRINT("Format already configured\n");
+            print_format(fmt);
+            return 0;
+        }
+    }
+
+    CLEAR(*fmt);
+    fmt->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt->fmt.pix.width       = cfg->width;
+    fmt->fmt.pix.height      = cfg->height;
+    fmt->fmt.pix.pixelformat = cfg->pixelformat;
+    fmt->fmt.pix.field       = V4L2_FIELD_NONE;
+
+    INFO_PRINT("Setting format...\n");
+    if (-1 == ioctl(dev->fd, VIDIOC_S_FMT, fmt)) {
+        perror("VIDIOC_S_FMT");
+        return -1;
+    }
+
+    // Query the set format
+    if (-1 == ioctl(dev->fd, VIDIOC_G_FMT, fmt)) {
+        perror("VIDIOC_G_FMT");
+        return -1;
+    }
+    print_format(fmt);
+    return 0;
+}
+
+static void configure_frame_interval(struct capture_device *dev, const struct capture_config *cfg) {
+    struct v4l2_streamparm streamparm;
+
+    if (cfg->fast_start) {
+        CLEAR(streamparm);
+        streamparm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        if (0 == ioctl(dev->fd, VIDIOC_G_PARM, &streamparm) &&
+            streamparm.parm.capture.timeperframe.numerator == cfg->fps_num &&
+            streamparm.parm.capture.timeperframe.denominator == cfg->fps_den) {
+            INFO_PRINT("Frame interval already %d/%d\n", cfg->fps_num, cfg->fps_den);
+            return;
+        }
+    }
+
+    CLEAR(streamparm);
+    streamparm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    streamparm.parm.capture.timeperframe.numerator = cfg->fps_num;
+    streamparm.parm.capture.timeperframe.denominator = cfg->fps_den;
+
+    if (-1 == ioctl(dev->fd, VIDIOC_S_PARM, &streamparm)) {
+        perror("VIDIOC_S_PARM");
+    } else {
+        INFO_PRINT("Frame interval set to %d/%d\n",
+                   streamparm.parm.capture.timeperframe.numerator,
+                   streamparm.parm.capture.timeperframe.denominator);
+    }
+}
+
+static void configure_controls(struct capture_device *dev, const struct capture_config *cfg) {
+    struct v4l2_control control;
+
+    for (int i = 0; i < cfg->n_controls; i++) {
+        if (cfg->fast_start) {
+            CLEAR(control);
+            control.id = cfg->controls[i].id;
+            if (0 == ioctl(dev->fd, VIDIOC_G_CTRL, &control) &&
+                control.value == cfg->controls[i].value)
+                continue;
+        }
+
+        CLEAR(control);
+        control.id = cfg->controls[i].id;
+        control.value = cfg->controls[i].value;
+        if (-1 == ioctl(dev->fd, VIDIOC_S_CTRL, &control)) {
+            fprintf(stderr, "VIDIOC_S_CTRL 0x%08x: %s\n", control.id, strerror(errno));
+        }
+    }
+}
+
+// Requests and maps the driver buffers. On a reopen the buffer table is
+// reused and the driver must give back as many buffers as before.
+static int map_buffers(struct capture_device *dev, const struct capture_config *cfg) {
+    struct v4l2_requestbuffers req;
+    struct v4l2_buffer buf;
+    unsigned int i;
+
+    // Request buffers
+    CLEAR(req);
+    req.count = cfg->n_buffers;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+
+    INFO_PRINT("Requesting buffers...\n");
+    if (-1 == ioctl(dev->fd, VIDIOC_REQBUFS, &req)) {
+        perror("VIDIOC_REQBUFS");
+        return -1;
+    }
+    INFO_PRINT("Buffers requested successfully\n");
+
+    if (!dev->buffers) {
+        dev->buffers = static_cast<buffer*>(calloc(req.count, sizeof(*dev->buffers)));
+        if (!dev->buffers) {
+            perror("Out of memory");
+            exit(EXIT_FAILURE);
+        }
+        dev->n_buffers = req.count;
+    } else if (req.count != dev->n_buffers) {
+        fprintf(stderr, "Driver returned %u buffers instead of %u\n", req.count, dev->n_buffers);
+        return -1;
+    }
+
+    for (i = 0; i < dev->n_buffers; ++i) {
+        CLEAR(buf);
+
+        buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory      = V4L2_MEMORY_MMAP;
+        buf.index       = i;
+
+        if (-1 == ioctl(dev->fd, VIDIOC_QUERYBUF, &buf)) {
+            perror("VIDIOC_QUERYBUF");
+            return -1;
+        }
+        INFO_PRINT("Buffer %d queried successfully\n", i);
+
+        dev->buffers[i].length = buf.length;
+        dev->buffers[i].start = mmap(NULL, buf.length,
+                      PROT_READ | PROT_WRITE, MAP_SHARED,
+                      dev->fd, buf.m.offset);
+
+        if (MAP_FAILED == dev->buffers[i].start) {
+            dev->buffers[i].start = NULL;
+            perror("mmap");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void unmap_buffers(struct capture_device *dev) {
+    for (unsigned int i = 0; i < dev->n_buffers; ++i) {
+        if (dev->buffers[i].start)
+            munmap(dev->buffers[i].start, dev->buffers[i].length);
+        dev->buffers[i].start = NULL;
+    }
+}
+
+// Opens the device node. The first open picks the fd; a reopen moves the
+// new file onto the same fd number, so poll sets and the metrics endpoint
+// that captured dev->fd keep working.
+static int open_device(struct capture_device *dev) {
+    int fd = open(dev->cfg->dev_name, O_RDWR | O_NONBLOCK, 0);
+    if (fd < 0)
+        return -1;
+    if (dev->fd < 0) {
+        dev->fd = fd;
+    } else {
+        dup2(fd, dev->fd);
+        close(fd);
+    }
+    return 0;
+}
+
+static int configure_device(struct capture_device *dev) {
+    // Check if the device supports video capture
+    v4l2_capability cap;
+    if (-1 == ioctl(dev->fd, VIDIOC_QUERYCAP, &cap)) {
+        perror("VIDIOC_QUERYCAP");
+        return -1;
+    }
+
+    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
+        fprintf(stderr, "The device does not support video capture\n");
+        return -1;
+    }
+
+    INFO_PRINT("Device capabilities: %08x\n", cap.capabilities);
+
+    if (configure_format(dev, dev->cfg))
+        return -1;
+    configure_frame_interval(dev, dev->cfg);
+    configure_controls(dev, dev->cfg);
+    return map_buffers(dev, dev->cfg);
+}
+
+static int start_stream(struct capture_device *dev) {
+    struct v4l2_buffer buf;
+    enum v4l2_buf_type type;
+    unsigned int queued = 0;
+
+    // Buffers the program still holds are queued when they are handed back.
+    for (unsigned int i = 0; i < dev->n_buffers; ++i) {
+        if (dev->buffers[i].held)
+            continue;
+        CLEAR(buf);
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = i;
+
+        if (-1 == ioctl(dev->fd, VIDIOC_QBUF, &buf)) {
+            perror("VIDIOC_QBUF");
+            return -1;
+        }
+        queued++;
+    }
+    INFO_PRINT("Queued %u buffers\n", queued);
+
+    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    INFO_PRINT("Starting stream...\n");
+    if (-1 == ioctl(dev->fd, VIDIOC_STREAMON, &type)) {
+        perror("VIDIOC_STREAMON");
+        return -1;
+    }
+    INFO_PRINT("Stream started successfully\n");
+
+    dev->fault = CAPTURE_OK;
+    dev->error_run = 0;
+    dev->stalled_ms = 0;
+    dev->sequence_valid = 0;
+    return 0;
+}
+
+void capture_open(struct capture_device *dev, const struct capture_config *cfg) {
+    memset(dev, 0, sizeof(*dev));
+    dev->fd = -1;
+    dev->cfg = cfg;
+    pthread_mutex_init(&dev->lock, NULL);
+    pthread_cond_init(&dev->returned, NULL);
+
+    INFO_PRINT("Opening device: %s\n", cfg->dev_name);
+    if (-1 == open_device(dev)) {
+        perror("Cannot open device");
+        exit(EXIT_FAILURE);
+    }
+    INFO_PRINT("Device opened successfully\n");
+
+    if (configure_device(dev)) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+void capture_start(struct capture_device *dev) {
+    if (start_stream(dev)) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Frame accounting for the metrics endpoint: drops show up as gaps in
+// buf.sequence.
+static void count_frame(struct capture_device *dev, const struct v4l2_buffer *buf) {
+    metrics_add(METRIC_FRAMES_DEQUEUED, 1);
+    if (dev->sequence_valid && buf->sequence > dev->next_sequence)
+        metrics_add(METRIC_FRAMES_DROPPED, buf->sequence - dev->next_sequence);
+    dev->next_sequence = buf->sequence + 1;
+    dev->sequence_valid = 1;
+
+    if (buf->flags & V4L2_BUF_FLAG_ERROR)
+        metrics_add(METRIC_FRAMES_ERRORED, 1);
+    else
+        metrics_frame_stats((const uint16_t *)dev->buffers[buf->index].start, buf->bytesused / 2);
+}
+
+static enum capture_fault classify(int err) {
+    return err == ENODEV ? CAPTURE_FAULT_GONE : CAPTURE_FAULT_IO;
+}
+
+// Faults are raised by the capture thread and by requeueing workers; the
+// first one sticks until the recovery clears it.
+void capture_set_fault(struct capture_device *dev, enum capture_fault fault) {
+    pthread_mutex_lock(&dev->lock);
+    if (!dev->fault)
+        dev->fault = fault;
+    pthread_cond_broadcast(&dev->returned);
+    pthread_mutex_unlock(&dev->lock);
+}
+
+// Waits up to timeout_ms for a filled buffer. Returns 1 with *buf filled,
+// 0 on timeout and -1 once the stream has failed: dev->fault says why and
+// capture_recover() gets it streaming again.
+int capture_dequeue(struct capture_device *dev, struct v4l2_buffer *buf, int timeout_ms) {
+    fd_set fds;
+    struct timeval tv;
+    struct metrics_timer timer;
+    int r;
+
+    if (dev->error_run >= CAPTURE_MAX_ERROR_RUN)
+        capture_set_fault(dev, CAPTURE_FAULT_ERRORS);
+    if (__atomic_load_n(&dev->fault, __ATOMIC_RELAXED))
+        return -1;
+
+    metrics_timer_start(&timer);
+    for (;;) {
+        FD_ZERO(&fds);
+        FD_SET(dev->fd, &fds);
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+        r = select(dev->fd + 1, &fds, NULL, NULL, &tv);
+        if (-1 == r) {
+            if (errno == EINTR)
+                continue;
+            perror("select");
+            capture_set_fault(dev, CAPTURE_FAULT_IO);
+            return -1;
+        }
+        if (0 == r) {
+            metrics_add(METRIC_DEQUEUE_TIMEOUTS, 1);
+            dev->stalled_ms += timeout_ms;
+            if (dev->stalled_ms > dev->cfg->timeout_s * 1000) {
+                capture_set_fault(dev, CAPTURE_FAULT_STALL);
+                return -1;
+            }
+            return 0;
+        }
+
+        CLEAR(*buf);
+        buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf->memory = V4L2_MEMORY_MMAP;
+
+        pthread_mutex_lock(&dev->lock);
+        if (-1 == ioctl(dev->fd, VIDIOC_DQBUF, buf)) {
+            int err = errno;
+            pthread_mutex_unlock(&dev->lock);
+            if (err == EAGAIN)
+                continue;
+            fprintf(stderr, "VIDIOC_DQBUF: %s\n", strerror(err));
+            capture_set_fault(dev, classify(err));
+            return -1;
+        }
+        dev->buffers[buf->index].held = 1;
+        dev->n_held++;
+        pthread_mutex_unlock(&dev->lock);
+
+        metrics_timer_stop(&timer, STAGE_DEQUEUE);
+        dev->stalled_ms = 0;
+        if (buf->flags & V4L2_BUF_FLAG_ERROR)
+            dev->error_run++;
+        else
+            dev->error_run = 0;
+        count_frame(dev, buf);
+        return 1;
+    }
+}
+
+// Hands a buffer back to the driver; safe from any thread. After a fault
+// the buffer is only marked free, and the recovery queues it again.
+void capture_requeue(struct capture_device *dev, struct v4l2_buffer *buf) {
+    pthread_mutex_lock(&dev->lock);
+    dev->buffers[buf->index].held = 0;
+    dev->n_held--;
+    if (!dev->fault && -1 == ioctl(dev->fd, VIDIOC_QBUF, buf)) {
+        int err = errno;
+        fprintf(stderr, "VIDIOC_QBUF: %s\n", strerror(err));
+        dev->fault = classify(err);
+    }
+    if (dev->fault)
+        pthread_cond_broadcast(&dev->returned);
+    pthread_mutex_unlock(&dev->lock);
+}
+
+const char *capture_fault_name(enum capture_fault fault) {
+    switch (fault) {
+    case CAPTURE_OK:            return "none";
+    case CAPTURE_FAULT_IO:      return "I/O error";
+    case CAPTURE_FAULT_GONE:    return "device gone";
+    case CAPTURE_FAULT_ERRORS:  return "corrupt frames";
+    case CAPTURE_FAULT_STALL:   return "no frames";
+    }
+    return "unknown";
+}
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// STREAMOFF returns every queued buffer to the program, so the restart
+// queues all buffers nobody holds and streams again on the same mappings.
+static int restart_stream(struct capture_device *dev) {
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int rc = -1;
+
+    pthread_mutex_lock(&dev->lock);
+    if (-1 == ioctl(dev->fd, VIDIOC_STREAMOFF, &type))
+        perror("VIDIOC_STREAMOFF");
+    else
+        rc = start_stream(dev);
+    pthread_mutex_unlock(&dev->lock);
+    return rc;
+}
+
+// The kernel buffers belong to the open file, and the file stays open as
+// long as any buffer is mapped. So all buffers must come back and be
+// unmapped before the old file can be closed and the device reopened.
+static int reopen_device(struct capture_device *dev, double deadline_ms, int *attempts) {
+    struct v4l2_format old = dev->fmt;
+
+    pthread_mutex_lock(&dev->lock);
+    while (dev->n_held > 0)
+        pthread_cond_wait(&dev->returned, &dev->lock);
+    unmap_buffers(dev);
+
+    // Close the old file but keep its fd number reserved: a device that
+    // re-enumerates only gets its old node back once the last user is gone.
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd >= 0) {
+        dup2(null_fd, dev->fd);
+        close(null_fd);
+    }
+
+    int rc = -1;
+    while (rc && now_ms() < deadline_ms) {
+        if (-1 == open_device(dev)) {
+            usleep(100 * 1000);
+            continue;
+        }
+        (*attempts)++;
+        if (configure_device(dev) == 0 &&
+            dev->fmt.fmt.pix.width == old.fmt.pix.width &&
+            dev->fmt.fmt.pix.height == old.fmt.pix.height &&
+            dev->fmt.fmt.pix.pixelformat == old.fmt.pix.pixelformat &&
+            start_stream(dev) == 0) {
+            rc = 0;
+        } else {
+            unmap_buffers(dev);
+            usleep(100 * 1000);
+        }
+    }
+    pthread_mutex_unlock(&dev->lock);
+    return rc;
+}
+
+// Gets a failed stream going again: first STREAMOFF/STREAMON on the open
+// device, then a full close and reopen, retried for --recovery-timeout
+// seconds. Returns 0 once frames can be dequeued again, -1 if the device
+// did not come back; the caller then shuts down normally.
+int capture_recover(struct capture_device *dev) {
+    const struct capture_config *cfg = dev->cfg;
+    enum capture_fault fault = dev->fault;
+    struct metrics_timer timer;
+    double start = now_ms();
+    int attempts = 0;
+
+    fprintf(stderr, "Stream failed: %s\n", capture_fault_name(fault));
+    if (cfg->recovery_timeout_s == 0)
+        return -1;
+
+    metrics_add(METRIC_RECOVERIES, 1);
+    metrics_timer_start(&timer);
+    if (fault != CAPTURE_FAULT_GONE && restart_stream(dev) == 0) {
+        metrics_timer_stop(&timer, STAGE_RECOVERY);
+        fprintf(stderr, "Stream restarted in %.1f ms\n", now_ms() - start);
+        return 0;
+    }
+
+    if (reopen_device(dev, start + cfg->recovery_timeout_s * 1e3, &attempts) == 0) {
+        metrics_timer_stop(&timer, STAGE_RECOVERY);
+        fprintf(stderr, "Device reopened in %.1f ms (%d attempts)\n", now_ms() - start, attempts);
+        return 0;
+    }
+    fprintf(stderr, "Device did not recover within %d s\n", cfg->recovery_timeout_s);
+    return -1;
+}
+
+static void report_stall(struct capture_device *dev) {
+    // Check stream status
+    v4l2_input input;
+    CLEAR(input);
+    if (-1 == ioctl(dev->fd, VIDIOC_G_INPUT, &input.index)) {
+        perror("VIDIOC_G_INPUT");
+    } else if (-1 == ioctl(dev->fd, VIDIOC_ENUMINPUT, &input)) {
+        perror("VIDIOC_ENUMINPUT");
+    } else {
+        INFO_PRINT("Current input status: 0x%08X\n", input.status);
+    }
+}
+
+// Returns the first usable frame after STREAMON. Instead of sleeping for a
+// fixed time, frames flagged as errored or empty are handed straight back
+// to the driver, as are the first skip_frames good ones (e.g. to let auto
+// exposure settle). Without --fast-start the historical settle delay still
+// applies. Returns -1 if no frame arrives.
+int capture_first_frame(struct capture_device *dev, const struct capture_config *cfg,
+                        struct v4l2_buffer *buf) {
+    int skipped = 0;
+
+    if (!cfg->fast_start && cfg->settle_ms > 0)
+        usleep(cfg->settle_ms * 1000);
+
+    for (int attempt = 0; attempt < 5; ) {
+        INFO_PRINT("Attempt %d: Waiting for frame (timeout: %d seconds)...\n", attempt + 1, cfg->timeout_s);
+        int r = capture_dequeue(dev, buf, cfg->timeout_s * 1000);
+        if (r < 0) {
+            if (capture_recover(dev))
+                return -1;
+            attempt++;
+            continue;
+        }
+        if (!r) {
+            fprintf(stderr, "select timeout\n");
+            report_stall(dev);
+            attempt++;
+            continue;
+        }
+
+        if ((buf->flags & V4L2_BUF_FLAG_ERROR) || buf->bytesused == 0) {
+            INFO_PRINT("Discarding invalid frame %u\n", buf->sequence);
+            capture_requeue(dev, buf);
+            continue;
+        }
+        if (skipped < cfg->skip_frames) {
+            skipped++;
+            capture_requeue(dev, buf);
+            continue;
+        }
+
+        INFO_PRINT("Frame is ready\n");
+        return 0;
+    }
+
+    fprintf(stderr, "No frame after 5 attempts\n");
+    return -1;
+}
+
+void capture_stop(struct capture_device *dev) {
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    INFO_PRINT("Stopping stream...\n");
+    // A failed device is still unmapped and closed.
+    if (-1 == ioctl(dev->fd, VIDIOC_STREAMOFF, &type)) {
+        if (!dev->fault)
+            perror("VIDIOC_STREAMOFF");
+    } else {
+        INFO_PRINT("Stream stopped successfully\n");
+    }
+
+    unmap_buffers(dev);
+    free(dev->buffers);
+    dev->buffers = NULL;
+
+    close(dev->fd);
+    dev->fd = -1;
+    pthread_mutex_destroy(&dev->lock);
+    pthread_cond_destroy(&dev->returned);
+}
+
+// Milliseconds since this process was started by the kernel, so that
+// time-to-first-frame includes exec and dynamic loading, not just main().
+double capture_process_age_ms(void) {
+    char stat[1024];
+    unsigned long long start_ticks;
+    struct timespec now;
+
+    FILE *fp = fopen("/proc/self/stat", "r");
+    if (!fp)
+        return -1;
+    size_t n = fread(stat, 1, sizeof(stat) - 1, fp);
+    fclose(fp);
+    stat[n] = '\0';
+
+    // Field 22 (starttime); skip past the parenthesised comm first since
+    // it may contain spaces.
+    char *p = strrchr(stat, ')');
+    if (!p)
+        return -1;
+    for (int field = 2; field < 22 && p; field++)
+        p = strchr(p + 1, ' ');
+    if (!p || sscanf(p + 1, "%llu", &start_ticks) != 1)
+        return -1;
+
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    double now_ms = now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+    return now_ms - start_ticks * 1e3 / sysconf(_SC_CLK_TCK);
+}
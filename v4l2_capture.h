@@ -0,0 +1,85 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef V4L2_CAPTURE_H
+#define V4L2_CAPTURE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/videodev2.h>
+#include "capture_config.h"
+
+#define CLEAR(x) memset(&(x), 0, sizeof(x))
+
+// Consecutive V4L2_BUF_FLAG_ERROR frames after which the stream counts as
+// failed. A stream also fails after --timeout seconds without a frame.
+#define CAPTURE_MAX_ERROR_RUN   8
+
+struct buffer {
+    void   *start;
+    size_t length;
+    int    held;        // dequeued and not yet handed back
+};
+
+enum capture_fault {
+    CAPTURE_OK,
+    CAPTURE_FAULT_IO,           // EIO or another ioctl failure
+    CAPTURE_FAULT_GONE,         // ENODEV: the device went away
+    CAPTURE_FAULT_ERRORS,       // a run of V4L2_BUF_FLAG_ERROR frames
+    CAPTURE_FAULT_STALL,        // no frames for the --timeout period
+};
+
+// An open, configured and mmapped capture device. Setup failures are fatal
+// (perror + exit), as they always were in main(). Failures once streaming
+// are not: capture_dequeue() reports them and capture_recover() restarts
+// the stream, or closes and reopens the device, with the same buffer count
+// and the same fd number.
+struct capture_device {
+    int                 fd;
+    const struct capture_config *cfg;
+    struct v4l2_format  fmt;
+    struct buffer       *buffers;
+    unsigned int        n_buffers;
+    uint32_t            next_sequence;  // expected buf.sequence, for drop counts
+    int                 sequence_valid;
+
+    // Buffer ownership, shared with the threads that requeue buffers.
+    pthread_mutex_t     lock;
+    pthread_cond_t      returned;
+    int                 n_held;
+    enum capture_fault  fault;
+    int                 error_run;
+    int                 stalled_ms;
+};
+
+void   capture_open(struct capture_device *dev, const struct capture_config *cfg);
+void   capture_start(struct capture_device *dev);
+int    capture_dequeue(struct capture_device *dev, struct v4l2_buffer *buf, int timeout_ms);
+void   capture_requeue(struct capture_device *dev, struct v4l2_buffer *buf);
+int    capture_recover(struct capture_device *dev);
+// For callers that poll dev->fd themselves and notice a stall on their own.
+void   capture_set_fault(struct capture_device *dev, enum capture_fault fault);
+int    capture_first_frame(struct capture_device *dev, const struct capture_config *cfg,
+                           struct v4l2_buffer *buf);
+void   capture_stop(struct capture_device *dev);
+const char *capture_fault_name(enum capture_fault fault);
+double capture_process_age_ms(void);
+
+#endif
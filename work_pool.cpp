@@ -0,0 +1,183 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdio.h>
+#include <string.h>
+#include "work_pool.h"
+
+#define QUEUE_MASK (WORK_QUEUE_SIZE - 1)
+
+static int queue_push(struct work_queue *q, const struct work_item *item) {
+    int ok = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail - q->head < WORK_QUEUE_SIZE) {
+        q->items[q->tail & QUEUE_MASK] = *item;
+        q->tail++;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+// The owner takes the oldest item so frames are started in dequeue order.
+static int queue_pop_head(struct work_queue *q, struct work_item *item) {
+    int ok = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->head != q->tail) {
+        *item = q->items[q->head & QUEUE_MASK];
+        q->head++;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+// Thieves take from the other end to stay out of the owner's way.
+static int queue_pop_tail(struct work_queue *q, struct work_item *item) {
+    int ok = 0;
+    pthread_mutex_lock(&q->lock);
+    if (q->head != q->tail) {
+        q->tail--;
+        *item = q->items[q->tail & QUEUE_MASK];
+        ok = 1;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return ok;
+}
+
+static int find_work(struct work_pool *pool, int self, struct work_item *item) {
+    if (queue_pop_head(&pool->queues[self], item))
+        return 1;
+    for (int i = 1; i < pool->n_threads; i++) {
+        int victim = (self + i) % pool->n_threads;
+        if (queue_pop_tail(&pool->queues[victim], item))
+            return 1;
+    }
+    return 0;
+}
+
+static void *worker_main(void *p) {
+    struct work_pool_worker *arg = (struct work_pool_worker *)p;
+    struct work_pool *pool = arg->pool;
+    struct work_item item;
+
+    for (;;) {
+        if (find_work(pool, arg->index, &item)) {
+            pthread_mutex_lock(&pool->lock);
+            pool->pending--;
+            pool->active++;
+            pthread_mutex_unlock(&pool->lock);
+
+            item.fn(item.arg, arg->index);
+
+            pthread_mutex_lock(&pool->lock);
+            pool->active--;
+            if (pool->pending == 0 && pool->active == 0)
+                pthread_cond_broadcast(&pool->all_idle);
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->pending == 0 && !pool->stop)
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        int stop = pool->stop && pool->pending == 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop)
+            break;
+    }
+    return NULL;
+}
+
+int work_pool_init(struct work_pool *pool, int n_threads) {
+    memset(pool, 0, sizeof(*pool));
+    if (n_threads < 1)
+        n_threads = 1;
+    if (n_threads > WORK_POOL_MAX_THREADS)
+        n_threads = WORK_POOL_MAX_THREADS;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->all_idle, NULL);
+    for (int i = 0; i < WORK_POOL_MAX_THREADS; i++)
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+
+    pool->n_threads = n_threads;
+    for (int i = 0; i < n_threads; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        int err = pthread_create(&pool->threads[i], NULL, worker_main, &pool->workers[i]);
+        if (err) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(err));
+            pool->n_threads = i;
+            work_pool_destroy(pool);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int work_pool_submit(struct work_pool *pool, void (*fn)(void *arg, int worker), void *arg) {
+    struct work_item item;
+    item.fn = fn;
+    item.arg = arg;
+
+    // Count the item before it becomes visible so a worker that grabs it
+    // straight away never sees pending go negative.
+    pthread_mutex_lock(&pool->lock);
+    pool->pending++;
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->n_threads; i++) {
+        unsigned int q = __atomic_fetch_add(&pool->next_queue, 1, __ATOMIC_RELAXED) % pool->n_threads;
+        if (queue_push(&pool->queues[q], &item)) {
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_signal(&pool->work_ready);
+            pthread_mutex_unlock(&pool->lock);
+            return 0;
+        }
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->pending--;
+    pthread_mutex_unlock(&pool->lock);
+    return -1;
+}
+
+void work_pool_wait(struct work_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0 || pool->active > 0)
+        pthread_cond_wait(&pool->all_idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void work_pool_destroy(struct work_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->n_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+    for (int i = 0; i < WORK_POOL_MAX_THREADS; i++)
+        pthread_mutex_destroy(&pool->queues[i].lock);
+    pthread_cond_destroy(&pool->all_idle);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_mutex_destroy(&pool->lock);
+}
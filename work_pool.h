@@ -0,0 +1,70 @@
+// MIT License
+// Copyright (c) [2024] [Oren Collaco]
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#include <pthread.h>
+
+#define WORK_POOL_MAX_THREADS   16
+#define WORK_QUEUE_SIZE         64      // per-thread deque slots, power of two
+
+// Fixed-capacity work-stealing thread pool. Each worker owns a deque that
+// submissions are spread across round-robin; a worker drains its own deque
+// oldest-first and, when empty, steals the newest item from a sibling.
+// Deques are plain rings, so submitting and running work never allocates.
+struct work_item {
+    void (*fn)(void *arg, int worker);
+    void *arg;
+};
+
+struct work_queue {
+    pthread_mutex_t  lock;
+    struct work_item items[WORK_QUEUE_SIZE];
+    unsigned int     head;
+    unsigned int     tail;
+};
+
+struct work_pool;
+
+struct work_pool_worker {
+    struct work_pool *pool;
+    int              index;
+};
+
+struct work_pool {
+    int                     n_threads;
+    pthread_t               threads[WORK_POOL_MAX_THREADS];
+    struct work_pool_worker workers[WORK_POOL_MAX_THREADS];
+    struct work_queue       queues[WORK_POOL_MAX_THREADS];
+    pthread_mutex_t         lock;
+    pthread_cond_t          work_ready;
+    pthread_cond_t          all_idle;
+    int                     pending;    // submitted, not yet picked up
+    int                     active;     // currently running
+    unsigned int            next_queue;
+    int                     stop;
+};
+
+int  work_pool_init(struct work_pool *pool, int n_threads);
+int  work_pool_submit(struct work_pool *pool, void (*fn)(void *arg, int worker), void *arg);
+void work_pool_wait(struct work_pool *pool);
+void work_pool_destroy(struct work_pool *pool);
+
+#endif